@@ -1,10 +1,27 @@
 #include "aout.h"
 #include <assert.h>
 #include <ctype.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	undef LOBYTE		// windows.h has its own definitions
+#	undef HIBYTE
+#	include <windows.h>
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
 
 //
-ObjectFile::ObjectFile()
+ObjectFile::ObjectFile(Arena *arena) :
+	text_segment(arena), data_segment(arena), textRelocs(arena), dataRelocs(arena),
+	symbolTable(arena), stringTable(arena), symbolHash(arena), stringHash(arena)
 {
+	format = FORMAT_AOUT;
 	clear();
 }
 
@@ -21,7 +38,7 @@ void ObjectFile::clear()
 	memset(&file_header, 0, sizeof(file_header));
 
 	// default to NMAGIC format?
-	file_header.a_magic = 263;
+	file_header.a_magic = AOUT_MAGIC;
 
 	text_segment.clear();
 	data_segment.clear();
@@ -30,20 +47,25 @@ void ObjectFile::clear()
 	dataRelocs.clear();
 
 	symbolTable.clear();
-	symbolLookup.clear();
-	codeSymbolRLookup.clear();
-	dataSymbolRLookup.clear();
-	bssSymbolRLookup.clear();
+	symbolHash.clear();
+	stringHash.clear();
+	stringCount = 0;
+
+	addrIndexed = false;
+	codeAddrIndex.clear();
+	dataAddrIndex.clear();
+	bssAddrIndex.clear();
 
 	stringTable.clear();
 
 	textBase = dataBase = bssBase = 0;
+	symbolsOnly = false;
 }
 
 // return the symbol at the given index
 SymbolEntity ObjectFile::symbolAt(size_t index)
 {
-	return symbolTable[index].second;
+	return symbolTable[index];
 }
 
 // find the symbol by name
@@ -59,55 +81,65 @@ bool ObjectFile::findSymbol(const std::string &name, SymbolEntity &sym)
 	return false;
 }
 
-// find a code symbol by address
-bool ObjectFile::findCodeSymbolByAddr(uint16_t addr, std::string &name)
+// build the address lookups from the current symbol values
+void ObjectFile::buildAddrIndexes()
 {
-	name = "<none>";
-	auto it = codeSymbolRLookup.find(addr);
-	if (it != codeSymbolRLookup.end())
+	addrIndexed = true;
+
+	codeAddrIndex.clear();
+	dataAddrIndex.clear();
+	bssAddrIndex.clear();
+
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
 	{
-		name = it->second;
-		return true;
+		if (it->type & SET_TEXT)
+			codeAddrIndex.add(it->value, it->nameOffset);
+		else if (it->type & SET_DATA)
+			dataAddrIndex.add(it->value, it->nameOffset);
+		else if (it->type & SET_BSS)
+			bssAddrIndex.add(it->value, it->nameOffset);
 	}
 
-	return false;
+	codeAddrIndex.sort();
+	dataAddrIndex.sort();
+	bssAddrIndex.sort();
 }
 
-// find a data symbol by address
-bool ObjectFile::findDataSymbolByAddr(uint16_t addr, std::string &name)
+// find a code symbol by address, returns nullptr if there is none
+const char *ObjectFile::findCodeSymbolByAddr(uint16_t addr)
 {
-	name = "<none>";
-	auto it = dataSymbolRLookup.find(addr);
-	if (it != dataSymbolRLookup.end())
-	{
-		name = it->second;
-		return true;
-	}
+	if (!addrIndexed)
+		buildAddrIndexes();
 
-	it = bssSymbolRLookup.find(addr);
-	if (it != bssSymbolRLookup.end())
-	{
-		name = it->second;
-		return true;
-	}
+	auto entry = codeAddrIndex.find(addr);
+	return entry ? &stringTable[entry->nameOffset] : nullptr;
+}
 
-	return false;
+// find a data symbol by address, returns nullptr if there is none
+const char *ObjectFile::findDataSymbolByAddr(uint16_t addr)
+{
+	if (!addrIndexed)
+		buildAddrIndexes();
+
+	auto entry = dataAddrIndex.find(addr);
+	if (!entry)
+		entry = bssAddrIndex.find(addr);
+
+	return entry ? &stringTable[entry->nameOffset] : nullptr;
 }
 
 // find nearst code symbol less than given address
-bool ObjectFile::findNearestCodeSymbolToAddr(uint16_t addr, std::string &name, uint16_t &symAddr)
+const char *ObjectFile::findNearestCodeSymbolToAddr(uint16_t addr, uint16_t &symAddr)
 {
-	auto it = codeSymbolRLookup.lower_bound(addr);
-	if (it == codeSymbolRLookup.end())
-		return false;
-
-	if (it->first != addr && it != codeSymbolRLookup.begin())
-		it--;
+	if (!addrIndexed)
+		buildAddrIndexes();
 
-	symAddr = (uint16_t)it->first;
-	name = it->second;
+	auto entry = codeAddrIndex.findNearest(addr);
+	if (!entry)
+		return nullptr;
 
-	return true;
+	symAddr = (uint16_t)entry->addr;
+	return &stringTable[entry->nameOffset];
 }
 
 //
@@ -116,12 +148,40 @@ void ObjectFile::updateBssSymbols()
 	// Note: we must update the symbolTable addresses so that BSS 
 	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
 	{
-		if (it->second.type & SET_BSS)
-			it->second.value += getBssBase();
+		if (it->type & SET_BSS)
+			it->value += getBssBase();
 	}
+
+	addrIndexed = false;
 }
 
-//
+// Size this module to hold the linked image of all the modules, once the
+// segment bases are assigned, so that concat() copies each module straight
+// to its final offset.
+void ObjectFile::beginConcat(const std::vector<ObjectFile*> &modules)
+{
+	auto last = modules.back();
+
+	text_segment.resize(last->getTextBase() + last->getTextSize() - textBase);
+	data_segment.resize(last->getDataBase() + last->getDataSize() - dataBase);
+
+	size_t relocs = textRelocs.size();
+	size_t symbols = symbolTable.size();
+
+	for (auto it = modules.begin(); it != modules.end(); it++)
+	{
+		if (*it == this)
+			continue;
+
+		relocs += (*it)->textRelocs.size();
+		symbols += (*it)->symbolTable.size();
+	}
+
+	textRelocs.reserve(relocs);
+	symbolTable.reserve(symbols);
+}
+
+// merge a module into this one, the rhs module can be freed afterwards
 void ObjectFile::concat(ObjectFile *rhs)
 {
 	// combine headers
@@ -131,61 +191,121 @@ void ObjectFile::concat(ObjectFile *rhs)
 	file_header.a_drsize	+= rhs->file_header.a_drsize;
 	file_header.a_trsize	+= rhs->file_header.a_trsize;
 
-	// merge contents of text and data segments
-	text_segment.insert(text_segment.end(), rhs->text_segment.begin(), rhs->text_segment.end());
-	data_segment.insert(data_segment.end(), rhs->data_segment.begin(), rhs->data_segment.end());
+	// copy the text and data segments to their offsets in the linked image
+	size_t textOffset = rhs->getTextBase() - getTextBase();
+	if (text_segment.size() < textOffset + rhs->text_segment.size())
+		text_segment.resize(textOffset + rhs->text_segment.size());
+
+	size_t dataOffset = rhs->getDataBase() - getDataBase();
+	if (data_segment.size() < dataOffset + rhs->data_segment.size())
+		data_segment.resize(dataOffset + rhs->data_segment.size());
+
+	std::copy(rhs->text_segment.begin(), rhs->text_segment.end(), text_segment.begin() + textOffset);
+	std::copy(rhs->data_segment.begin(), rhs->data_segment.end(), data_segment.begin() + dataOffset);
 
 	// Note: the bss is all zero so no merging of contents is required
 
-	// merge the symbols
-	for (auto it = rhs->symbolTable.begin(); it != rhs->symbolTable.end(); it++)
+	mergeSymbols(rhs);
+	rhs->appendLinkedRelocs(textRelocs, dataRelocs);
+}
+
+// add the symbols a module defines, or resolves, to this one
+void ObjectFile::mergeSymbols(ObjectFile *rhs)
+{
+	for (size_t i = 0; i < rhs->symbolTable.size(); i++)
 	{
+		auto it = &rhs->symbolTable[i];
+		auto name = rhs->symbolName(i);
+		auto len = strlen(name);
+
 		// see if the rhs symbol exists in this module
-		SymbolEntity se;
-		if (findSymbol(it->first, se) && (se.type & SET_UNDEFINED))
+		auto index = findSymbolIndex(name, len, hashName(name, len));
+		if (index != UINT_MAX && (symbolTable[index].type & SET_UNDEFINED))
 		{
-			auto index = indexOfSymbol(it->first);
-			assert(index != UINT_MAX);
-
-			auto sym = &symbolTable[index].second;
+			auto sym = &symbolTable[index];
 
 			// if it does and it is defined in rhs module, then update it
-			sym->type = it->second.type;
+			sym->type = it->type;
 
 			if (sym->type & SET_TEXT)
-				sym->value = it->second.value + rhs->getTextBase();
+				sym->value = it->value + rhs->getTextBase();
 			else if (sym->type & SET_DATA)
-				sym->value = it->second.value + rhs->getDataBase();
+				sym->value = it->value + rhs->getDataBase();
 			else if (sym->type & SET_BSS)
-				sym->value = it->second.value + rhs->getBssBase();
+				sym->value = it->value + rhs->getBssBase();
 		}
 		else
 		{
 			// if not and it is defined in rhs module, then add it
-			if (!(it->second.type & SET_UNDEFINED))
+			if (!(it->type & SET_UNDEFINED))
 			{
-				auto sym = it->second;
-				if (it->second.type & SET_TEXT)
-					sym.value = it->second.value + rhs->getTextBase();
-				else if (it->second.type & SET_DATA)
-					sym.value = it->second.value + rhs->getDataBase();
-				else if (it->second.type & SET_BSS)
-					sym.value = it->second.value + rhs->getBssBase();
+				auto sym = *it;
+				if (it->type & SET_TEXT)
+					sym.value = it->value + rhs->getTextBase();
+				else if (it->type & SET_DATA)
+					sym.value = it->value + rhs->getDataBase();
+				else if (it->type & SET_BSS)
+					sym.value = it->value + rhs->getBssBase();
 				else
 					assert(false);
 
-				addSymbol(it->first, sym);
+				addSymbol(name, len, sym);
 			}
 		}
 	}
 
+	addrIndexed = false;
+}
+
+// add the segment relocations of this module to those of a linked image
+void ObjectFile::appendLinkedRelocs(Relocations &text, Relocations &data) const
+{
+	appendLinkedRelocs(textRelocs, text);
+	appendLinkedRelocs(dataRelocs, data);
+}
+
+// merge relocations updating addresses
+void ObjectFile::appendLinkedRelocs(const Relocations &from, Relocations &relocs) const
+{
+	for (auto it = from.begin(); it != from.end(); it++)
+	{
+		if (it->external)
+			continue;
+
+		auto re = *it;
+
+		if (it->index == SEG_TEXT)
+			re.address += getTextBase();
+		else if (it->index == SEG_DATA)
+			re.address += getDataBase();
+		else if (it->index == SEG_BSS)
+			re.address += getBssBase();
+		else
+			assert(false);
+
+		relocs.push_back(re);
+	}
+}
+
+// finish merging modules, the external references this module made are
+// now resolved to the segments that define them
+void ObjectFile::endConcat()
+{
+	resolveExternals(textRelocs);
+	resolveExternals(dataRelocs);
+}
+
+// turn external relocations into segment ones once this module's symbols
+// are resolved
+void ObjectFile::resolveExternals(Relocations &relocs) const
+{
 	// fixup locations in the lhs module
-	for (auto it = textRelocs.begin(); it != textRelocs.end(); it++)
+	for (auto it = relocs.begin(); it != relocs.end(); it++)
 	{
 		if (it->external)
 		{
 			// look up the symbol
-			auto sym = &symbolTable[it->index].second;
+			auto sym = &symbolTable[it->index];
 
 			// if the symbol has been resolved for this module, fixup the address, index and external flags
 			if (!(sym->type & SET_EXTERN))
@@ -204,93 +324,42 @@ void ObjectFile::concat(ObjectFile *rhs)
 			}
 		}
 	}
+}
 
-	// merge relocations updating addresses
-	for (auto it = rhs->textRelocs.begin(); it != rhs->textRelocs.end(); it++)
-	{
-		if (it->external)
-			continue;
-
-		auto re = *it;
-
-		if (it->index == SEG_TEXT)
-			re.address += rhs->getTextBase();
-		else if (it->index == SEG_DATA)
-			re.address += rhs->getDataBase();
-		else if (it->index == SEG_BSS)
-			re.address += rhs->getBssBase();
-		else
-			assert(false);
-
-		textRelocs.push_back(re);
-	}
+// patch the text and data segments with the addresses of the symbols and
+// segments they refer to
+bool ObjectFile::relocate(const GlobalSymbolTable &symbols)
+{
+	return relocateSegment(textRelocs, text_segment, symbols) && relocateSegment(dataRelocs, data_segment, symbols);
 }
 
 //
-bool ObjectFile::relocate(const std::vector<ObjectFile*> &modules)
+bool ObjectFile::relocateSegment(const Relocations &relocs, Segment &segment, const GlobalSymbolTable &symbols)
 {
-	// for each code segment relocation
-	for (auto it = textRelocs.begin(); it != textRelocs.end(); it++)
+	// for each segment relocation
+	for (auto it = relocs.begin(); it != relocs.end(); it++)
 	{
-		int iSymbolFound = 0;
-
 		if (it->external)
 		{
-			auto name = symbolTable[it->index].first;
-			auto sym = symbolTable[it->index].second;
-			assert(sym.type & SET_UNDEFINED);
+			auto name = symbolName(it->index);
+			assert(symbolTable[it->index].type & SET_UNDEFINED);
 
 			// find address of external symbol and patch it into this segment
-			SymbolEntity externSym;
-			for (auto moduleIter = modules.begin(); moduleIter != modules.end(); moduleIter++)
-			{
-				// look for the symbol in the module
-				auto module = (*moduleIter);
-				if (module->findSymbol(name, externSym))
-				{
-					// see if it is defined in this module
-					if (!(externSym.type & SET_UNDEFINED))
-					{
-						// it is defined in this module
-						if (externSym.type & SET_TEXT)
-						{
-							auto addr = module->getTextBase() + externSym.value;
-							text_segment[it->address] = LOBYTE(addr);
-							text_segment[it->address + 1] = HIBYTE(addr);
-							iSymbolFound++;
-						}
-						else if (externSym.type & SET_DATA)
-						{
-							auto addr = module->getDataBase() + externSym.value;
-							text_segment[it->address] = LOBYTE(addr);
-							text_segment[it->address + 1] = HIBYTE(addr);
-							iSymbolFound++;
-						}
-						else if (externSym.type & SET_BSS)
-						{
-							auto addr = module->getBssBase() + externSym.value;
-							text_segment[it->address] = LOBYTE(addr);
-							text_segment[it->address + 1] = HIBYTE(addr);
-							iSymbolFound++;
-						}
-						else
-						{
-							assert(false);
-						}
-					}
-				}
-			}
-
-			if (0 == iSymbolFound)
+			auto def = symbols.find(name);
+			if (!def)
 			{
-				fprintf(stderr, "Error: Symbol '%s' not found!\n", name.c_str());
+				fprintf(stderr, "Error: Symbol '%s' not found!\n", name);
 				return false;
 			}
-			else if (iSymbolFound > 1)
+			else if (def->count > 1)
 			{
-				fprintf(stderr, "Error: Symbol '%s' multiply defined!\n", name.c_str());
+				fprintf(stderr, "Error: Symbol '%s' multiply defined!\n", name);
 				return false;
 			}
+
+			auto addr = symbols.addressOf(*def);
+			segment[it->address] = LOBYTE(addr);
+			segment[it->address + 1] = HIBYTE(addr);
 		}
 		else
 		{
@@ -298,387 +367,2084 @@ bool ObjectFile::relocate(const std::vector<ObjectFile*> &modules)
 			uint32_t addr = 0;
 			if (it->index == SEG_TEXT)
 			{
-				addr = textBase + text_segment[it->address] + (text_segment[it->address + 1] << 8);
+				addr = textBase + segment[it->address] + (segment[it->address + 1] << 8);
 			}
 			else if (it->index == SEG_DATA)
 			{
-				addr = dataBase + text_segment[it->address] + (text_segment[it->address + 1] << 8);
+				addr = dataBase + segment[it->address] + (segment[it->address + 1] << 8);
 			}
 			else if (it->index == SEG_BSS)
 			{
-				addr = bssBase + text_segment[it->address] + (text_segment[it->address + 1] << 8);
+				addr = bssBase + segment[it->address] + (segment[it->address + 1] << 8);
 			}
 
-			// patch the address in code segment
-			text_segment[it->address] = LOBYTE(addr);
-			text_segment[it->address + 1] = HIBYTE(addr);
+			// patch the address in the segment
+			segment[it->address] = LOBYTE(addr);
+			segment[it->address + 1] = HIBYTE(addr);
 		}
 	}
 	
 	return true;
 }
 
-// write out the object file to the named file
-int ObjectFile::writeFile(const std::string &name)
+// The extents of the procedures in the text segment, in address order. A
+// PROC runs until the next one, code before the first PROC is an extent of
+// its own and a module without PROCs is a single extent.
+void ObjectFile::getProcExtents(std::vector<ProcExtent> &extents) const
 {
-	FILE *f = fopen(name.c_str(), "wb");
-	if (nullptr == f)
-		return EOF;
+	extents.clear();
 
-	auto result = writeFile(f);
-	fclose(f);
+	std::vector<uint32_t> starts(1, 0);
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
+	{
+		if ((it->type & SET_PROC) && !(it->type & SET_UNDEFINED))
+			starts.push_back(it->value);
+	}
 
-	filename = name;
+	std::sort(starts.begin(), starts.end());
+	starts.push_back(getTextSize());
 
-	return result;
+	// empty extents, like two PROCs in a row, don't take part
+	for (size_t i = 0; i + 1 < starts.size(); i++)
+	{
+		if (starts[i] < starts[i + 1] && starts[i + 1] <= getTextSize())
+		{
+			ProcExtent e = { starts[i], starts[i + 1] - starts[i] };
+			extents.push_back(e);
+		}
+	}
 }
 
-// write out the object file to the given stream
-int ObjectFile::writeFile(FILE *fptr)
+// Keep only the given extents of the text segment, which must be in address
+// order. The code is moved down over the dead extents, the text relocations,
+// text pointers and symbols are rebased and the symbols of dropped code are
+// removed. Returns the number of bytes removed.
+uint32_t ObjectFile::removeDeadCode(const std::vector<ProcExtent> &live)
 {
-	assert(fptr != nullptr);
-	if (fptr == nullptr)
-		return EOF;
+	uint32_t oldSize = text_segment.size();
 
-	// update the header
-	file_header.a_text		= text_segment.size();
-	file_header.a_data		= data_segment.size();
-	file_header.a_trsize	= textRelocs.size();
-	file_header.a_drsize	= dataRelocs.size();
-	file_header.a_syms		= symbolTable.size();
+	// the new offset of each live extent
+	std::vector<uint32_t> newStart;
+	Segment text(text_segment.get_allocator());
 
-	// write the header
-	auto result = fwrite(&file_header, sizeof(file_header), 1, fptr);
+	for (auto it = live.begin(); it != live.end(); it++)
+	{
+		newStart.push_back(text.size());
+		text.insert(text.end(), text_segment.begin() + it->start, text_segment.begin() + it->start + it->size);
+	}
 
-	// write the text segment
-	fwrite(text_segment.data(), text_segment.size(), 1, fptr);
+	// map an old text offset to its new one, UINT_MAX if it was dropped. The
+	// end of the segment stays valid if the last extent is kept.
+	auto rebase = [&](uint32_t offset) -> uint32_t {
+		auto it = std::upper_bound(live.begin(), live.end(), offset, [](uint32_t value, const ProcExtent &e) { return value < e.start; });
+		if (it != live.begin())
+		{
+			auto k = (it - live.begin()) - 1;
+			if (offset < live[k].start + live[k].size || (offset == oldSize && live[k].start + live[k].size == oldSize))
+				return newStart[k] + offset - live[k].start;
+		}
 
-	// write the data segment
-	fwrite(data_segment.data(), data_segment.size(), 1, fptr);
+		return UINT_MAX;
+	};
 
-	// write the text relocations
-	for (auto iter = textRelocs.begin(); iter != textRelocs.end(); iter++)
-	{
-		fwrite(&(*iter), sizeof(RelocationEntry), 1, fptr);
-	}
+	// rebase a text pointer stored in a segment
+	auto rebasePointer = [&](Segment &seg, uint32_t address) {
+		uint32_t offset = rebase(seg[address] + (seg[address + 1] << 8));
+		if (offset != UINT_MAX)
+		{
+			seg[address] = LOBYTE(offset);
+			seg[address + 1] = HIBYTE(offset);
+		}
+	};
 
-	// write the data relocations
-	for (auto iter = dataRelocs.begin(); iter != dataRelocs.end(); iter++)
+	// drop the symbols of removed code
+	std::vector<uint32_t> newIndex(symbolTable.size(), UINT_MAX);
+	SymbolTable symbols(symbolTable.get_allocator());
+
+	for (size_t i = 0; i < symbolTable.size(); i++)
 	{
-		fwrite(&(*iter), sizeof(RelocationEntry), 1, fptr);
+		auto se = symbolTable[i];
+		if ((se.type & SET_TEXT) && !(se.type & SET_UNDEFINED))
+		{
+			se.value = rebase(se.value);
+			if (se.value == UINT_MAX)
+				continue;
+		}
+
+		newIndex[i] = symbols.size();
+		symbols.push_back(se);
 	}
 
-	// write the symbol table
-	for (auto iter = symbolTable.begin(); iter != symbolTable.end(); iter++)
+	// relocations in removed code are dropped with it
+	Relocations relocs(textRelocs.get_allocator());
+	for (auto it = textRelocs.begin(); it != textRelocs.end(); it++)
 	{
-		auto se = (*iter).second;
-		fwrite(&se, sizeof(se), 1, fptr);
+		auto re = *it;
+		re.address = rebase(it->address);
+		if (re.address == UINT_MAX)
+			continue;
+
+		if (re.external)
+			re.index = newIndex[it->index];
+		else if (re.index == SEG_TEXT)
+			rebasePointer(text, re.address);
+
+		relocs.push_back(re);
 	}
 
-	// write the string table
-	for (size_t i = 0; i < stringTable.size(); i++)
+	for (auto it = dataRelocs.begin(); it != dataRelocs.end(); it++)
 	{
-		fputc(stringTable[i], fptr);
+		if (it->external)
+			it->index = newIndex[it->index];
+		else if (it->index == SEG_TEXT)
+			rebasePointer(data_segment, it->address);
 	}
 
-	return 0;
+	text_segment.swap(text);
+	textRelocs.swap(relocs);
+	symbolTable.swap(symbols);
+
+	rehashSymbols(symbolTable.size() * 2);
+	rehashStrings();
+	addrIndexed = false;
+
+	return oldSize - text_segment.size();
 }
 
-// read in the named object file
-int ObjectFile::readFile(const std::string &name)
+// Shorten the given branches, which must be in address order, wherever the
+// target is in reach of the 8-bit displacement. A branch is only shortened
+// within its PROC, so that removing dead code, which moves whole PROCs,
+// keeps the displacement valid, and it needs no relocation. Every branch
+// starts long and is shortened once its target is in reach, until none
+// changes, as shortening only brings targets closer. The code is then moved
+// down and the symbols, text relocations and text pointers are rebased.
+// Returns the number of bytes removed.
+uint32_t ObjectFile::relaxBranches(const std::vector<BranchSite> &sites)
 {
-	FILE *f = fopen(name.c_str(), "rb");
-	if (nullptr == f)
-		return EOF;
+	uint32_t oldSize = text_segment.size();
 
-	auto result = readFile(f);
-	if (result)
-		return EOF;
+	std::vector<ProcExtent> extents;
+	getProcExtents(extents);
 
-	fclose(f);
+	// the index of the extent an offset is in
+	auto extentOf = [&](uint32_t offset) -> size_t {
+		return std::upper_bound(extents.begin(), extents.end(), offset, [](uint32_t value, const ProcExtent &e) { return value < e.start; }) - extents.begin();
+	};
 
-	filename = name;
+	// the branches that may be shortened and their targets
+	std::vector<BranchSite> branches;
+	std::vector<uint32_t> targets;
 
-	return result;
-}
+	for (auto it = sites.begin(); it != sites.end(); it++)
+	{
+		if (it->offset + 3 > oldSize)
+			continue;
 
-// read an object file from the given stream
-int ObjectFile::readFile(FILE *fptr)
-{
-	assert(fptr != nullptr);
-	if (fptr == nullptr)
-		return EOF;
+		uint32_t target = text_segment[it->offset + 1] | (text_segment[it->offset + 2] << 8);
+		if (target < oldSize && extentOf(target) == extentOf(it->offset))
+		{
+			branches.push_back(*it);
+			targets.push_back(target);
+		}
+	}
 
-	clear();
+	// the offsets of the shortened branches in address order, each one
+	// drops the last byte of its operand
+	std::vector<uint32_t> shortened;
+	std::vector<bool> isShort(branches.size(), false);
 
-	// read the header
-	auto result = fread(&file_header, sizeof(file_header), 1, fptr);
-	if (result != 1)
-		return EOF;
+	auto rebase = [&](uint32_t offset) -> uint32_t {
+		auto removed = std::upper_bound(shortened.begin(), shortened.end(), offset, [](uint32_t value, uint32_t site) { return value < site + 3; }) - shortened.begin();
+		return offset - (uint32_t)removed;
+	};
 
-	// read the text segment
-	for (int i = 0; i < file_header.a_text; i++)
-	{
-		auto c = fgetc(fptr);
-		text_segment.push_back(c);
-	}
+	// the displacement of a branch in its short form
+	auto displacement = [&](size_t i) -> int {
+		int target = rebase(targets[i]);
+		if (!isShort[i] && targets[i] > branches[i].offset)
+			target--;
 
-	// read the data segment
-	for (int i = 0; i < file_header.a_data; i++)
-	{
-		auto c = fgetc(fptr);
-		data_segment.push_back(c);
-	}
+		return target - (int)(rebase(branches[i].offset) + 2);
+	};
 
-	// read the text relocations
-	for (int i = 0; i < file_header.a_trsize; i++)
+	for (bool changed = true; changed; )
 	{
-		RelocationEntry re;
+		changed = false;
 
-		fread(&re, sizeof(re), 1, fptr);
-		textRelocs.push_back(re);
-	}
+		for (size_t i = 0; i < branches.size(); i++)
+		{
+			if (isShort[i])
+				continue;
 
-	// read the data relocations
-	for (int i = 0; i < file_header.a_drsize; i++)
-	{
-		RelocationEntry re;
+			int disp = displacement(i);
+			if (disp >= -128 && disp <= 127)
+				isShort[i] = changed = true;
+		}
 
-		fread(&re, sizeof(re), 1, fptr);
-		dataRelocs.push_back(re);
+		shortened.clear();
+		for (size_t i = 0; i < branches.size(); i++)
+		{
+			if (isShort[i])
+				shortened.push_back(branches[i].offset);
+		}
 	}
 
-	// read the symbol table
-	std::vector<SymbolEntity> st;
-	for (int i = 0; i < file_header.a_syms; i++)
+	if (shortened.empty())
+		return 0;
+
+	// rebuild the text with the short branches
+	Segment text(text_segment.get_allocator());
+	uint32_t from = 0;
+
+	for (size_t i = 0; i < branches.size(); i++)
 	{
-		SymbolEntity se;
-		fread(&se, sizeof(se), 1, fptr);
-		st.push_back(se);
+		if (!isShort[i])
+			continue;
+
+		text.insert(text.end(), text_segment.begin() + from, text_segment.begin() + branches[i].offset);
+		text.push_back(branches[i].shortOp);
+		text.push_back((uint8_t)displacement(i));
+
+		from = branches[i].offset + 3;
 	}
 
-	// read the string table
-	char c = fgetc(fptr);
-	while (c != EOF)
+	text.insert(text.end(), text_segment.begin() + from, text_segment.end());
+
+	// rebase a text pointer stored in a segment
+	auto rebasePointer = [&](Segment &seg, uint32_t address) {
+		uint32_t offset = rebase(seg[address] + (seg[address + 1] << 8));
+		seg[address] = LOBYTE(offset);
+		seg[address + 1] = HIBYTE(offset);
+	};
+
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
 	{
-		stringTable.push_back(c);
-		c = fgetc(fptr);
+		if ((it->type & SET_TEXT) && !(it->type & SET_UNDEFINED))
+			it->value = rebase(it->value);
 	}
 
-	// read the symbols
-	for (int i = 0; i < file_header.a_syms; i++)
+	// the short branches no longer have a relocation
+	Relocations relocs(textRelocs.get_allocator());
+	for (auto it = textRelocs.begin(); it != textRelocs.end(); it++)
 	{
-		auto sym = st[i];
-		char *pStr = &(stringTable[sym.nameOffset]);
-		symbolTable.push_back(SymbolTable::value_type(pStr, sym));
+		if (it->address && std::binary_search(shortened.begin(), shortened.end(), it->address - 1))
+			continue;
+
+		auto re = *it;
+		re.address = rebase(it->address);
 
-		auto r1 = symbolLookup.insert(SymbolLookup::value_type(pStr, i));
-		assert(r1.second);
+		if (!re.external && re.index == SEG_TEXT)
+			rebasePointer(text, re.address);
 
-		if (sym.type & SET_TEXT)
-		{
-			auto result = codeSymbolRLookup.insert(SymbolRLookup::value_type(sym.value, pStr));
-			assert(result.second);
-		}
-		else if (sym.type & SET_DATA)
-		{
-			auto result = dataSymbolRLookup.insert(SymbolRLookup::value_type(sym.value, pStr));
-			assert(result.second);
-		}
-		else if (sym.type & SET_BSS)
-		{
-			auto result = bssSymbolRLookup.insert(SymbolRLookup::value_type(sym.value, pStr));
-			assert(result.second);
-		}
+		relocs.push_back(re);
 	}
 
-	return 0;
-}
+	for (auto it = dataRelocs.begin(); it != dataRelocs.end(); it++)
+	{
+		if (!it->external && it->index == SEG_TEXT)
+			rebasePointer(data_segment, it->address);
+	}
 
-// alloc space in bss segment and return its address
-uint32_t ObjectFile::allocBSS(size_t size)
-{
-	uint32_t addr = file_header.a_bss;
-	file_header.a_bss += size;
+	text_segment.swap(text);
+	textRelocs.swap(relocs);
+	addrIndexed = false;
 
-	return addr;
+	return oldSize - text_segment.size();
 }
 
-// alloc/assign byte to code segment and return its address
-uint32_t ObjectFile::addText(uint8_t item)
+// Replace the module at the given index of a linked image with a new build
+// of it that fits the module's slot, for an incremental link. The module
+// must be relocated and have the same defined symbols as the one it
+// replaces, and its text and data relocations replace the given ranges of
+// the image's. Returns the number of text relocations the module now has in
+// the image.
+size_t ObjectFile::replaceModule(uint32_t index, const ObjectFile &module, const GlobalSymbolTable &symbols, size_t firstReloc, size_t relocCount, size_t firstDataReloc, size_t dataRelocCount, uint32_t textSlot, uint32_t dataSlot, uint32_t oldBssSize)
 {
-	uint32_t addr = text_segment.size();
-		text_segment.push_back(item);
-	return addr;
-}
+	assert(module.getTextSize() <= textSlot && module.getDataSize() <= dataSlot);
 
-// alloc/assign data byte to data segment and return its address
-uint32_t ObjectFile::addData(uint8_t item)
-{
-	uint32_t addr = data_segment.size();
-		data_segment.push_back(item);
-	return addr;
-}
+	// copy the segments over the old ones, clearing the rest of the slots
+	auto text = text_segment.begin() + (module.getTextBase() - getTextBase());
+	std::fill(std::copy(module.text_segment.begin(), module.text_segment.end(), text), text + textSlot, 0);
 
-//
-void ObjectFile::addSymbol(const std::string &name, SymbolEntity &sym)
-{
-	auto it = symbolLookup.find(name);
+	auto data = data_segment.begin() + (module.getDataBase() - getDataBase());
+	std::fill(std::copy(module.data_segment.begin(), module.data_segment.end(), data), data + dataSlot, 0);
 
-	// if symbol already exists as an EXTERN, update it since it is now defined
-	if (it != symbolLookup.end())
-	{
-		symbolTable[it->second].second.type = sym.type;
-		symbolTable[it->second].second.value = sym.value;
-		return;
-	}
+	file_header.a_bss += module.getBssSize() - oldBssSize;
 
-	uint32_t offset = addString(name);
-	sym.nameOffset = offset;
+	// the first module's external relocations were resolved in place, the
+	// other modules only add their segment relocations
+	Relocations newTextRelocs, newDataRelocs;
+	if (0 == index)
+	{
+		auto resolve = [&](const Relocations &from, Relocations &to) {
+			for (auto it = from.begin(); it != from.end(); it++)
+			{
+				auto re = *it;
+				if (re.external)
+				{
+					auto def = symbols.find(module.symbolName(re.index));
+					assert(def);
 
-	auto index = symbolTable.size();
+					re.address = symbols.addressOf(*def);
+					re.external = 0;
+					re.index = (def->type & SET_TEXT) ? SEG_TEXT : (def->type & SET_DATA) ? SEG_DATA : SEG_BSS;
+				}
 
-	symbolTable.push_back(SymbolTable::value_type(name, sym));
-	auto sl = symbolLookup.insert(SymbolLookup::value_type(name, index));
-	assert(sl.second);
+				to.push_back(re);
+			}
+		};
 
-	if (sym.type & SET_TEXT)
-	{
-		auto r = codeSymbolRLookup.insert(SymbolRLookup::value_type(sym.value, name));
-		assert(r.second);
-	}
-	else if (sym.type & SET_DATA)
-	{
-		auto r = dataSymbolRLookup.insert(SymbolRLookup::value_type(sym.value, name));
-		assert(r.second);
-	}
-	else if (sym.type & SET_BSS)
-	{
-		auto r = bssSymbolRLookup.insert(SymbolRLookup::value_type(sym.value, name));
-		assert(r.second);
+		resolve(module.textRelocs, newTextRelocs);
+		resolve(module.dataRelocs, newDataRelocs);
 	}
+	else
+		module.appendLinkedRelocs(newTextRelocs, newDataRelocs);
 
-	//	assert(false);
-}
+	textRelocs.erase(textRelocs.begin() + firstReloc, textRelocs.begin() + firstReloc + relocCount);
+	textRelocs.insert(textRelocs.begin() + firstReloc, newTextRelocs.begin(), newTextRelocs.end());
 
-//
-uint32_t ObjectFile::addString(const std::string &name)
-{
-	uint32_t offset = stringTable.size();
+	dataRelocs.erase(dataRelocs.begin() + firstDataReloc, dataRelocs.begin() + firstDataReloc + dataRelocCount);
+	dataRelocs.insert(dataRelocs.begin() + firstDataReloc, newDataRelocs.begin(), newDataRelocs.end());
 
-	for (size_t i = 0; i < name.size(); i++)
-		stringTable.push_back(name[i]);
+	// update the values of the symbols the module defines, the first
+	// module's symbols keep their own values like in a full link
+	for (size_t i = 0; i < module.symbolTable.size(); i++)
+	{
+		auto &se = module.symbolTable[i];
+		if (se.type & SET_UNDEFINED)
+			continue;
 
-	// make it asciiz
-	stringTable.push_back(0);
+		auto name = module.symbolName(i);
+		auto def = symbols.find(name);
+		if (!def || def->module != index)
+			continue;
 
-	return offset;
-}
+		auto len = strlen(name);
+		auto sym = findSymbolIndex(name, len, hashName(name, len));
+		if (sym == UINT_MAX)
+			continue;
 
-//
-size_t ObjectFile::indexOfSymbol(const std::string &name)
-{
-	auto iter = symbolLookup.find(name);
+		if (0 == index)
+			symbolTable[sym].value = se.value;
+		else
+			symbolTable[sym].value = symbols.addressOf(*def);
+	}
 
-	if (iter == symbolLookup.end())
-		return UINT_MAX;
+	addrIndexed = false;
 
-	return iter->second;
+	return newTextRelocs.size();
 }
 
-//
-void ObjectFile::addTextRelocation(RelocationEntry &r)
+// patch a reference at an offset in the text or data of a linked image to a
+// new address, and the resolved relocation of the first module that made it
+void ObjectFile::patchReference(uint32_t segment, uint32_t offset, uint32_t relocIndex, uint32_t addr)
 {
-	textRelocs.push_back(r);
+	auto &seg = SEG_DATA == segment ? data_segment : text_segment;
+	seg[offset] = LOBYTE(addr);
+	seg[offset + 1] = HIBYTE(addr);
+
+	if (relocIndex != EMPTY_SLOT)
+		(SEG_DATA == segment ? dataRelocs : textRelocs)[relocIndex].address = addr;
 }
 
-//
-void ObjectFile::addDataRelocation(RelocationEntry &r)
+// write out the object file to the named file, optionally through a temp file
+// which is renamed over the target once it is complete
+int ObjectFile::writeFile(const std::string &name, bool atomic)
 {
-	dataRelocs.push_back(r);
+	int result;
+
+	if (atomic)
+		result = writeFileAtomic(name, [this](FILE *f) { return !writeFile(f); });
+	else
+	{
+		FILE *f = fopen(name.c_str(), "wb");
+		if (nullptr == f)
+			return EOF;
+
+		result = writeFile(f);
+		if (fclose(f))
+			result = EOF;
+	}
+
+	if (result)
+		return EOF;
+
+	filename = name;
+
+	return 0;
+}
+
+// lay out the whole object file in memory
+void ObjectFile::writeBuffer(std::vector<uint8_t> &buf)
+{
+	mergeStrings();
+
+	// update the header
+	file_header.a_text		= text_segment.size();
+	file_header.a_data		= data_segment.size();
+	file_header.a_trsize	= textRelocs.size();
+	file_header.a_drsize	= dataRelocs.size();
+	file_header.a_syms		= symbolTable.size();
+
+	size_t trSize = textRelocs.size() * sizeof(RelocationEntry);
+	size_t drSize = dataRelocs.size() * sizeof(RelocationEntry);
+	size_t symSize = symbolTable.size() * sizeof(SymbolEntity);
+
+	buf.resize(sizeof(file_header) + text_segment.size() + data_segment.size() + trSize + drSize + symSize + stringTable.size());
+	uint8_t *p = buf.data();
+
+	// header, text and data segments
+	memcpy(p, &file_header, sizeof(file_header));
+	p += sizeof(file_header);
+
+	memcpy(p, text_segment.data(), text_segment.size());
+	p += text_segment.size();
+
+	memcpy(p, data_segment.data(), data_segment.size());
+	p += data_segment.size();
+
+	// text and data relocations
+	memcpy(p, textRelocs.data(), trSize);
+	p += trSize;
+
+	memcpy(p, dataRelocs.data(), drSize);
+	p += drSize;
+
+	// symbol table
+	memcpy(p, symbolTable.data(), symSize);
+	p += symSize;
+
+	// string table
+	memcpy(p, stringTable.data(), stringTable.size());
+
+	if (format != FORMAT_AOUT)
+	{
+		std::vector<uint8_t> classic;
+		classic.swap(buf);
+		encodeAoutx(classic.data(), classic.size(), format, buf);
+	}
+}
+
+// write out the object file to the given stream
+int ObjectFile::writeFile(FILE *fptr)
+{
+	assert(fptr != nullptr);
+	if (fptr == nullptr)
+		return EOF;
+
+	// build the file image so that it is written with a single call
+	std::vector<uint8_t> buf;
+	writeBuffer(buf);
+
+	if (fwrite(buf.data(), buf.size(), 1, fptr) != 1)
+		return EOF;
+
+	return 0;
+}
+
+// read in the named object file
+int ObjectFile::readFile(const std::string &name)
+{
+	FILE *f = fopen(name.c_str(), "rb");
+	if (nullptr == f)
+		return EOF;
+
+	auto result = readFile(f);
+	fclose(f);
+
+	if (result)
+		return EOF;
+
+	filename = name;
+
+	return result;
+}
+
+// read an object file from the given stream
+int ObjectFile::readFile(FILE *fptr)
+{
+	assert(fptr != nullptr);
+	if (fptr == nullptr)
+		return EOF;
+
+	clear();
+
+	// size the rest of the stream so that it can be read in one go
+	auto start = ftell(fptr);
+	if (start < 0 || fseek(fptr, 0, SEEK_END))
+		return EOF;
+
+	auto end = ftell(fptr);
+	if (end < start || fseek(fptr, start, SEEK_SET))
+		return EOF;
+
+	std::vector<uint8_t> buf(end - start);
+	if (!buf.empty() && fread(buf.data(), buf.size(), 1, fptr) != 1)
+		return EOF;
+
+	return readBuffer(buf.data(), buf.size());
+}
+
+// check that the sections described by a header fit in a file of the given size
+bool validateHeader(const AOUT_HEADER &header, size_t fileSize)
+{
+	if (header.a_text < 0 || header.a_data < 0 || header.a_trsize < 0 || header.a_drsize < 0 || header.a_syms < 0)
+		return false;
+
+	uint64_t size = sizeof(AOUT_HEADER);
+	size += (uint64_t)header.a_text + header.a_data;
+	size += ((uint64_t)header.a_trsize + header.a_drsize) * sizeof(RelocationEntry);
+	size += (uint64_t)header.a_syms * sizeof(SymbolEntity);
+
+	return size <= fileSize;
+}
+
+// read an object file from an in-memory image of the file
+int ObjectFile::readBuffer(const uint8_t *buf, size_t size)
+{
+	clear();
+
+	// read the header
+	if (size < sizeof(file_header))
+		return EOF;
+
+	// the extended format has its own reader
+	if (isAoutx(buf, size))
+		return readAoutx(buf, size);
+
+	memcpy(&file_header, buf, sizeof(file_header));
+
+	if (!validateHeader(file_header, size))
+	{
+		clear();
+		return EOF;
+	}
+
+	size_t textSize = file_header.a_text;
+	size_t dataSize = file_header.a_data;
+	size_t trSize = file_header.a_trsize * sizeof(RelocationEntry);
+	size_t drSize = file_header.a_drsize * sizeof(RelocationEntry);
+	size_t symSize = file_header.a_syms * sizeof(SymbolEntity);
+
+	const uint8_t *p = buf + sizeof(file_header);
+
+	// read the text and data segments
+	text_segment.assign(p, p + textSize);
+	p += textSize;
+
+	data_segment.assign(p, p + dataSize);
+	p += dataSize;
+
+	// read the text and data relocations
+	textRelocs.resize(file_header.a_trsize);
+	memcpy(textRelocs.data(), p, trSize);
+	p += trSize;
+
+	dataRelocs.resize(file_header.a_drsize);
+	memcpy(dataRelocs.data(), p, drSize);
+	p += drSize;
+
+	// read the symbol table
+	symbolTable.resize(file_header.a_syms);
+	memcpy(symbolTable.data(), p, symSize);
+	p += symSize;
+
+	// the string table is the rest of the file
+	stringTable.assign(p, buf + size);
+
+	return indexSymbols();
+}
+
+// check the names of the symbols that were read and index them
+int ObjectFile::indexSymbols()
+{
+	// every name must be a null terminated string inside the string table
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
+	{
+		if (it->nameOffset >= stringTable.size() || !memchr(&stringTable[it->nameOffset], 0, stringTable.size() - it->nameOffset))
+		{
+			clear();
+			return EOF;
+		}
+	}
+
+	// index the symbols
+	rehashSymbols(symbolTable.size() * 2);
+	rehashStrings();
+	addrIndexed = false;
+
+	return 0;
+}
+
+// read only the header, symbols and names of the named object file. The
+// segment sizes are taken from the header until the file is read in full.
+int ObjectFile::readSymbols(const std::string &name)
+{
+	clear();
+
+	FILE *f = fopen(name.c_str(), "rb");
+	if (nullptr == f)
+		return EOF;
+
+	long size = -1;
+	if (!fseek(f, 0, SEEK_END))
+		size = ftell(f);
+
+	if (size < (long)sizeof(file_header) || fseek(f, 0, SEEK_SET) || fread(&file_header, sizeof(file_header), 1, f) != 1)
+	{
+		fclose(f);
+		clear();
+		return EOF;
+	}
+
+	bool ok;
+
+	// the extended format can seek straight to the symbols
+	if (file_header.a_magic == AOUTX_MAGIC)
+		ok = !readAoutxSymbols(f, size);
+	else if (!validateHeader(file_header, size))
+		ok = false;
+	else
+	{
+		// skip the segments and relocations
+		long symStart = sizeof(file_header) + file_header.a_text + file_header.a_data;
+		symStart += (file_header.a_trsize + file_header.a_drsize) * sizeof(RelocationEntry);
+
+		size_t symSize = file_header.a_syms * sizeof(SymbolEntity);
+		symbolTable.resize(file_header.a_syms);
+		stringTable.resize(size - symStart - symSize);
+
+		ok = !fseek(f, symStart, SEEK_SET);
+		if (ok && symSize)
+			ok = fread(symbolTable.data(), symSize, 1, f) == 1;
+		if (ok && !stringTable.empty())
+			ok = fread(stringTable.data(), stringTable.size(), 1, f) == 1;
+	}
+
+	fclose(f);
+
+	if (!ok)
+	{
+		clear();
+		return EOF;
+	}
+
+	if (indexSymbols())
+		return EOF;
+
+	filename = name;
+	symbolsOnly = true;
+
+	return 0;
+}
+
+// alloc space in bss segment and return its address
+uint32_t ObjectFile::allocBSS(size_t size)
+{
+	uint32_t addr = file_header.a_bss;
+	file_header.a_bss += size;
+
+	return addr;
+}
+
+// alloc/assign byte to code segment and return its address
+uint32_t ObjectFile::addText(uint8_t item)
+{
+	uint32_t addr = text_segment.size();
+		text_segment.push_back(item);
+	return addr;
+}
+
+// alloc/assign data byte to data segment and return its address
+uint32_t ObjectFile::addData(uint8_t item)
+{
+	uint32_t addr = data_segment.size();
+		data_segment.push_back(item);
+	return addr;
+}
+
+//
+void ObjectFile::addSymbol(const std::string &name, SymbolEntity &sym)
+{
+	addSymbol(name.data(), name.size(), sym);
+}
+
+//
+void ObjectFile::addSymbol(const char *name, size_t len, SymbolEntity &sym)
+{
+	auto hash = hashName(name, len);
+	auto index = findSymbolIndex(name, len, hash);
+
+	// if symbol already exists as an EXTERN, update it since it is now defined
+	if (index != UINT_MAX)
+	{
+		symbolTable[index].type = sym.type;
+		symbolTable[index].value = sym.value;
+		addrIndexed = false;
+		return;
+	}
+
+	sym.nameOffset = addString(name, len);
+
+	index = symbolTable.size();
+	symbolTable.push_back(sym);
+
+	hashSymbol(index, hash);
+	addrIndexed = false;
+}
+
+// add a symbol to the name hash, growing it to keep it at most half full
+void ObjectFile::hashSymbol(uint32_t index, uint32_t hash)
+{
+	if (symbolTable.size() * 2 > symbolHash.size())
+	{
+		// the new symbol is already in the table so this hashes it too
+		rehashSymbols(symbolHash.size() * 2);
+		return;
+	}
+
+	insertHashSlot(symbolHash, hash, index);
+}
+
+// rebuild the name hash with at least the given number of slots
+void ObjectFile::rehashSymbols(size_t slots)
+{
+	size_t size = 64;
+	while (size < slots)
+		size *= 2;
+
+	HashSlot empty = { 0, EMPTY_SLOT };
+	symbolHash.assign(size, empty);
+
+	for (size_t i = 0; i < symbolTable.size(); i++)
+	{
+		auto name = symbolName(i);
+		insertHashSlot(symbolHash, hashName(name, strlen(name)), i);
+	}
+}
+
+// find a symbol by name and hash, returns UINT_MAX if not found
+size_t ObjectFile::findSymbolIndex(const char *name, size_t len, uint32_t hash) const
+{
+	if (symbolHash.empty())
+		return UINT_MAX;
+
+	size_t mask = symbolHash.size() - 1;
+
+	for (size_t slot = hash & mask; symbolHash[slot].index != EMPTY_SLOT; slot = (slot + 1) & mask)
+	{
+		if (symbolHash[slot].hash != hash)
+			continue;
+
+		auto str = &stringTable[symbolTable[symbolHash[slot].index].nameOffset];
+		if (!strncmp(str, name, len) && 0 == str[len])
+			return symbolHash[slot].index;
+	}
+
+	return UINT_MAX;
+}
+
+//
+uint32_t ObjectFile::addString(const std::string &name)
+{
+	return addString(name.data(), name.size());
+}
+
+// add a name to the string table, or return where it already is
+uint32_t ObjectFile::addString(const char *name, size_t len)
+{
+	auto hash = hashName(name, len);
+
+	uint32_t offset = findString(name, len, hash);
+	if (offset != EMPTY_SLOT)
+		return offset;
+
+	offset = stringTable.size();
+
+	stringTable.insert(stringTable.end(), name, name + len);
+
+	// make it asciiz
+	stringTable.push_back(0);
+
+	hashString(offset, hash);
+
+	return offset;
+}
+
+// add a string to the string hash, growing it to keep it at most half full
+void ObjectFile::hashString(uint32_t offset, uint32_t hash)
+{
+	if (++stringCount * 2 > stringHash.size())
+	{
+		SymbolHash old(stringHash.get_allocator());
+		old.swap(stringHash);
+
+		HashSlot empty = { 0, EMPTY_SLOT };
+		stringHash.assign(old.empty() ? 64 : old.size() * 2, empty);
+
+		for (auto it = old.begin(); it != old.end(); it++)
+		{
+			if (it->index != EMPTY_SLOT)
+				insertHashSlot(stringHash, it->hash, it->index);
+		}
+	}
+
+	insertHashSlot(stringHash, hash, offset);
+}
+
+// rebuild the string hash from the symbol names
+void ObjectFile::rehashStrings()
+{
+	stringHash.clear();
+	stringCount = 0;
+
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
+	{
+		auto name = &stringTable[it->nameOffset];
+		auto len = strlen(name);
+		auto hash = hashName(name, len);
+
+		if (findString(name, len, hash) == EMPTY_SLOT)
+			hashString(it->nameOffset, hash);
+	}
+}
+
+// find a string by name and hash, returns EMPTY_SLOT if not found
+uint32_t ObjectFile::findString(const char *name, size_t len, uint32_t hash) const
+{
+	if (stringHash.empty())
+		return EMPTY_SLOT;
+
+	size_t mask = stringHash.size() - 1;
+
+	for (size_t slot = hash & mask; stringHash[slot].index != EMPTY_SLOT; slot = (slot + 1) & mask)
+	{
+		if (stringHash[slot].hash != hash)
+			continue;
+
+		auto str = &stringTable[stringHash[slot].index];
+		if (!strncmp(str, name, len) && 0 == str[len])
+			return stringHash[slot].index;
+	}
+
+	return EMPTY_SLOT;
+}
+
+// order names by their reversed text, so a name sorts right before the
+// names that end with it
+static bool suffixLess(const char *a, size_t lenA, const char *b, size_t lenB)
+{
+	while (lenA && lenB)
+	{
+		uint8_t ca = a[--lenA];
+		uint8_t cb = b[--lenB];
+
+		if (ca != cb)
+			return ca < cb;
+	}
+
+	return lenA < lenB;
+}
+
+// Rebuild the string table so that every name is stored once and a name
+// that is the tail of another, like "_end" in "heap_end", points into it.
+void ObjectFile::mergeStrings()
+{
+	struct Name
+	{
+		uint32_t offset;	// offset in the current string table
+		uint32_t len;
+		uint32_t merged;	// offset in the merged string table
+		bool owner;			// stored in full, not as the tail of another name
+	};
+
+	// every distinct name offset the symbols use
+	std::vector<Name> names;
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
+	{
+		Name name = { it->nameOffset, 0, 0, true };
+		names.push_back(name);
+	}
+
+	std::sort(names.begin(), names.end(), [](const Name &a, const Name &b) {
+		return a.offset < b.offset;
+	});
+
+	names.erase(std::unique(names.begin(), names.end(), [](const Name &a, const Name &b) {
+		return a.offset == b.offset;
+	}), names.end());
+
+	for (auto it = names.begin(); it != names.end(); it++)
+		it->len = strlen(&stringTable[it->offset]);
+
+	std::vector<uint32_t> order(names.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return suffixLess(&stringTable[names[a].offset], names[a].len, &stringTable[names[b].offset], names[b].len);
+	});
+
+	// a name that is the tail of the next one in suffix order is stored in it
+	for (size_t i = 0; i + 1 < order.size(); i++)
+	{
+		auto &name = names[order[i]];
+		auto &next = names[order[i + 1]];
+
+		if (name.len <= next.len && !memcmp(&stringTable[name.offset], &stringTable[next.offset + next.len - name.len], name.len))
+			name.owner = false;
+	}
+
+	// store the full names in their original order
+	StringTable merged(stringTable.get_allocator());
+	for (auto it = names.begin(); it != names.end(); it++)
+	{
+		if (!it->owner)
+			continue;
+
+		it->merged = merged.size();
+		merged.insert(merged.end(), &stringTable[it->offset], &stringTable[it->offset] + it->len + 1);
+	}
+
+	// then point the tails into the names that hold them
+	for (size_t i = order.size(); i-- > 0; )
+	{
+		auto &name = names[order[i]];
+		if (name.owner)
+			continue;
+
+		auto &next = names[order[i + 1]];
+		name.merged = next.merged + next.len - name.len;
+	}
+
+	for (auto it = symbolTable.begin(); it != symbolTable.end(); it++)
+	{
+		auto name = std::lower_bound(names.begin(), names.end(), it->nameOffset, [](const Name &name, uint32_t offset) {
+			return name.offset < offset;
+		});
+
+		it->nameOffset = name->merged;
+	}
+
+	stringTable.swap(merged);
+
+	rehashStrings();
+	addrIndexed = false;
+}
+
+//
+size_t ObjectFile::indexOfSymbol(const std::string &name)
+{
+	return findSymbolIndex(name.data(), name.size(), hashName(name.data(), name.size()));
+}
+
+// remove all symbols and their names
+void ObjectFile::stripSymbols()
+{
+	symbolTable.clear();
+	symbolHash.clear();
+	stringHash.clear();
+	stringCount = 0;
+
+	addrIndexed = false;
+	codeAddrIndex.clear();
+	dataAddrIndex.clear();
+	bssAddrIndex.clear();
+
+	stringTable.clear();
+}
+
+// index the defined symbols of the modules, returns the number of names
+// defined by more than one module
+size_t GlobalSymbolTable::build(const std::vector<ObjectFile*> &modules)
+{
+	size_t count = 0;
+	for (auto it = modules.begin(); it != modules.end(); it++)
+		count += (*it)->getSymbolCount();
+
+	reset(modules, count);
+
+	size_t duplicates = 0;
+
+	for (size_t m = 0; m < modules.size(); m++)
+	{
+		auto module = modules[m];
+		for (size_t i = 0; i < module->getSymbolCount(); i++)
+		{
+			auto se = module->symbolAt(i);
+			if (se.type & SET_UNDEFINED)
+				continue;
+
+			assert(se.type & (SET_TEXT | SET_DATA | SET_BSS));
+
+			if (!define(module->symbolName(i), (uint32_t)m, se.type, se.value))
+			{
+				// a name seen before only counts the extra definition
+				if (2 == find(module->symbolName(i))->count)
+					duplicates++;
+			}
+		}
+	}
+
+	return duplicates;
+}
+
+// start an empty table for the modules, sized for the given number of names
+void GlobalSymbolTable::reset(const std::vector<ObjectFile*> &modules, size_t names)
+{
+	this->modules = &modules;
+	definitions.clear();
+	definitions.reserve(names);
+
+	size_t size = 64;
+	while (size < names * 2)
+		size *= 2;
+
+	HashSlot empty = { 0, EMPTY_SLOT };
+	slots.assign(size, empty);
+}
+
+// add the definition of a name, returns false if the name is already
+// defined, the first definition is kept and counts the extra one
+bool GlobalSymbolTable::define(const char *name, uint32_t module, uint32_t type, uint32_t value)
+{
+	auto hash = hashName(name, strlen(name));
+
+	auto index = indexOf(name, hash);
+	if (index != EMPTY_SLOT)
+	{
+		definitions[index].count++;
+		return false;
+	}
+
+	// keep the hash at most half full
+	if ((definitions.size() + 1) * 2 > slots.size())
+	{
+		HashSlot empty = { 0, EMPTY_SLOT };
+		slots.assign(slots.size() * 2, empty);
+
+		for (uint32_t i = 0; i < definitions.size(); i++)
+			insertHashSlot(slots, hashName(definitions[i].name, strlen(definitions[i].name)), i);
+	}
+
+	Definition d = { name, module, type & (SET_TEXT | SET_DATA | SET_BSS), value, 1 };
+	insertHashSlot(slots, hash, definitions.size());
+	definitions.push_back(d);
+
+	return true;
+}
+
+// find the definition of a name, returns nullptr if no module defines it
+const GlobalSymbolTable::Definition *GlobalSymbolTable::find(const char *name) const
+{
+	auto index = indexOf(name, hashName(name, strlen(name)));
+	return index != EMPTY_SLOT ? &definitions[index] : nullptr;
+}
+
+// find a name in the hash, returns EMPTY_SLOT if not found
+uint32_t GlobalSymbolTable::indexOf(const char *name, uint32_t hash) const
+{
+	if (slots.empty())
+		return EMPTY_SLOT;
+
+	size_t mask = slots.size() - 1;
+
+	for (size_t slot = hash & mask; slots[slot].index != EMPTY_SLOT; slot = (slot + 1) & mask)
+	{
+		if (slots[slot].hash == hash && !strcmp(definitions[slots[slot].index].name, name))
+			return slots[slot].index;
+	}
+
+	return EMPTY_SLOT;
+}
+
+// absolute address of a definition once the segment bases are set
+uint32_t GlobalSymbolTable::addressOf(const Definition &def) const
+{
+	auto module = (*modules)[def.module];
+
+	if (def.type & SET_TEXT)
+		return module->getTextBase() + def.value;
+	else if (def.type & SET_DATA)
+		return module->getDataBase() + def.value;
+	else
+		return module->getBssBase() + def.value;
+}
+
+// Build the reference graph of the procedures of the modules. The symbols
+// must index the same modules. Text pointers in the data segments can't be
+// followed back to a use, so the procedures they point at are roots.
+void ProcGraph::build(const std::vector<ObjectFile*> &modules, const GlobalSymbolTable &symbols)
+{
+	this->modules = &modules;
+	this->symbols = &symbols;
+
+	nodes.clear();
+	firstNode.clear();
+	roots.clear();
+
+	std::vector<ProcExtent> extents;
+	for (uint32_t m = 0; m < modules.size(); m++)
+	{
+		firstNode.push_back(nodes.size());
+
+		modules[m]->getProcExtents(extents);
+		for (auto it = extents.begin(); it != extents.end(); it++)
+		{
+			Node node = { m, *it, false };
+			nodes.push_back(node);
+		}
+	}
+
+	firstNode.push_back(nodes.size());
+	edges.assign(nodes.size(), std::vector<uint32_t>());
+
+	for (uint32_t m = 0; m < modules.size(); m++)
+	{
+		auto module = modules[m];
+
+		for (auto it = module->textRelocs.begin(); it != module->textRelocs.end(); it++)
+		{
+			auto from = nodeAt(m, it->address);
+			auto to = targetOf(m, *it, module->text_segment);
+
+			if (from != EMPTY_SLOT && to != EMPTY_SLOT && from != to)
+				edges[from].push_back(to);
+		}
+
+		for (auto it = module->dataRelocs.begin(); it != module->dataRelocs.end(); it++)
+		{
+			auto to = targetOf(m, *it, module->data_segment);
+			if (to != EMPTY_SLOT)
+				roots.push_back(to);
+		}
+	}
+}
+
+// find the procedure at an offset in a module's text, EMPTY_SLOT if none
+uint32_t ProcGraph::nodeAt(uint32_t module, uint32_t offset) const
+{
+	auto first = nodes.begin() + firstNode[module];
+	auto last = nodes.begin() + firstNode[module + 1];
+
+	auto it = std::upper_bound(first, last, offset, [](uint32_t value, const Node &n) { return value < n.extent.start; });
+	if (it == first)
+		return EMPTY_SLOT;
+
+	--it;
+	return offset < it->extent.start + it->extent.size ? (uint32_t)(it - nodes.begin()) : EMPTY_SLOT;
+}
+
+// find the procedure a relocation refers to, EMPTY_SLOT if it isn't code
+uint32_t ProcGraph::targetOf(uint32_t module, const RelocationEntry &re, const ObjectFile::Segment &segment) const
+{
+	if (re.external)
+	{
+		auto def = symbols->find((*modules)[module]->symbolName(re.index));
+		if (!def || !(def->type & SET_TEXT))
+			return EMPTY_SLOT;
+
+		return nodeAt(def->module, def->value);
+	}
+
+	if (re.index != SEG_TEXT)
+		return EMPTY_SLOT;
+
+	return nodeAt(module, segment[re.address] + (segment[re.address + 1] << 8));
+}
+
+// keep the procedure at an offset in a module's text
+void ProcGraph::addRoot(uint32_t module, uint32_t offset)
+{
+	auto node = nodeAt(module, offset);
+	if (node != EMPTY_SLOT)
+		roots.push_back(node);
+}
+
+// keep the procedure a name is defined in, returns false if there is none
+bool ProcGraph::addRoot(const char *name)
+{
+	auto def = symbols->find(name);
+	if (!def || !(def->type & SET_TEXT))
+		return false;
+
+	addRoot(def->module, def->value);
+	return true;
+}
+
+// Mark what the roots reach and remove the rest from the modules. Returns
+// the number of bytes of code removed.
+uint32_t ProcGraph::sweep()
+{
+	std::vector<uint32_t> stack(roots);
+
+	while (!stack.empty())
+	{
+		auto node = stack.back();
+		stack.pop_back();
+
+		if (nodes[node].live)
+			continue;
+
+		nodes[node].live = true;
+		stack.insert(stack.end(), edges[node].begin(), edges[node].end());
+	}
+
+	uint32_t removed = 0;
+	std::vector<ProcExtent> live;
+
+	for (uint32_t m = 0; m < modules->size(); m++)
+	{
+		live.clear();
+
+		for (auto n = firstNode[m]; n < firstNode[m + 1]; n++)
+		{
+			if (nodes[n].live)
+				live.push_back(nodes[n].extent);
+		}
+
+		if (live.size() < firstNode[m + 1] - firstNode[m])
+			removed += (*modules)[m]->removeDeadCode(live);
+	}
+
+	return removed;
+}
+
+// FNV-1a hash of a symbol name
+uint32_t hashName(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// FNV-1a hash of a buffer, continuing from a previous hash
+uint64_t hashBytes(const void *buf, size_t size, uint64_t hash)
+{
+	auto p = static_cast<const uint8_t*>(buf);
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= p[i];
+		hash *= 0x100000001B3ull;
+	}
+
+	return hash;
+}
+
+// read a whole file into memory
+int readWholeFile(const char *name, std::vector<uint8_t> &buf)
+{
+	FILE *f = fopen(name, "rb");
+	if (nullptr == f)
+		return EOF;
+
+	long size = -1;
+	if (!fseek(f, 0, SEEK_END))
+		size = ftell(f);
+
+	bool ok = size >= 0 && !fseek(f, 0, SEEK_SET);
+	if (ok)
+	{
+		buf.resize(size);
+		if (size)
+			ok = fread(buf.data(), buf.size(), 1, f) == 1;
+	}
+
+	fclose(f);
+
+	return ok ? 0 : EOF;
+}
+
+// rename a complete temp file over the target, the temp file is removed if
+// that fails
+int replaceFile(const std::string &tmpName, const std::string &name)
+{
+#ifdef _WIN32
+	// rename() does not replace an existing file on Windows
+	remove(name.c_str());
+#endif
+	if (rename(tmpName.c_str(), name.c_str()))
+	{
+		remove(tmpName.c_str());
+		return EOF;
+	}
+
+	return 0;
+}
+
+// write a file through a temp file named with the suffix, which replaces the
+// target only once it is complete so that readers never see part of a file
+int writeFileAtomic(const std::string &name, const std::function<bool(FILE*)> &write, const char *suffix)
+{
+	std::string tmpName = name + suffix;
+
+	FILE *f = fopen(tmpName.c_str(), "wb");
+	if (nullptr == f)
+		return EOF;
+
+	bool ok = write(f);
+	if (fclose(f))
+		ok = false;
+
+	if (!ok)
+	{
+		remove(tmpName.c_str());
+		return EOF;
+	}
+
+	return replaceFile(tmpName, name);
+}
+
+//
+void ObjectFile::addTextRelocation(RelocationEntry &r)
+{
+	textRelocs.push_back(r);
+}
+
+//
+void ObjectFile::addDataRelocation(RelocationEntry &r)
+{
+	dataRelocs.push_back(r);
+}
+
+//
+void ObjectFile::dumpHeader(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
+		return;
+
+	::dumpHeader(f, file_header);
+}
+
+//
+void dumpHeader(FILE *f, const AOUT_HEADER &file_header)
+{
+	fprintf(f, "A.out File Header\n");
+	fprintf(f, "-----------------\n\n");
+
+	fprintf(f, "     Magic Number: " HEX_PREFIX "%X\n", file_header.a_magic);
+	fprintf(f, "Text Segment size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_text, file_header.a_text);
+	fprintf(f, "Data Segment size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_data, file_header.a_data);
+	fprintf(f, " BSS Segment size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_bss, file_header.a_bss);
+	fprintf(f, "Symbol Table size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_syms, file_header.a_syms);
+	fprintf(f, " Text reloc count: " HEX_PREFIX "%04X (%d) entries\n", file_header.a_trsize, file_header.a_trsize);
+	fprintf(f, " Data reloc count: " HEX_PREFIX "%04X (%d) entries\n", file_header.a_drsize, file_header.a_drsize);
+	fprintf(f, " Main Entry Point: " HEX_PREFIX "%04X\n\n", file_header.a_entry);
+}
+
+//
+void hexDumpGroup(FILE *f, const uint8_t *buf)
+{
+	for (int item = 0; item < 4; item++)
+	{
+		fprintf(f, "%02X ", buf[item]);
+	}
+}
+
+//
+void hexDumpLine(FILE *f, uint32_t offset, const uint8_t *buf)
+{
+	fprintf(f, "%04X: ", offset);
+
+	hexDumpGroup(f, buf);
+	fputc(' ', f);
+	hexDumpGroup(f, buf+4);
+
+	fputs("- ", f);
+
+	hexDumpGroup(f, buf+8);
+	fputc(' ', f);
+	hexDumpGroup(f, buf+12);
+
+	fputc('[', f);
+
+	// write out character row
+	for (int i = 0; i < 16; i++)
+	{
+		if (isprint(buf[i]))
+			fputc(buf[i], f);
+		else
+			fputc('.', f);
+	}
+	
+	fprintf(f, "]\n");
+}
+
+//
+void hexDumpSegment(FILE *f, const uint8_t *seg, size_t size)
+{
+	uint32_t offset = 0;
+
+	for (size_t i = 0; i < size / 16; i++)
+	{
+		hexDumpLine(f, offset, &seg[offset]);
+		offset += 16;
+	}
+
+	// if we finished on a full line then we are done!
+	if (0 == (size % 16))
+		return;
+
+	// otherwise we need to print the last (partial) line
+	uint8_t lastLine[16] = { 0 };
+	memcpy(lastLine, &seg[offset], size % 16);
+	hexDumpLine(f, offset, lastLine);
+}
+
+//
+void ObjectFile::dumpText(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
+		return;
+
+	fprintf(f, ".text segment (hex)\n");
+	fprintf(f, "-------------------\n\n");
+
+	Segment::value_type *pData = text_segment.data();
+	hexDumpSegment(f, pData, text_segment.size());
+	fputc('\n', f);
+}
+
+//
+void ObjectFile::dumpData(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
+		return;
+
+	fprintf(f, ".data segment (hex)\n");
+	fprintf(f, "-------------------\n\n");
+
+	Segment::value_type *pData = data_segment.data();
+	hexDumpSegment(f, data_segment.data(), data_segment.size());
+	fputc('\n', f);
+}
+
+//
+const char *getSegmentName(uint32_t seg)
+{
+	if (seg == SEG_TEXT)
+		return ".text";
+	else if (seg == SEG_DATA)
+		return ".data";
+	else if (seg == SEG_BSS)
+		return ".bss";
+
+	assert(false);
+	return "unknown!";
+}
+
+// output the text relocations
+void ObjectFile::dumpTextRelocs(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
+		return;
+
+	if (0 == textRelocs.size())
+		return;
+
+	fprintf(f, ".text segment relocations\n");
+	fprintf(f, "-------------------------\n\n");
+
+	auto iter = textRelocs.begin();
+	for (;iter != textRelocs.end(); iter++)
+	{
+		auto re = *iter;
+		dumpRelocation(f, re, re.external ? symbolName(re.index) : nullptr);
+	}
+
+	fputc('\n', f);
+}
+
+// output the data relocations
+void ObjectFile::dumpDataRelocs(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
+		return;
+
+	if (0 == dataRelocs.size())
+		return;
+
+	fprintf(f, ".data segment relocations\n");
+	fprintf(f, "-------------------------\n\n");
+
+	auto iter = dataRelocs.begin();
+	for (; iter != dataRelocs.end(); iter++)
+	{
+		auto re = *iter;
+		dumpRelocation(f, re, re.external ? symbolName(re.index) : nullptr);
+	}
+
+	fputc('\n', f);
+}
+
+// output all of the symbol names
+void ObjectFile::dumpSymbols(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
+		return;
+
+	if (0 == symbolTable.size())
+		return;
+
+	fprintf(f, "Symbols\n");
+	fprintf(f, "-------\n\n");
+
+	for (size_t i = 0; i < symbolTable.size(); i++)
+		dumpSymbol(f, symbolName(i), symbolTable[i]);
+}
+
+// output a single relocation, name is the symbol of an external relocation
+void dumpRelocation(FILE *f, const RelocationEntry &re, const char *name)
+{
+	if (re.external)
+		fprintf(f, "%04X\tsize: %d (bytes)\tExternal\t%s\n", re.address, 1 << re.length, name);
+	else
+		fprintf(f, "%04X\tsize: %d (bytes)\tSegment: %s\n", re.address, 1 << re.length, getSegmentName(re.index));
+}
+
+// output a single symbol
+void dumpSymbol(FILE *f, const char *name, const SymbolEntity &se)
+{
+	std::string type;
+
+	if (se.type & SET_EXTERN)
+		type += " public";
+	if (se.type & SET_TEXT)
+		type += " .text";
+	if (se.type & SET_DATA)
+		type += " .data";
+	if (se.type & SET_BSS)
+		type += " .bss";
+	if (se.type & SET_UNDEFINED)
+		type += " external";
+
+	fprintf(f, "%15s\t%s segment\toffset: %d (" HEX_PREFIX "%04X)\n", name, type.c_str(), se.value, se.value);
+}
+
+//
+ImageWriter::ImageWriter()
+{
+	f = nullptr;
+	result = 0;
+}
+
+//
+ImageWriter::~ImageWriter()
+{
+	if (f)
+	{
+		fclose(f);
+		remove(tmpName.c_str());
+	}
+}
+
+// start an image for the modules, which must have their bases assigned
+int ImageWriter::open(const std::string &name, const std::vector<ObjectFile*> &modules)
+{
+	auto firstModule = modules.front();
+	auto lastModule = modules.back();
+
+	textBase = firstModule->getTextBase();
+	dataBase = firstModule->getDataBase();
+	textSize = lastModule->getTextBase() + lastModule->getTextSize() - textBase;
+	dataSize = lastModule->getDataBase() + lastModule->getDataSize() - dataBase;
+
+	bssSize = 0;
+	for (auto it = modules.begin(); it != modules.end(); it++)
+		bssSize += (*it)->getBssSize();
+
+	// the first module's text relocations go first, the rest follow
+	relocStart = sizeof(AOUT_HEADER) + textSize + dataSize;
+	relocPos = relocStart + firstModule->file_header.a_trsize * sizeof(RelocationEntry);
+	first = true;
+
+	this->name = name;
+	tmpName = name + ".tmp";
+	result = 0;
+
+	f = fopen(tmpName.c_str(), "wb");
+	return f ? 0 : EOF;
 }
 
-//
-void ObjectFile::dumpHeader(FILE *f)
+// write at an offset in the image, the first error is kept until close()
+void ImageWriter::write(long pos, const void *buf, size_t size)
 {
-	assert(f != nullptr);
-	if (f == nullptr)
+	if (result || !size)
 		return;
 
-	fprintf(f, "A.out File Header\n");
-	fprintf(f, "-----------------\n\n");
+	if (fseek(f, pos, SEEK_SET) || fwrite(buf, size, 1, f) != 1)
+		result = EOF;
+}
 
-	fprintf(f, "     Magic Number: " HEX_PREFIX "%X\n", file_header.a_magic);
-	fprintf(f, "Text Segment size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_text, file_header.a_text);
-	fprintf(f, "Data Segment size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_data, file_header.a_data);
-	fprintf(f, " BSS Segment size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_bss, file_header.a_bss);
-	fprintf(f, "Symbol Table size: " HEX_PREFIX "%04X (%d) bytes\n", file_header.a_syms, file_header.a_syms);
-	fprintf(f, " Text reloc count: " HEX_PREFIX "%04X (%d) entries\n", file_header.a_trsize, file_header.a_trsize);
-	fprintf(f, " Data reloc count: " HEX_PREFIX "%04X (%d) entries\n", file_header.a_drsize, file_header.a_drsize);
-	fprintf(f, " Main Entry Point: " HEX_PREFIX "%04X\n\n", file_header.a_entry);
+// write the segments and relocations of a relocated module, in link order
+int ImageWriter::writeModule(ObjectFile &module)
+{
+	write(sizeof(AOUT_HEADER) + module.getTextBase() - textBase, module.text_segment.data(), module.text_segment.size());
+	write(sizeof(AOUT_HEADER) + textSize + module.getDataBase() - dataBase, module.data_segment.data(), module.data_segment.size());
+
+	if (first)
+	{
+		firstTextRelocs = module.textRelocs;
+		dataRelocs = module.dataRelocs;
+		first = false;
+
+		// a different count would overlap the relocations that follow
+		if (firstTextRelocs.size() * sizeof(RelocationEntry) != (size_t)(relocPos - relocStart))
+			result = EOF;
+	}
+	else
+	{
+		// the data relocations are few and follow all the text ones, so
+		// they are kept until the end
+		ObjectFile::Relocations relocs;
+		module.appendLinkedRelocs(relocs, dataRelocs);
+
+		write(relocPos, relocs.data(), relocs.size() * sizeof(RelocationEntry));
+		relocPos += relocs.size() * sizeof(RelocationEntry);
+	}
+
+	return result;
 }
 
-//
-void hexDumpGroup(FILE *f, uint8_t *buf)
+// finish the image with the merged symbols of the first module
+int ImageWriter::close(ObjectFile &image)
 {
-	for (int item = 0; item < 4; item++)
+	image.resolveExternals(firstTextRelocs);
+	image.resolveExternals(dataRelocs);
+	image.mergeStrings();
+
+	write(relocStart, firstTextRelocs.data(), firstTextRelocs.size() * sizeof(RelocationEntry));
+	write(relocPos, dataRelocs.data(), dataRelocs.size() * sizeof(RelocationEntry));
+
+	long pos = relocPos + dataRelocs.size() * sizeof(RelocationEntry);
+	write(pos, image.symbolTable.data(), image.symbolTable.size() * sizeof(SymbolEntity));
+
+	pos += image.symbolTable.size() * sizeof(SymbolEntity);
+	write(pos, image.stringTable.data(), image.stringTable.size());
+
+	auto header = image.file_header;
+	header.a_text = textSize;
+	header.a_data = dataSize;
+	header.a_bss = bssSize;
+	header.a_trsize = (relocPos - relocStart) / sizeof(RelocationEntry);
+	header.a_drsize = dataRelocs.size();
+	header.a_syms = image.symbolTable.size();
+	write(0, &header, sizeof(header));
+
+	if (fclose(f))
+		result = EOF;
+
+	f = nullptr;
+
+	// the image is laid out as an a.out file, then converted
+	if (!result && image.getFormat() != FORMAT_AOUT)
+		result = convertFile(tmpName, image.getFormat());
+
+	if (result)
 	{
-		fprintf(f, "%02X ", buf[item]);
+		remove(tmpName.c_str());
+		return EOF;
 	}
+
+	return replaceFile(tmpName, name);
 }
 
+const uint32_t ObjectFileView::NO_SYMBOL;
+
 //
-void hexDumpLine(FILE *f, uint32_t offset, uint8_t *buf)
+void SymbolAddrIndex::add(uint32_t addr, uint32_t nameOffset)
 {
-	fprintf(f, "%04X: ", offset);
+	Entry entry = { addr, nameOffset };
+	entries.push_back(entry);
+}
 
-	hexDumpGroup(f, buf);
-	fputc(' ', f);
-	hexDumpGroup(f, buf+4);
+// sort by address keeping only the first symbol added at each address
+void SymbolAddrIndex::sort()
+{
+	std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+		return a.addr < b.addr;
+	});
 
-	fputs("- ", f);
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+		return a.addr == b.addr;
+	}), entries.end());
+}
 
-	hexDumpGroup(f, buf+8);
-	fputc(' ', f);
-	hexDumpGroup(f, buf+12);
+// find the symbol at an address
+const SymbolAddrIndex::Entry *SymbolAddrIndex::find(uint16_t addr) const
+{
+	auto it = std::lower_bound(entries.begin(), entries.end(), addr, [](const Entry &entry, uint32_t addr) {
+		return entry.addr < addr;
+	});
 
-	fputc('[', f);
+	if (it == entries.end() || it->addr != addr)
+		return nullptr;
 
-	// write out character row
-	for (int i = 0; i < 16; i++)
+	return &*it;
+}
+
+// find the symbol at or before an address. An address below the first
+// symbol gets the first symbol, one above the last symbol gets nothing.
+const SymbolAddrIndex::Entry *SymbolAddrIndex::findNearest(uint16_t addr) const
+{
+	auto it = std::lower_bound(entries.begin(), entries.end(), addr, [](const Entry &entry, uint32_t addr) {
+		return entry.addr < addr;
+	});
+
+	if (it == entries.end())
+		return nullptr;
+
+	if (it->addr != addr && it != entries.begin())
+		it--;
+
+	return &*it;
+}
+
+//
+ObjectFileView::ObjectFileView()
+{
+	base = nullptr;
+	close();
+}
+
+//
+ObjectFileView::~ObjectFileView()
+{
+	close();
+}
+
+// unmap the file and reset the view
+void ObjectFileView::close()
+{
+	if (base)
 	{
-		if (isprint(buf[i]))
-			fputc(buf[i], f);
-		else
-			fputc('.', f);
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+#else
+		munmap((void *)base, size);
+#endif
 	}
-	
-	fprintf(f, "]\n");
+
+	memset(&file_header, 0, sizeof(file_header));
+	filename.clear();
+
+	base = nullptr;
+	size = 0;
+
+	text = data = textRelocs = dataRelocs = symbols = nullptr;
+	strings = nullptr;
+	stringSize = 0;
+
+	directory.clear();
+	decoded.clear();
+
+	indexed = false;
+	nameIndex.clear();
+	codeIndex.clear();
+	dataIndex.clear();
+	bssIndex.clear();
+
+	codeMap.clear();
+	dataMap.clear();
+	nearestMap.clear();
 }
 
-//
-void hexDumpSegment(FILE *f, uint8_t *seg, size_t size)
+// map the named object file
+int ObjectFileView::open(const std::string &name)
 {
-	uint32_t offset = 0;
+	close();
 
-	for (size_t i = 0; i < size / 16; i++)
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return EOF;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize) || 0 == fileSize.QuadPart)
 	{
-		hexDumpLine(f, offset, &seg[offset]);
-		offset += 16;
+		CloseHandle(hFile);
+		return EOF;
 	}
 
-	// if we finished on a full line then we are done!
-	if (0 == (size % 16))
+	HANDLE hMap = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(hFile);
+	if (nullptr == hMap)
+		return EOF;
+
+	// the view keeps the mapping alive after the handle is closed
+	base = (const uint8_t *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMap);
+	if (nullptr == base)
+		return EOF;
+
+	size = (size_t)fileSize.QuadPart;
+#else
+	int fd = ::open(name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return EOF;
+
+	struct stat st;
+	if (fstat(fd, &st) || 0 == st.st_size)
+	{
+		::close(fd);
+		return EOF;
+	}
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return EOF;
+
+	base = (const uint8_t *)p;
+	size = st.st_size;
+#endif
+
+	// validate the header against the file length
+	if (size < sizeof(file_header))
+	{
+		close();
+		return EOF;
+	}
+
+	if (isAoutx(base, size))
+	{
+		if (openAoutx())
+		{
+			close();
+			return EOF;
+		}
+
+		filename = name;
+
+		return 0;
+	}
+
+	memcpy(&file_header, base, sizeof(file_header));
+
+	if (!validateHeader(file_header, size))
+	{
+		close();
+		return EOF;
+	}
+
+	// locate the sections, nothing is read until it is used
+	text = base + sizeof(file_header);
+	data = text + file_header.a_text;
+	textRelocs = data + file_header.a_data;
+	dataRelocs = textRelocs + file_header.a_trsize * sizeof(RelocationEntry);
+	symbols = dataRelocs + file_header.a_drsize * sizeof(RelocationEntry);
+	strings = (const char *)(symbols + file_header.a_syms * sizeof(SymbolEntity));
+	stringSize = base + size - (const uint8_t *)strings;
+
+	filename = name;
+
+	return 0;
+}
+
+// return the text relocation at the given index
+RelocationEntry ObjectFileView::textRelocAt(size_t index) const
+{
+	RelocationEntry re;
+	memcpy(&re, textRelocs + index * sizeof(re), sizeof(re));
+
+	return re;
+}
+
+// return the data relocation at the given index
+RelocationEntry ObjectFileView::dataRelocAt(size_t index) const
+{
+	RelocationEntry re;
+	memcpy(&re, dataRelocs + index * sizeof(re), sizeof(re));
+
+	return re;
+}
+
+// return the symbol at the given index
+SymbolEntity ObjectFileView::symbolAt(size_t index) const
+{
+	SymbolEntity se;
+	memcpy(&se, symbols + index * sizeof(se), sizeof(se));
+
+	return se;
+}
+
+// return the name of the symbol at the given index, pointing into the string table
+const char *ObjectFileView::symbolName(size_t index) const
+{
+	if (index >= getSymbolCount())
+		return "<invalid>";
+
+	return nameAt(symbolAt(index).nameOffset);
+}
+
+// build the name and address indexes on first use
+void ObjectFileView::buildIndexes()
+{
+	indexed = true;
+
+	auto count = getSymbolCount();
+	nameIndex.resize(count);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		nameIndex[i] = i;
+
+		auto se = symbolAt(i);
+		if (se.type & SET_TEXT)
+			codeIndex.add(se.value, se.nameOffset);
+		else if (se.type & SET_DATA)
+			dataIndex.add(se.value, se.nameOffset);
+		else if (se.type & SET_BSS)
+			bssIndex.add(se.value, se.nameOffset);
+	}
+
+	std::stable_sort(nameIndex.begin(), nameIndex.end(), [this](uint32_t a, uint32_t b) {
+		return strcmp(symbolName(a), symbolName(b)) < 0;
+	});
+
+	codeIndex.sort();
+	dataIndex.sort();
+	bssIndex.sort();
+}
+
+// expand the address indexes into one entry per 16 bit address so the
+// emulator can symbolize any address with a single array index
+void ObjectFileView::buildAddrMaps()
+{
+	if (!indexed)
+		buildIndexes();
+
+	codeMap.assign(0x10000, NO_SYMBOL);
+	dataMap.assign(0x10000, NO_SYMBOL);
+	nearestMap.assign(0x10000, NO_SYMBOL);
+
+	// bss first so data symbols win at the same address like the lookups
+	const SymbolAddrIndex *dataIndexes[] = { &bssIndex, &dataIndex };
+	for (auto index : dataIndexes)
+	{
+		for (size_t i = 0; i < index->size(); i++)
+		{
+			auto &entry = index->begin()[i];
+			if (entry.addr < 0x10000)
+				dataMap[entry.addr] = entry.nameOffset;
+		}
+	}
+
+	for (uint32_t addr = 0; addr < 0x10000; addr++)
+	{
+		auto entry = codeIndex.findNearest((uint16_t)addr);
+		if (!entry)
+			break;
+
+		if (entry->addr == addr)
+			codeMap[addr] = entry->nameOffset;
+
+		nearestMap[addr] = entry - codeIndex.begin();
+	}
+}
+
+// names must be null terminated inside the string table
+const char *ObjectFileView::nameAt(uint32_t offset) const
+{
+	if (offset >= stringSize || !memchr(strings + offset, 0, stringSize - offset))
+		return "<invalid>";
+
+	return strings + offset;
+}
+
+// find the symbol by name
+bool ObjectFileView::findSymbol(const std::string &name, SymbolEntity &sym)
+{
+	if (!indexed)
+		buildIndexes();
+
+	auto it = std::lower_bound(nameIndex.begin(), nameIndex.end(), name, [this](uint32_t index, const std::string &name) {
+		return strcmp(symbolName(index), name.c_str()) < 0;
+	});
+
+	if (it == nameIndex.end() || name != symbolName(*it))
+		return false;
+
+	sym = symbolAt(*it);
+	return true;
+}
+
+// find a code symbol by address, returns nullptr if there is none
+const char *ObjectFileView::findCodeSymbolByAddr(uint16_t addr)
+{
+	if (!codeMap.empty())
+		return codeMap[addr] != NO_SYMBOL ? nameAt(codeMap[addr]) : nullptr;
+
+	if (!indexed)
+		buildIndexes();
+
+	auto entry = codeIndex.find(addr);
+	return entry ? nameAt(entry->nameOffset) : nullptr;
+}
+
+// find a data symbol by address, returns nullptr if there is none
+const char *ObjectFileView::findDataSymbolByAddr(uint16_t addr)
+{
+	if (!dataMap.empty())
+		return dataMap[addr] != NO_SYMBOL ? nameAt(dataMap[addr]) : nullptr;
+
+	if (!indexed)
+		buildIndexes();
+
+	auto entry = dataIndex.find(addr);
+	if (!entry)
+		entry = bssIndex.find(addr);
+
+	return entry ? nameAt(entry->nameOffset) : nullptr;
+}
+
+// find nearest code symbol less than given address
+const char *ObjectFileView::findNearestCodeSymbolToAddr(uint16_t addr, uint16_t &symAddr)
+{
+	const SymbolAddrIndex::Entry *entry;
+
+	if (!nearestMap.empty())
+		entry = nearestMap[addr] != NO_SYMBOL ? codeIndex.begin() + nearestMap[addr] : nullptr;
+	else
+	{
+		if (!indexed)
+			buildIndexes();
+
+		entry = codeIndex.findNearest(addr);
+	}
+
+	if (!entry)
+		return nullptr;
+
+	symAddr = (uint16_t)entry->addr;
+	return nameAt(entry->nameOffset);
+}
+
+//
+void ObjectFileView::dumpHeader(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr)
 		return;
 
-	// otherwise we need to print the last (partial) line
-	uint8_t lastLine[16] = { 0 };
-	memcpy(lastLine, &seg[offset], size % 16);
-	hexDumpLine(f, offset, lastLine);
+	::dumpHeader(f, file_header);
 }
 
 //
-void ObjectFile::dumpText(FILE *f)
+void ObjectFileView::dumpText(FILE *f)
 {
 	assert(f != nullptr);
 	if (f == nullptr)
@@ -687,13 +2453,12 @@ void ObjectFile::dumpText(FILE *f)
 	fprintf(f, ".text segment (hex)\n");
 	fprintf(f, "-------------------\n\n");
 
-	Segment::value_type *pData = text_segment.data();
-	hexDumpSegment(f, pData, text_segment.size());
+	hexDumpSegment(f, text, getTextSize());
 	fputc('\n', f);
 }
 
 //
-void ObjectFile::dumpData(FILE *f)
+void ObjectFileView::dumpData(FILE *f)
 {
 	assert(f != nullptr);
 	if (f == nullptr)
@@ -702,104 +2467,67 @@ void ObjectFile::dumpData(FILE *f)
 	fprintf(f, ".data segment (hex)\n");
 	fprintf(f, "-------------------\n\n");
 
-	Segment::value_type *pData = data_segment.data();
-	hexDumpSegment(f, data_segment.data(), data_segment.size());
+	hexDumpSegment(f, data, getDataSize());
 	fputc('\n', f);
 }
 
-//
-const char *getSegmentName(uint32_t seg)
-{
-	if (seg == SEG_TEXT)
-		return ".text";
-	else if (seg == SEG_DATA)
-		return ".data";
-	else if (seg == SEG_BSS)
-		return ".bss";
-
-	assert(false);
-	return "unknown!";
-}
-
 // output the text relocations
-void ObjectFile::dumpTextRelocs(FILE *f)
+void ObjectFileView::dumpTextRelocs(FILE *f)
 {
 	assert(f != nullptr);
 	if (f == nullptr)
 		return;
 
-	if (0 == textRelocs.size())
+	if (0 == getTextRelocSize())
 		return;
 
 	fprintf(f, ".text segment relocations\n");
 	fprintf(f, "-------------------------\n\n");
 
-	auto iter = textRelocs.begin();
-	for (;iter != textRelocs.end(); iter++)
+	for (uint32_t i = 0; i < getTextRelocSize(); i++)
 	{
-		auto re = *iter;
-		if (re.external)
-			fprintf(f, "%04X\tsize: %d (bytes)\tExternal\t%s\n", re.address, 1 << re.length, symbolTable[re.index].first.c_str());
-		else
-			fprintf(f, "%04X\tsize: %d (bytes)\tSegment: %s\n", re.address, 1 << re.length, getSegmentName(re.index));
+		auto re = textRelocAt(i);
+		dumpRelocation(f, re, re.external ? symbolName(re.index) : nullptr);
 	}
 
 	fputc('\n', f);
 }
 
 // output the data relocations
-void ObjectFile::dumpDataRelocs(FILE *f)
+void ObjectFileView::dumpDataRelocs(FILE *f)
 {
 	assert(f != nullptr);
 	if (f == nullptr)
 		return;
 
-	if (0 == dataRelocs.size())
+	if (0 == getDataRelocSize())
 		return;
 
 	fprintf(f, ".data segment relocations\n");
 	fprintf(f, "-------------------------\n\n");
 
-	auto iter = dataRelocs.begin();
-	for (; iter != dataRelocs.end(); iter++)
+	for (uint32_t i = 0; i < getDataRelocSize(); i++)
 	{
-		auto re = *iter;
-		fprintf(f, "%04X\texternal: %d\tsize: %d (bytes)\n", re.address, re.external, 1 << re.length);
+		auto re = dataRelocAt(i);
+		dumpRelocation(f, re, re.external ? symbolName(re.index) : nullptr);
 	}
 
 	fputc('\n', f);
 }
 
 // output all of the symbol names
-void ObjectFile::dumpSymbols(FILE *f)
+void ObjectFileView::dumpSymbols(FILE *f)
 {
 	assert(f != nullptr);
 	if (f == nullptr)
 		return;
 
-	if (0 == symbolTable.size())
+	if (0 == getSymbolCount())
 		return;
 
 	fprintf(f, "Symbols\n");
 	fprintf(f, "-------\n\n");
 
-	auto iter = symbolTable.begin();
-	for (; iter != symbolTable.end(); iter++)
-	{
-		auto sym = *iter;
-		std::string type;
-
-		if (sym.second.type & SET_EXTERN)
-			type += " public";
-		if (sym.second.type & SET_TEXT)
-			type += " .text";
-		if (sym.second.type & SET_DATA)
-			type += " .data";
-		if (sym.second.type & SET_BSS)
-			type += " .bss";
-		if (sym.second.type & SET_UNDEFINED)
-			type += " external";
-
-		fprintf(f, "%15s\t%s segment\toffset: %d (" HEX_PREFIX "%04X)\n", sym.first.c_str(), type.c_str(), sym.second.value, sym.second.value);
-	}
+	for (size_t i = 0; i < getSymbolCount(); i++)
+		dumpSymbol(f, symbolName(i), symbolAt(i));
 }
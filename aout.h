@@ -15,9 +15,12 @@
 #	define HIBYTE(val) (((val) & 0xFF00) >> 8)
 #endif
 
+#include <stdio.h>
+#include <functional>
 #include <string>
 #include <vector>
 #include <map>
+#include "arena.h"
 
 
 #define HEX_PREFIX "$"
@@ -39,6 +42,98 @@ struct AOUT_HEADER
 // Validate the size of the a.out struct
 static_assert(sizeof(AOUT_HEADER) == 32, "Invalid a.out header size!");
 
+static const int AOUT_MAGIC = 263;
+
+// Define the extended a.out header. The extended format holds the same
+// sections as an a.out file, but a directory gives the offset, length,
+// encoding and checksum of each one so a reader can go straight to the
+// sections it needs. The text and data segments may be compressed and the
+// relocations and symbols packed as varints.
+//
+// The file is laid out as the header, the section directory and then the
+// sections, in any order. A section missing from the directory is empty.
+struct AOUTX_HEADER
+{
+	int ax_magic;			// magic number
+	int ax_version;			// format version
+	int ax_sections;		// number of section directory entries
+	int ax_bss;				// uninitialized data size
+	int ax_entry;			// entry point
+	uint32_t ax_checksum;	// CRC-32 of the section directory
+	int ax_spare[2];		// unused
+};
+
+// Validate the size of the extended header struct
+static_assert(sizeof(AOUTX_HEADER) == 32, "Invalid extended a.out header size!");
+
+static const int AOUTX_MAGIC = 0x0A78613C;	// "<ax\n"
+static const int AOUTX_VERSION = 1;
+static const int AOUTX_MAX_SECTIONS = 64;
+
+// Section types
+enum
+{
+	SECT_TEXT,			// code segment
+	SECT_DATA,			// initialized data segment
+	SECT_TEXT_RELOCS,	// text relocation entries
+	SECT_DATA_RELOCS,	// data relocation entries
+	SECT_SYMBOLS,		// symbol table
+	SECT_STRINGS,		// string table
+	SECT_COUNT
+};
+
+// Section encodings
+enum
+{
+	ENC_RAW,			// stored as is
+	ENC_LZ,				// LZ compressed, see lzCompress()
+	ENC_VARINT,			// relocations or symbols packed as varints, see packTable()
+	ENC_COUNT
+};
+
+// Define a section directory entry
+struct AoutxSection
+{
+	uint32_t type;		// SECT_xxx type of the section
+	uint32_t encoding;	// ENC_xxx encoding of the stored section
+	uint32_t offset;	// offset of the stored section from the start of the file
+	uint32_t size;		// stored size
+	uint32_t length;	// size once decoded
+	uint32_t checksum;	// CRC-32 of the stored section
+};
+
+// Validate the size of the section directory entry struct
+static_assert(sizeof(AoutxSection) == 24, "Invalid section directory entry!");
+
+// Define the section directory of an extended file
+class AoutxDirectory
+{
+	AOUTX_HEADER header;
+	std::vector<AoutxSection> sections;
+
+	int validate(size_t fileSize);
+
+public:
+	AoutxDirectory();
+
+	int read(const uint8_t *buf, size_t size);
+	int read(FILE *f, size_t fileSize);
+
+	const AOUTX_HEADER &getHeader() const		{ return header; }
+	const std::vector<AoutxSection> &getSections() const	{ return sections; }
+
+	const AoutxSection *find(uint32_t type) const;
+	uint32_t lengthOf(uint32_t type) const;
+};
+
+// Output formats of ObjectFile::writeFile()
+enum
+{
+	FORMAT_AOUT,		// a.out
+	FORMAT_AOUTX,		// extended
+	FORMAT_AOUTX_COMPACT	// extended with the segments compressed and the tables packed
+};
+
 // Segment types for relocation entries
 enum
 {
@@ -55,7 +150,8 @@ enum
 	SET_DATA = 4,		// DATA segment symbol
 	SET_BSS = 8,		// BSS segment symbol
 	SET_ABS = 16,		// absolute non-relocatable item. Usually debugging symbol
-	SET_UNDEFINED = 32	// symbol not defined in this module
+	SET_UNDEFINED = 32,	// symbol not defined in this module
+	SET_PROC = 64		// TEXT symbol starting a PROC, which runs to the next one
 };
 
 // Define the RelocationEntry type
@@ -91,6 +187,103 @@ struct SymbolEntity
 // Validate the size of the symbol entity struct
 static_assert(sizeof(SymbolEntity) == 12, "Invalid symbol entry!");
 
+// Flat address to symbol lookup, sorted by address with one symbol per address
+class SymbolAddrIndex
+{
+public:
+	struct Entry
+	{
+		uint32_t addr;			// symbol value
+		uint32_t nameOffset;	// offset of the symbol name in the string table
+	};
+
+	void clear()					{ entries.clear(); }
+	void add(uint32_t addr, uint32_t nameOffset);
+	void sort();
+
+	const Entry *find(uint16_t addr) const;
+	const Entry *findNearest(uint16_t addr) const;
+
+	size_t size() const				{ return entries.size(); }
+	const Entry *begin() const		{ return entries.data(); }
+
+private:
+	std::vector<Entry> entries;
+};
+
+// Slot of an open addressing name hash
+struct HashSlot
+{
+	uint32_t hash;		// hash of the name
+	uint32_t index;		// what the name refers to, EMPTY_SLOT if unused
+};
+
+static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+// put a slot in the first free place after its hash, in a vector of slots
+// from any allocator
+template <typename Slots>
+void insertHashSlot(Slots &slots, uint32_t hash, uint32_t index)
+{
+	size_t mask = slots.size() - 1;
+	size_t slot = hash & mask;
+
+	while (slots[slot].index != EMPTY_SLOT)
+		slot = (slot + 1) & mask;
+
+	slots[slot].hash = hash;
+	slots[slot].index = index;
+}
+
+class ObjectFile;
+
+// A range of a text segment that is kept or dropped as a whole, one PROC
+struct ProcExtent
+{
+	uint32_t start;		// offset in the text segment
+	uint32_t size;		// size in bytes
+};
+
+// A branch the assembler may shorten, an opcode followed by a 16-bit text
+// address with a relocation, and the opcode of the form that is followed by
+// an 8-bit displacement from the next instruction instead
+struct BranchSite
+{
+	uint32_t offset;	// offset of the opcode in the text segment
+	uint8_t shortOp;	// opcode of the short form
+};
+
+// Defined symbols of all the modules being linked, so that every external
+// reference is resolved with one lookup instead of a search of each module
+class GlobalSymbolTable
+{
+public:
+	struct Definition
+	{
+		const char *name;	// in the string table of the defining module
+		uint32_t module;	// index of the defining module
+		uint32_t type;		// SET_TEXT, SET_DATA or SET_BSS
+		uint32_t value;		// offset in the module segment
+		uint32_t count;		// number of modules defining the name
+	};
+
+	size_t build(const std::vector<ObjectFile*> &modules);
+	const Definition *find(const char *name) const;
+
+	// build the table by hand, the names must outlive the table
+	void reset(const std::vector<ObjectFile*> &modules, size_t names);
+	bool define(const char *name, uint32_t module, uint32_t type, uint32_t value);
+
+	uint32_t addressOf(const Definition &def) const;
+
+private:
+	const std::vector<ObjectFile*> *modules;
+	std::vector<Definition> definitions;
+	std::vector<HashSlot> slots;
+
+	uint32_t indexOf(const char *name, uint32_t hash) const;
+};
+
 // Define the object file class
 class ObjectFile
 {
@@ -98,50 +291,96 @@ protected:
 	AOUT_HEADER file_header;
 	std::string filename;
 
-	using Segment = std::vector<uint8_t>;
-		
+	// the containers allocate from the arena given to the constructor, if any
+	using Segment = std::vector<uint8_t, ArenaAllocator<uint8_t> >;
+
 	Segment text_segment;
 	Segment data_segment;
 
-	using Relocations = std::vector<RelocationEntry>;
+	using Relocations = std::vector<RelocationEntry, ArenaAllocator<RelocationEntry> >;
 	Relocations textRelocs;
 	Relocations dataRelocs;
 
-	// Make this a vector with a map of name/index pairs for lookup.
-	using SymbolTable = std::vector<std::pair<std::string, SymbolEntity> >;
-	using SymbolLookup = std::map<std::string, size_t>;
-	using SymbolRLookup = std::map<size_t, std::string>;
-
+	// Symbol names are only stored in the string table
+	using SymbolTable = std::vector<SymbolEntity, ArenaAllocator<SymbolEntity> >;
 	SymbolTable symbolTable;
-	SymbolLookup symbolLookup;
-	SymbolRLookup codeSymbolRLookup;
-	SymbolRLookup dataSymbolRLookup;
-	SymbolRLookup bssSymbolRLookup;
 
-	using StringTable = std::vector<char>;
+	// address lookups, rebuilt on first use after the symbols change
+	bool addrIndexed;
+	SymbolAddrIndex codeAddrIndex;
+	SymbolAddrIndex dataAddrIndex;
+	SymbolAddrIndex bssAddrIndex;
+
+	void buildAddrIndexes();
+
+	using StringTable = std::vector<char, ArenaAllocator<char> >;
 	StringTable stringTable;
 
+	// open addressing hash index of the symbol names, the table size is a
+	// power of two and is kept at most half full
+	using SymbolHash = std::vector<HashSlot, ArenaAllocator<HashSlot> >;
+	SymbolHash symbolHash;
+
+	void hashSymbol(uint32_t index, uint32_t hash);
+	void rehashSymbols(size_t slots);
+	size_t findSymbolIndex(const char *name, size_t len, uint32_t hash) const;
+
+	// the same kind of hash over the string table so each name is stored once
+	SymbolHash stringHash;
+	size_t stringCount;
+
+	void hashString(uint32_t offset, uint32_t hash);
+	void rehashStrings();
+	uint32_t findString(const char *name, size_t len, uint32_t hash) const;
+
 	uint32_t textBase, dataBase, bssBase;
 
+	// only the header, symbols and names were read, see readSymbols()
+	bool symbolsOnly;
+
+	// FORMAT_xxx the object file is written in
+	int format;
+
+	int indexSymbols();
+	int readAoutx(const uint8_t *buf, size_t size);
+	int readAoutxSymbols(FILE *f, size_t size);
+	void setHeader(const AOUTX_HEADER &header);
+
+	bool relocateSegment(const Relocations &relocs, Segment &segment, const GlobalSymbolTable &symbols);
+
+	// linking helpers shared by concat() and ImageWriter
+	void appendLinkedRelocs(Relocations &text, Relocations &data) const;
+	void appendLinkedRelocs(const Relocations &from, Relocations &relocs) const;
+	void resolveExternals(Relocations &relocs) const;
+
+	friend class ImageWriter;
+	friend class ProcGraph;
+
 public:
-	ObjectFile();
+	ObjectFile(Arena *arena = nullptr);
 	virtual ~ObjectFile();
 
 	void clear();
 
 	bool isValid() 
 	{ 
-		return file_header.a_magic == 263 && file_header.a_text > 0;
+		return file_header.a_magic == AOUT_MAGIC && file_header.a_text > 0;
 	}
 
 	// file IO
+	void setFormat(int format)	{ this->format = format; }
+	int getFormat() const		{ return format; }
+
 	int writeFile(FILE *fptr);
-	int writeFile(const std::string &name);
+	int writeFile(const std::string &name, bool atomic = false);
+	void writeBuffer(std::vector<uint8_t> &buf);
 	int readFile(FILE *fptr);
 	int readFile(const std::string &name);
+	int readBuffer(const uint8_t *buf, size_t size);
+	int readSymbols(const std::string &name);
 
 	// stripping options
-	void stripSymbols()		{ symbolTable.clear(); stringTable.clear();  }
+	void stripSymbols();
 	void stripRelocations() { textRelocs.clear(); dataRelocs.clear(); }
 
 	// code/data segments
@@ -149,8 +388,8 @@ public:
 	uint32_t addData(uint8_t item);
 	uint32_t allocBSS(size_t size);
 
-	uint32_t getTextSize() const		{ return text_segment.size(); }
-	uint32_t getDataSize() const		{ return data_segment.size(); }
+	uint32_t getTextSize() const		{ return symbolsOnly ? file_header.a_text : text_segment.size(); }
+	uint32_t getDataSize() const		{ return symbolsOnly ? file_header.a_data : data_segment.size(); }
 	uint32_t getBssSize() const			{ return file_header.a_bss; }
 	uint32_t getEntryPoint() const		{ return file_header.a_entry; }
 
@@ -170,19 +409,41 @@ public:
 
 	// symbols
 	void addSymbol(const std::string &name, SymbolEntity &sym);
+	void addSymbol(const char *name, size_t len, SymbolEntity &sym);
 	uint32_t addString(const std::string &name);
+	uint32_t addString(const char *name, size_t len);
+	void mergeStrings();
 	size_t indexOfSymbol(const std::string &name);
 	SymbolEntity symbolAt(size_t index);
+	const char *symbolName(size_t index) const { return &stringTable[symbolTable[index].nameOffset]; }
+	size_t getSymbolCount() const	{ return symbolTable.size(); }
 	bool findSymbol(const std::string &name, SymbolEntity &sym);
-	bool findCodeSymbolByAddr(uint16_t addr, std::string &name);
-	bool findDataSymbolByAddr(uint16_t addr, std::string &name);
-	bool findNearestCodeSymbolToAddr(uint16_t addr, std::string &name, uint16_t &symAddr);
+	const char *findCodeSymbolByAddr(uint16_t addr);
+	const char *findDataSymbolByAddr(uint16_t addr);
+	const char *findNearestCodeSymbolToAddr(uint16_t addr, uint16_t &symAddr);
 
 	// relocations
 	void addTextRelocation(RelocationEntry&);
 	void addDataRelocation(RelocationEntry&);
-	bool relocate(const std::vector<ObjectFile*>&);
+	bool relocate(const GlobalSymbolTable&);
+	void beginConcat(const std::vector<ObjectFile*> &modules);
 	void concat(ObjectFile *rhs);
+	void endConcat();
+	void mergeSymbols(ObjectFile *rhs);
+
+	// dead code elimination
+	void getProcExtents(std::vector<ProcExtent> &extents) const;
+	uint32_t removeDeadCode(const std::vector<ProcExtent> &live);
+
+	// branch relaxation
+	uint32_t relaxBranches(const std::vector<BranchSite> &sites);
+
+	// incremental linking, this object file is the linked image
+	size_t replaceModule(uint32_t index, const ObjectFile &module, const GlobalSymbolTable &symbols, size_t firstReloc, size_t relocCount, size_t firstDataReloc, size_t dataRelocCount, uint32_t textSlot, uint32_t dataSlot, uint32_t oldBssSize);
+	void patchReference(uint32_t segment, uint32_t offset, uint32_t relocIndex, uint32_t addr);
+
+	const Relocations &getTextRelocs() const { return textRelocs; }
+	const Relocations &getDataRelocs() const { return dataRelocs; }
 
 	uint32_t getTextRelocSize() const { return file_header.a_trsize; }
 	uint32_t getDataRelocSize() const { return file_header.a_drsize; }
@@ -196,10 +457,192 @@ public:
 	void dumpSymbols(FILE*);
 };
 
+// Reference graph of the procedures of the modules being linked. A text
+// relocation is an edge from the procedure it is in to the procedure it
+// refers to, so only what the roots reach needs to be linked.
+class ProcGraph
+{
+	struct Node
+	{
+		uint32_t module;	// index of the module
+		ProcExtent extent;	// the procedure in the module's text segment
+		bool live;
+	};
+
+	const std::vector<ObjectFile*> *modules;
+	const GlobalSymbolTable *symbols;
+
+	std::vector<Node> nodes;
+	std::vector<uint32_t> firstNode;	// the nodes of module m start at firstNode[m]
+	std::vector<std::vector<uint32_t> > edges;
+	std::vector<uint32_t> roots;
+
+	uint32_t nodeAt(uint32_t module, uint32_t offset) const;
+	uint32_t targetOf(uint32_t module, const RelocationEntry &re, const ObjectFile::Segment &segment) const;
+
+public:
+	void build(const std::vector<ObjectFile*> &modules, const GlobalSymbolTable &symbols);
+	void addRoot(uint32_t module, uint32_t offset);
+	bool addRoot(const char *name);
+	uint32_t sweep();
+};
+
+// Writes a linked executable one module at a time, straight to the final
+// offsets in the file, so only the symbols and one module are in memory.
+class ImageWriter
+{
+	FILE *f;
+	std::string name;
+	std::string tmpName;
+	int result;
+
+	uint32_t textBase, dataBase;	// bases of the first module
+	uint32_t textSize, dataSize;
+	uint32_t bssSize;
+
+	long relocStart;				// where the text relocations start
+	long relocPos;					// where the next module's relocations go
+	bool first;
+
+	// the first module's relocations are written once the symbols are merged,
+	// the data relocations of all the modules follow the text ones
+	ObjectFile::Relocations firstTextRelocs;
+	ObjectFile::Relocations dataRelocs;
+
+	void write(long pos, const void *buf, size_t size);
+
+public:
+	ImageWriter();
+	~ImageWriter();
+
+	int open(const std::string &name, const std::vector<ObjectFile*> &modules);
+	int writeModule(ObjectFile &module);
+	int close(ObjectFile &image);
+};
+
+// Read-only view of an object file mapped into memory. Nothing is copied,
+// the segments, relocations, symbols and names are read straight from the
+// mapping and the symbol indexes are only built once a lookup needs them.
+class ObjectFileView
+{
+protected:
+	AOUT_HEADER file_header;
+	std::string filename;
+
+	const uint8_t *base;		// start of the mapping
+	size_t size;
+
+	const uint8_t *text;
+	const uint8_t *data;
+	const uint8_t *textRelocs;	// entries may be unaligned, see textRelocAt()
+	const uint8_t *dataRelocs;
+	const uint8_t *symbols;
+	const char *strings;
+	size_t stringSize;
+
+	// the section directory of an extended file and its encoded
+	// sections, decoded
+	std::vector<AoutxSection> directory;
+	std::vector<std::vector<uint8_t> > decoded;
+
+	int openAoutx();
+
+	// lazily built indexes
+	using NameIndex = std::vector<uint32_t>;
+
+	bool indexed;
+	NameIndex nameIndex;
+	SymbolAddrIndex codeIndex;
+	SymbolAddrIndex dataIndex;
+	SymbolAddrIndex bssIndex;
+
+	// optional direct maps for every 16 bit address, see buildAddrMaps()
+	static const uint32_t NO_SYMBOL = 0xFFFFFFFF;
+
+	std::vector<uint32_t> codeMap;		// name offset of the code symbol at each address
+	std::vector<uint32_t> dataMap;		// name offset of the data or bss symbol at each address
+	std::vector<uint32_t> nearestMap;	// codeIndex entry of the nearest code symbol
+
+	void buildIndexes();
+	const char *nameAt(uint32_t offset) const;
+
+public:
+	ObjectFileView();
+	virtual ~ObjectFileView();
+
+	int open(const std::string &name);
+	void close();
+
+	bool isValid() const
+	{
+		return base != nullptr && file_header.a_magic == AOUT_MAGIC && file_header.a_text > 0;
+	}
+
+	// code/data segments
+	uint32_t getTextSize() const		{ return base ? file_header.a_text : 0; }
+	uint32_t getDataSize() const		{ return base ? file_header.a_data : 0; }
+	uint32_t getBssSize() const			{ return file_header.a_bss; }
+	uint32_t getEntryPoint() const		{ return file_header.a_entry; }
+
+	const uint8_t *textPtr() const		{ return text; }
+	const uint8_t *dataPtr() const		{ return data; }
+
+	// relocations
+	uint32_t getTextRelocSize() const	{ return file_header.a_trsize; }
+	uint32_t getDataRelocSize() const	{ return file_header.a_drsize; }
+	RelocationEntry textRelocAt(size_t index) const;
+	RelocationEntry dataRelocAt(size_t index) const;
+
+	// symbols
+	size_t getSymbolCount() const		{ return base ? file_header.a_syms : 0; }
+	SymbolEntity symbolAt(size_t index) const;
+	const char *symbolName(size_t index) const;
+	bool findSymbol(const std::string &name, SymbolEntity &sym);
+	const char *findCodeSymbolByAddr(uint16_t addr);
+	const char *findDataSymbolByAddr(uint16_t addr);
+	const char *findNearestCodeSymbolToAddr(uint16_t addr, uint16_t &symAddr);
+
+	// trade 768K for constant time address lookups
+	void buildAddrMaps();
+
+	// debug output
+	void dumpHeader(FILE*);
+	void dumpDirectory(FILE*);
+	void dumpText(FILE*);
+	void dumpData(FILE*);
+	void dumpTextRelocs(FILE*);
+	void dumpDataRelocs(FILE*);
+	void dumpSymbols(FILE*);
+};
+
 // helper functions
-void hexDumpGroup(FILE *f, uint8_t *buf);
-void hexDumpLine(FILE *f, uint32_t offset, uint8_t *buf);
-void hexDumpSegment(FILE *f, uint8_t *seg, size_t size);
+uint32_t hashName(const char *name, size_t len);
+uint64_t hashBytes(const void *buf, size_t size, uint64_t hash = 0xCBF29CE484222325ull);
+int readWholeFile(const char *name, std::vector<uint8_t> &buf);
+int replaceFile(const std::string &tmpName, const std::string &name);
+int writeFileAtomic(const std::string &name, const std::function<bool(FILE*)> &write, const char *suffix = ".tmp");
+bool validateHeader(const AOUT_HEADER &header, size_t fileSize);
+void dumpHeader(FILE *f, const AOUT_HEADER &header);
+void dumpRelocation(FILE *f, const RelocationEntry &re, const char *name);
+void dumpSymbol(FILE *f, const char *name, const SymbolEntity &se);
+void hexDumpGroup(FILE *f, const uint8_t *buf);
+void hexDumpLine(FILE *f, uint32_t offset, const uint8_t *buf);
+void hexDumpSegment(FILE *f, const uint8_t *seg, size_t size);
+
+// extended format helper functions
+bool isAoutx(const uint8_t *buf, size_t size);
+uint32_t crc32(const uint8_t *buf, size_t size);
+void lzCompress(const uint8_t *src, size_t size, std::vector<uint8_t> &out);
+int lzDecompress(const uint8_t *src, size_t size, uint8_t *dest, size_t length);
+void packTable(uint32_t type, const uint8_t *src, size_t size, std::vector<uint8_t> &out);
+int unpackTable(uint32_t type, const uint8_t *src, size_t size, uint8_t *dest, size_t length);
+int decodeSection(const AoutxSection &sect, const uint8_t *stored, uint8_t *dest);
+int readSection(FILE *f, const AoutxSection &sect, uint8_t *dest);
+void encodeAoutx(const uint8_t *buf, size_t size, int format, std::vector<uint8_t> &out);
+int convertFile(const std::string &name, int format);
+const char *getSectionName(uint32_t type);
+const char *getEncodingName(uint32_t encoding);
+void dumpSection(FILE *f, const AoutxSection &sect);
 
 #endif // __AOUT_H
 
@@ -0,0 +1,732 @@
+#include "aout.h"
+#include <assert.h>
+#include <string.h>
+
+//
+// Extended a.out container
+//
+// The readers decode the extended format into the same in-memory layout as
+// an a.out file, so everything past the reader works on either format. The
+// writers lay out an a.out file and encode it, see encodeAoutx().
+//
+
+static const size_t LZ_MIN_MATCH = 4;
+static const int LZ_HASH_BITS = 12;
+static const size_t LZ_MAX_OFFSET = 0xFFFF;
+
+// the size of an entry of each type of section
+static const size_t g_sectionItemSize[SECT_COUNT] = {
+	1, 1, sizeof(RelocationEntry), sizeof(RelocationEntry), sizeof(SymbolEntity), 1
+};
+
+//
+AoutxDirectory::AoutxDirectory()
+{
+	memset(&header, 0, sizeof(header));
+}
+
+// check the directory against the size of the file
+int AoutxDirectory::validate(size_t fileSize)
+{
+	bool seen[SECT_COUNT] = { false };
+
+	for (auto it = sections.begin(); it != sections.end(); it++)
+	{
+		if ((uint64_t)it->offset + it->size > fileSize)
+			return EOF;
+
+		if (it->encoding >= ENC_COUNT)
+			return EOF;
+
+		if (it->encoding == ENC_RAW && it->size != it->length)
+			return EOF;
+
+		// sections of newer versions are skipped, known ones appear once
+		if (it->type >= SECT_COUNT)
+			continue;
+
+		if (seen[it->type] || it->length % g_sectionItemSize[it->type])
+			return EOF;
+
+		// only tables of relocations or symbols are packed
+		if (it->encoding == ENC_VARINT && g_sectionItemSize[it->type] == 1)
+			return EOF;
+
+		seen[it->type] = true;
+	}
+
+	return 0;
+}
+
+// read the directory of an extended file in memory
+int AoutxDirectory::read(const uint8_t *buf, size_t size)
+{
+	sections.clear();
+
+	if (!isAoutx(buf, size) || size < sizeof(header))
+		return EOF;
+
+	memcpy(&header, buf, sizeof(header));
+
+	if (header.ax_version != AOUTX_VERSION || header.ax_sections < 0 || header.ax_sections > AOUTX_MAX_SECTIONS)
+		return EOF;
+
+	size_t dirSize = header.ax_sections * sizeof(AoutxSection);
+	if (size - sizeof(header) < dirSize || crc32(buf + sizeof(header), dirSize) != header.ax_checksum)
+		return EOF;
+
+	sections.resize(header.ax_sections);
+	if (dirSize)
+		memcpy(sections.data(), buf + sizeof(header), dirSize);
+
+	return validate(size);
+}
+
+// read the directory of an extended file, the file is left at an unknown
+// position
+int AoutxDirectory::read(FILE *f, size_t fileSize)
+{
+	sections.clear();
+
+	if (fileSize < sizeof(header) || fseek(f, 0, SEEK_SET) || fread(&header, sizeof(header), 1, f) != 1)
+		return EOF;
+
+	if (header.ax_magic != AOUTX_MAGIC || header.ax_version != AOUTX_VERSION || header.ax_sections < 0 || header.ax_sections > AOUTX_MAX_SECTIONS)
+		return EOF;
+
+	size_t dirSize = header.ax_sections * sizeof(AoutxSection);
+	if (fileSize - sizeof(header) < dirSize)
+		return EOF;
+
+	sections.resize(header.ax_sections);
+	if (dirSize && fread(sections.data(), dirSize, 1, f) != 1)
+		return EOF;
+
+	if (crc32((const uint8_t *)sections.data(), dirSize) != header.ax_checksum)
+		return EOF;
+
+	return validate(fileSize);
+}
+
+// find a section in the directory, nullptr if there is none
+const AoutxSection *AoutxDirectory::find(uint32_t type) const
+{
+	for (auto it = sections.begin(); it != sections.end(); it++)
+	{
+		if (it->type == type)
+			return &*it;
+	}
+
+	return nullptr;
+}
+
+// the decoded length of a section, 0 if there is none
+uint32_t AoutxDirectory::lengthOf(uint32_t type) const
+{
+	auto sect = find(type);
+	return sect ? sect->length : 0;
+}
+
+// check if a buffer starts with the extended magic number
+bool isAoutx(const uint8_t *buf, size_t size)
+{
+	int magic = 0;
+	if (size >= sizeof(magic))
+		memcpy(&magic, buf, sizeof(magic));
+
+	return magic == AOUTX_MAGIC;
+}
+
+// CRC-32 (IEEE 802.3) of a buffer
+uint32_t crc32(const uint8_t *buf, size_t size)
+{
+	struct Table
+	{
+		uint32_t entries[256];
+
+		Table()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+				entries[i] = c;
+			}
+		}
+	};
+
+	// built once, on first use, by whichever thread gets here first
+	static const Table table;
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < size; i++)
+		crc = table.entries[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+// Compress a buffer as a sequence of literal runs and matches. Each
+// sequence is a token byte, with the literal count in the high nibble and
+// the match length less LZ_MIN_MATCH in the low nibble, the literals and the
+// 16-bit offset back to the match. A nibble of 15 is followed by bytes that
+// are added to it up to and including the first one less than 255. The last
+// sequence only has literals.
+void lzCompress(const uint8_t *src, size_t size, std::vector<uint8_t> &out)
+{
+	out.clear();
+	out.reserve(size + size / 255 + 16);
+
+	auto putLength = [&](size_t n) {
+		for (; n >= 255; n -= 255)
+			out.push_back(255);
+		out.push_back((uint8_t)n);
+	};
+
+	auto putSequence = [&](size_t literal, size_t count, size_t offset, size_t match) {
+		size_t matchCode = match ? match - LZ_MIN_MATCH : 0;
+
+		out.push_back((uint8_t)(((count < 15 ? count : 15) << 4) | (matchCode < 15 ? matchCode : 15)));
+		if (count >= 15)
+			putLength(count - 15);
+
+		out.insert(out.end(), src + literal, src + literal + count);
+
+		if (match)
+		{
+			out.push_back(LOBYTE(offset));
+			out.push_back(HIBYTE(offset));
+			if (matchCode >= 15)
+				putLength(matchCode - 15);
+		}
+	};
+
+	// the last position each 4 byte sequence was seen at
+	std::vector<uint32_t> table(1 << LZ_HASH_BITS, UINT32_MAX);
+
+	size_t anchor = 0;
+	size_t i = 0;
+
+	while (i + LZ_MIN_MATCH <= size)
+	{
+		uint32_t seq;
+		memcpy(&seq, src + i, sizeof(seq));
+
+		uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		size_t candidate = table[h];
+		table[h] = (uint32_t)i;
+
+		if (candidate == UINT32_MAX || i - candidate > LZ_MAX_OFFSET || memcmp(src + candidate, src + i, LZ_MIN_MATCH))
+		{
+			i++;
+			continue;
+		}
+
+		size_t match = LZ_MIN_MATCH;
+		while (i + match < size && src[candidate + match] == src[i + match])
+			match++;
+
+		putSequence(anchor, i - anchor, i - candidate, match);
+
+		i += match;
+		anchor = i;
+	}
+
+	putSequence(anchor, size - anchor, 0, 0);
+}
+
+// Decompress a buffer made by lzCompress() straight into the destination,
+// which must be exactly the original length. Returns EOF if the compressed
+// data is damaged.
+int lzDecompress(const uint8_t *src, size_t size, uint8_t *dest, size_t length)
+{
+	const uint8_t *ip = src;
+	const uint8_t *end = src + size;
+	size_t op = 0;
+
+	auto getLength = [&](size_t &n) -> bool {
+		uint8_t b;
+		do
+		{
+			if (ip == end)
+				return false;
+
+			b = *ip++;
+			n += b;
+		} while (b == 255);
+
+		return true;
+	};
+
+	while (ip < end)
+	{
+		uint8_t token = *ip++;
+
+		size_t count = token >> 4;
+		if (count == 15 && !getLength(count))
+			return EOF;
+
+		if (count > (size_t)(end - ip) || count > length - op)
+			return EOF;
+
+		memcpy(dest + op, ip, count);
+		ip += count;
+		op += count;
+
+		// the last sequence has no match
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return EOF;
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t match = token & 15;
+		if (match == 15 && !getLength(match))
+			return EOF;
+
+		match += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > op || match > length - op)
+			return EOF;
+
+		// the match may overlap the bytes it produces
+		for (size_t k = 0; k < match; k++, op++)
+			dest[op] = dest[op - offset];
+	}
+
+	return op == length ? 0 : EOF;
+}
+
+// write a value as a varint, 7 bits a byte with the high bit set on all but
+// the last byte
+static void putVarint(std::vector<uint8_t> &out, uint32_t value)
+{
+	for (; value >= 0x80; value >>= 7)
+		out.push_back((uint8_t)(value | 0x80));
+
+	out.push_back((uint8_t)value);
+}
+
+// read a varint, false if it runs past the end of the buffer
+static inline bool getVarint(const uint8_t *&ip, const uint8_t *end, uint32_t &value)
+{
+	// most deltas, types and flags fit in a single byte
+	if (ip < end && *ip < 0x80)
+	{
+		value = *ip++;
+		return true;
+	}
+
+	value = 0;
+	for (int shift = 0; shift < 35 && ip < end; shift += 7)
+	{
+		uint8_t b = *ip++;
+		value |= (uint32_t)(b & 0x7F) << shift;
+
+		if (!(b & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+// map signed deltas to unsigned values, small either way round
+static inline uint32_t zigzag(uint32_t delta)
+{
+	return (delta << 1) ^ (0 - (delta >> 31));
+}
+
+static inline uint32_t unzigzag(uint32_t value)
+{
+	return (value >> 1) ^ (0 - (value & 1));
+}
+
+// Pack a table of relocations or symbols as varints. A relocation is the
+// delta from the address of the one before it, then its flag bits and its
+// index. A symbol is the delta from the name offset of the one before it,
+// then its type and its value. The deltas allow for tables that are not
+// sorted, so the table unpacks exactly as it was.
+void packTable(uint32_t type, const uint8_t *src, size_t size, std::vector<uint8_t> &out)
+{
+	assert(type == SECT_TEXT_RELOCS || type == SECT_DATA_RELOCS || type == SECT_SYMBOLS);
+
+	out.clear();
+	out.reserve(size / 2);
+
+	uint32_t last = 0;
+
+	if (type == SECT_SYMBOLS)
+	{
+		for (size_t i = 0; i + sizeof(SymbolEntity) <= size; i += sizeof(SymbolEntity))
+		{
+			SymbolEntity se;
+			memcpy(&se, src + i, sizeof(se));
+
+			putVarint(out, zigzag(se.nameOffset - last));
+			putVarint(out, se.type);
+			putVarint(out, se.value);
+
+			last = se.nameOffset;
+		}
+
+		return;
+	}
+
+	for (size_t i = 0; i + sizeof(RelocationEntry) <= size; i += sizeof(RelocationEntry))
+	{
+		// the address and the word of bit fields, moving the flags below the
+		// index
+		uint32_t words[2];
+		memcpy(words, src + i, sizeof(words));
+
+		putVarint(out, zigzag(words[0] - last));
+		putVarint(out, (words[1] << 8) | (words[1] >> 24));
+
+		last = words[0];
+	}
+}
+
+// Unpack a table made by packTable() straight into the destination, which
+// must be exactly the original length. Returns EOF if the packed data is
+// damaged.
+int unpackTable(uint32_t type, const uint8_t *src, size_t size, uint8_t *dest, size_t length)
+{
+	const uint8_t *ip = src;
+	const uint8_t *end = src + size;
+	uint32_t last = 0;
+
+	if (type == SECT_SYMBOLS)
+	{
+		for (size_t op = 0; op + sizeof(SymbolEntity) <= length; op += sizeof(SymbolEntity))
+		{
+			uint32_t delta;
+			SymbolEntity se;
+
+			if (!getVarint(ip, end, delta) || !getVarint(ip, end, se.type) || !getVarint(ip, end, se.value))
+				return EOF;
+
+			last += unzigzag(delta);
+			se.nameOffset = last;
+
+			memcpy(dest + op, &se, sizeof(se));
+		}
+
+		return ip == end ? 0 : EOF;
+	}
+
+	if (type != SECT_TEXT_RELOCS && type != SECT_DATA_RELOCS)
+		return EOF;
+
+	for (size_t op = 0; op + sizeof(RelocationEntry) <= length; op += sizeof(RelocationEntry))
+	{
+		uint32_t delta, bits;
+		if (!getVarint(ip, end, delta) || !getVarint(ip, end, bits))
+			return EOF;
+
+		last += unzigzag(delta);
+
+		uint32_t words[2] = { last, (bits >> 8) | (bits << 24) };
+		memcpy(dest + op, words, sizeof(words));
+	}
+
+	return ip == end ? 0 : EOF;
+}
+
+// check and decode a stored section into a buffer of its decoded length
+int decodeSection(const AoutxSection &sect, const uint8_t *stored, uint8_t *dest)
+{
+	if (crc32(stored, sect.size) != sect.checksum)
+		return EOF;
+
+	if (sect.encoding == ENC_LZ)
+		return lzDecompress(stored, sect.size, dest, sect.length);
+
+	if (sect.encoding == ENC_VARINT)
+		return unpackTable(sect.type, stored, sect.size, dest, sect.length);
+
+	if (sect.length)
+		memcpy(dest, stored, sect.length);
+
+	return 0;
+}
+
+// read, check and decode a section of an extended file
+int readSection(FILE *f, const AoutxSection &sect, uint8_t *dest)
+{
+	std::vector<uint8_t> stored(sect.size);
+
+	if (fseek(f, sect.offset, SEEK_SET))
+		return EOF;
+
+	if (!stored.empty() && fread(stored.data(), stored.size(), 1, f) != 1)
+		return EOF;
+
+	return decodeSection(sect, stored.data(), dest);
+}
+
+// Encode an a.out file in memory in the extended format. FORMAT_AOUTX_COMPACT
+// compresses the text and data segments and packs the relocations and
+// symbols, where that makes them smaller.
+void encodeAoutx(const uint8_t *buf, size_t size, int format, std::vector<uint8_t> &out)
+{
+	AOUT_HEADER aout;
+	memcpy(&aout, buf, sizeof(aout));
+	assert(validateHeader(aout, size));
+
+	// the sections in a.out file order
+	size_t lengths[SECT_COUNT];
+	lengths[SECT_TEXT] = aout.a_text;
+	lengths[SECT_DATA] = aout.a_data;
+	lengths[SECT_TEXT_RELOCS] = aout.a_trsize * sizeof(RelocationEntry);
+	lengths[SECT_DATA_RELOCS] = aout.a_drsize * sizeof(RelocationEntry);
+	lengths[SECT_SYMBOLS] = aout.a_syms * sizeof(SymbolEntity);
+	lengths[SECT_STRINGS] = size - sizeof(aout) - lengths[SECT_TEXT] - lengths[SECT_DATA] - lengths[SECT_TEXT_RELOCS] - lengths[SECT_DATA_RELOCS] - lengths[SECT_SYMBOLS];
+
+	AOUTX_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.ax_magic = AOUTX_MAGIC;
+	header.ax_version = AOUTX_VERSION;
+	header.ax_sections = SECT_COUNT;
+	header.ax_bss = aout.a_bss;
+	header.ax_entry = aout.a_entry;
+
+	std::vector<AoutxSection> sections(SECT_COUNT);
+
+	out.assign(sizeof(header) + sections.size() * sizeof(AoutxSection), 0);
+
+	const uint8_t *p = buf + sizeof(aout);
+	std::vector<uint8_t> packed;
+
+	for (uint32_t type = 0; type < SECT_COUNT; type++)
+	{
+		auto &sect = sections[type];
+		const uint8_t *stored = p;
+
+		sect.type = type;
+		sect.encoding = ENC_RAW;
+		sect.offset = out.size();
+		sect.size = lengths[type];
+		sect.length = lengths[type];
+
+		if (format == FORMAT_AOUTX_COMPACT && type != SECT_STRINGS && lengths[type])
+		{
+			uint32_t encoding = ENC_LZ;
+			if (type == SECT_TEXT || type == SECT_DATA)
+				lzCompress(p, lengths[type], packed);
+			else
+			{
+				encoding = ENC_VARINT;
+				packTable(type, p, lengths[type], packed);
+			}
+
+			if (packed.size() < lengths[type])
+			{
+				sect.encoding = encoding;
+				sect.size = packed.size();
+				stored = packed.data();
+			}
+		}
+
+		sect.checksum = crc32(stored, sect.size);
+		out.insert(out.end(), stored, stored + sect.size);
+
+		p += lengths[type];
+	}
+
+	header.ax_checksum = crc32((const uint8_t *)sections.data(), sections.size() * sizeof(AoutxSection));
+
+	memcpy(out.data(), &header, sizeof(header));
+	memcpy(out.data() + sizeof(header), sections.data(), sections.size() * sizeof(AoutxSection));
+}
+
+// rewrite an a.out file in place in another format
+int convertFile(const std::string &name, int format)
+{
+	ObjectFile obj;
+	if (obj.readFile(name))
+		return EOF;
+
+	obj.setFormat(format);
+
+	return obj.writeFile(name);
+}
+
+// get the name of a section type
+const char *getSectionName(uint32_t type)
+{
+	static const char *names[SECT_COUNT] = { ".text", ".data", ".trel", ".drel", ".syms", ".strs" };
+
+	return type < SECT_COUNT ? names[type] : "unknown";
+}
+
+// get the name of a section encoding
+const char *getEncodingName(uint32_t encoding)
+{
+	static const char *names[ENC_COUNT] = { "raw", "lz", "varint" };
+
+	return encoding < ENC_COUNT ? names[encoding] : "unknown";
+}
+
+// output a single section directory entry
+void dumpSection(FILE *f, const AoutxSection &sect)
+{
+	fprintf(f, "%8s\t%-6s\toffset: " HEX_PREFIX "%04X\tsize: %d\tlength: %d\tcrc: %08X\n", getSectionName(sect.type),
+		getEncodingName(sect.encoding), sect.offset, sect.size, sect.length, sect.checksum);
+}
+
+// read an object file in the extended format from memory, each section is
+// decoded straight into its place
+int ObjectFile::readAoutx(const uint8_t *buf, size_t size)
+{
+	AoutxDirectory dir;
+	if (dir.read(buf, size))
+		return EOF;
+
+	auto load = [&](uint32_t type, void *dest) -> int {
+		auto sect = dir.find(type);
+		return sect ? decodeSection(*sect, buf + sect->offset, (uint8_t *)dest) : 0;
+	};
+
+	text_segment.resize(dir.lengthOf(SECT_TEXT));
+	data_segment.resize(dir.lengthOf(SECT_DATA));
+	textRelocs.resize(dir.lengthOf(SECT_TEXT_RELOCS) / sizeof(RelocationEntry));
+	dataRelocs.resize(dir.lengthOf(SECT_DATA_RELOCS) / sizeof(RelocationEntry));
+	symbolTable.resize(dir.lengthOf(SECT_SYMBOLS) / sizeof(SymbolEntity));
+	stringTable.resize(dir.lengthOf(SECT_STRINGS));
+
+	bool ok = !load(SECT_TEXT, text_segment.data()) && !load(SECT_DATA, data_segment.data());
+	ok = ok && !load(SECT_TEXT_RELOCS, textRelocs.data()) && !load(SECT_DATA_RELOCS, dataRelocs.data());
+	ok = ok && !load(SECT_SYMBOLS, symbolTable.data()) && !load(SECT_STRINGS, stringTable.data());
+
+	if (!ok)
+	{
+		clear();
+		return EOF;
+	}
+
+	setHeader(dir.getHeader());
+
+	return indexSymbols();
+}
+
+// read only the header, symbols and names of an extended file
+int ObjectFile::readAoutxSymbols(FILE *f, size_t size)
+{
+	AoutxDirectory dir;
+	if (dir.read(f, size))
+		return EOF;
+
+	symbolTable.resize(dir.lengthOf(SECT_SYMBOLS) / sizeof(SymbolEntity));
+	stringTable.resize(dir.lengthOf(SECT_STRINGS));
+
+	auto symbols = dir.find(SECT_SYMBOLS);
+	auto strings = dir.find(SECT_STRINGS);
+
+	if ((symbols && readSection(f, *symbols, (uint8_t *)symbolTable.data())) || (strings && readSection(f, *strings, (uint8_t *)stringTable.data())))
+	{
+		clear();
+		return EOF;
+	}
+
+	setHeader(dir.getHeader());
+
+	// the segment sizes come from the directory
+	file_header.a_text = dir.lengthOf(SECT_TEXT);
+	file_header.a_data = dir.lengthOf(SECT_DATA);
+	file_header.a_trsize = dir.lengthOf(SECT_TEXT_RELOCS) / sizeof(RelocationEntry);
+	file_header.a_drsize = dir.lengthOf(SECT_DATA_RELOCS) / sizeof(RelocationEntry);
+
+	return 0;
+}
+
+// fill in the a.out header of an extended file, once its sections are read
+void ObjectFile::setHeader(const AOUTX_HEADER &header)
+{
+	memset(&file_header, 0, sizeof(file_header));
+	file_header.a_magic = AOUT_MAGIC;
+	file_header.a_text = text_segment.size();
+	file_header.a_data = data_segment.size();
+	file_header.a_bss = header.ax_bss;
+	file_header.a_syms = symbolTable.size();
+	file_header.a_entry = header.ax_entry;
+	file_header.a_trsize = textRelocs.size();
+	file_header.a_drsize = dataRelocs.size();
+}
+
+// Locate the sections of a mapped extended file. Raw sections are used in
+// place, encoded ones are decoded into buffers owned by the view.
+int ObjectFileView::openAoutx()
+{
+	AoutxDirectory dir;
+	if (dir.read(base, size))
+		return EOF;
+
+	directory = dir.getSections();
+	decoded.assign(SECT_COUNT, std::vector<uint8_t>());
+
+	const uint8_t *sections[SECT_COUNT];
+	for (uint32_t type = 0; type < SECT_COUNT; type++)
+	{
+		sections[type] = base;
+
+		auto sect = dir.find(type);
+		if (!sect)
+			continue;
+
+		if (sect->encoding == ENC_RAW)
+		{
+			if (crc32(base + sect->offset, sect->size) != sect->checksum)
+				return EOF;
+
+			sections[type] = base + sect->offset;
+		}
+		else
+		{
+			decoded[type].resize(sect->length);
+			if (decodeSection(*sect, base + sect->offset, decoded[type].data()))
+				return EOF;
+
+			sections[type] = decoded[type].data();
+		}
+	}
+
+	memset(&file_header, 0, sizeof(file_header));
+	file_header.a_magic = AOUT_MAGIC;
+	file_header.a_text = dir.lengthOf(SECT_TEXT);
+	file_header.a_data = dir.lengthOf(SECT_DATA);
+	file_header.a_bss = dir.getHeader().ax_bss;
+	file_header.a_syms = dir.lengthOf(SECT_SYMBOLS) / sizeof(SymbolEntity);
+	file_header.a_entry = dir.getHeader().ax_entry;
+	file_header.a_trsize = dir.lengthOf(SECT_TEXT_RELOCS) / sizeof(RelocationEntry);
+	file_header.a_drsize = dir.lengthOf(SECT_DATA_RELOCS) / sizeof(RelocationEntry);
+
+	text = sections[SECT_TEXT];
+	data = sections[SECT_DATA];
+	textRelocs = sections[SECT_TEXT_RELOCS];
+	dataRelocs = sections[SECT_DATA_RELOCS];
+	symbols = sections[SECT_SYMBOLS];
+	strings = (const char *)sections[SECT_STRINGS];
+	stringSize = dir.lengthOf(SECT_STRINGS);
+
+	return 0;
+}
+
+// output the section directory of an extended file
+void ObjectFileView::dumpDirectory(FILE *f)
+{
+	assert(f != nullptr);
+	if (f == nullptr || directory.empty())
+		return;
+
+	fprintf(f, "Extended Format Sections\n");
+	fprintf(f, "------------------------\n\n");
+
+	for (auto it = directory.begin(); it != directory.end(); it++)
+		dumpSection(f, *it);
+
+	fputc('\n', f);
+}
@@ -0,0 +1,116 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../archive.h"
+#include <stdio.h>
+
+//
+// Command line switches
+//
+bool g_bList = false;
+const char *g_szOutputFilename = "lib.a";
+
+//
+// show usage
+//
+void usage()
+{
+	puts("\nusage: ar [options] filename...\n");
+	puts("-o file\tset output filename");
+	puts("-t\tlist the members and symbols of an archive\n");
+
+	exit(0);
+}
+
+//
+// get options from the command line
+//
+int getopt(int n, char *args[])
+{
+	int i;
+	for (i = 1; i < n && args[i][0] == '-'; i++)
+	{
+		if (args[i][1] == 't')
+			g_bList = true;
+
+		if (args[i][1] == 'o')
+		{
+			g_szOutputFilename = args[i + 1];
+			i++;
+			continue;
+		}
+	}
+
+	return i;
+}
+
+// list the members of an archive and the symbols each one defines
+int list(const char *name)
+{
+	Archive ar;
+	if (ar.readIndex(name))
+	{
+		printf("Unable to read archive '%s'!\n", name);
+		return -1;
+	}
+
+	for (size_t i = 0; i < ar.getMemberCount(); i++)
+	{
+		printf("%s (%u bytes)\n", ar.memberName(i), ar.memberSize(i));
+
+		for (size_t j = 0; j < ar.getSymbolCount(); j++)
+		{
+			if (ar.symbolMember(j) == i)
+				printf("\t%s\n", ar.symbolName(j));
+		}
+	}
+
+	return 0;
+}
+
+//
+int main(int argc, char *argv[])
+{
+	if (argc == 1)
+		usage();
+
+	int iFirstArg = getopt(argc, argv);
+	if (iFirstArg >= argc)
+		usage();
+
+	if (g_bList)
+		return list(argv[iFirstArg]);
+
+	// add each object file to the archive
+	Archive ar;
+	for (int i = iFirstArg; i < argc; i++)
+	{
+		std::vector<uint8_t> buf;
+		if (readWholeFile(argv[i], buf))
+		{
+			printf("Unable to read object file '%s'!\n", argv[i]);
+			return -1;
+		}
+
+		auto duplicates = ar.addMember(argv[i], buf);
+		if (duplicates < 0)
+		{
+			printf("'%s' is not a valid object file!\n", argv[i]);
+			return -1;
+		}
+
+		printf("%s\n", argv[i]);
+		if (duplicates)
+			printf("Warning: %d symbols of '%s' are already defined by an earlier member\n", duplicates, argv[i]);
+	}
+
+	// write out the archive
+	if (ar.writeFile(g_szOutputFilename))
+	{
+		printf("Unable to write '%s'!\n", g_szOutputFilename);
+		return -1;
+	}
+
+	printf("\nArchive complete -> %s\n\n", g_szOutputFilename);
+
+	return 0;
+}
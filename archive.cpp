@@ -0,0 +1,286 @@
+#include "archive.h"
+#include <assert.h>
+
+//
+Archive::Archive()
+{
+	clear();
+}
+
+//
+Archive::~Archive()
+{
+}
+
+// reset the state of this archive
+void Archive::clear()
+{
+	memset(&header, 0, sizeof(header));
+	header.ar_magic = ARCHIVE_MAGIC;
+
+	filename.clear();
+	members.clear();
+	symbols.clear();
+	slots.clear();
+	names.clear();
+	contents.clear();
+}
+
+// add a name to the name table and return its offset
+uint32_t Archive::addName(const char *name)
+{
+	uint32_t offset = names.size();
+	names.insert(names.end(), name, name + strlen(name) + 1);
+
+	return offset;
+}
+
+// Add an object file to the archive and index the symbols it defines.
+// Returns the number of those symbols an earlier member already defines,
+// which keep pointing at the earlier member, or EOF if the file is not a
+// valid object file.
+int Archive::addMember(const std::string &name, const std::vector<uint8_t> &file)
+{
+	ObjectFile obj;
+	if (obj.readBuffer(file.data(), file.size()))
+		return EOF;
+
+	uint32_t member = members.size();
+	int duplicates = 0;
+
+	for (size_t i = 0; i < obj.getSymbolCount(); i++)
+	{
+		auto sym = obj.symbolAt(i);
+		if (sym.type & SET_UNDEFINED)
+			continue;
+
+		auto symName = obj.symbolName(i);
+		if (findMember(symName) >= 0)
+		{
+			duplicates++;
+			continue;
+		}
+
+		ArchiveSymbol as;
+		as.nameOffset = addName(symName);
+		as.member = member;
+		symbols.push_back(as);
+
+		// keep the hash at most half full
+		if (symbols.size() * 2 > slots.size())
+		{
+			slots.assign(slots.empty() ? 16 : slots.size() * 2, HashSlot{ 0, EMPTY_SLOT });
+			for (uint32_t j = 0; j < symbols.size(); j++)
+			{
+				auto str = &names[symbols[j].nameOffset];
+				insertHashSlot(slots, hashName(str, strlen(str)), j);
+			}
+		}
+		else
+			insertHashSlot(slots, hashName(symName, strlen(symName)), symbols.size() - 1);
+	}
+
+	// strip the path from the member name
+	auto base = name.find_last_of("/\\");
+	base = base == std::string::npos ? 0 : base + 1;
+
+	ArchiveMember am;
+	am.nameOffset = addName(name.c_str() + base);
+	am.offset = 0;
+	am.size = file.size();
+	members.push_back(am);
+
+	contents.push_back(file);
+
+	return duplicates;
+}
+
+// write out the archive through a temp file which is renamed over the
+// target once it is complete
+int Archive::writeFile(const std::string &name)
+{
+	header.ar_magic = ARCHIVE_MAGIC;
+	header.ar_members = members.size();
+	header.ar_symbols = symbols.size();
+	header.ar_slots = slots.size();
+	header.ar_strsize = names.size();
+
+	// the member files follow the index
+	uint32_t offset = sizeof(header);
+	offset += members.size() * sizeof(ArchiveMember);
+	offset += symbols.size() * sizeof(ArchiveSymbol);
+	offset += slots.size() * sizeof(HashSlot);
+	offset += names.size();
+
+	for (auto it = members.begin(); it != members.end(); it++)
+	{
+		it->offset = offset;
+		offset += it->size;
+	}
+
+	auto write = [this](FILE *f) {
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+		if (ok && !members.empty())
+			ok = fwrite(members.data(), members.size() * sizeof(ArchiveMember), 1, f) == 1;
+		if (ok && !symbols.empty())
+			ok = fwrite(symbols.data(), symbols.size() * sizeof(ArchiveSymbol), 1, f) == 1;
+		if (ok && !slots.empty())
+			ok = fwrite(slots.data(), slots.size() * sizeof(HashSlot), 1, f) == 1;
+		if (ok && !names.empty())
+			ok = fwrite(names.data(), names.size(), 1, f) == 1;
+
+		for (auto it = contents.begin(); ok && it != contents.end(); it++)
+		{
+			if (!it->empty())
+				ok = fwrite(it->data(), it->size(), 1, f) == 1;
+		}
+
+		return ok;
+	};
+
+	if (writeFileAtomic(name, write))
+		return EOF;
+
+	filename = name;
+
+	return 0;
+}
+
+// read the member table and symbol index of the named archive, the members
+// themselves are read on demand with readMember()
+int Archive::readIndex(const std::string &name)
+{
+	clear();
+
+	FILE *f = fopen(name.c_str(), "rb");
+	if (nullptr == f)
+		return EOF;
+
+	long size = -1;
+	if (!fseek(f, 0, SEEK_END))
+		size = ftell(f);
+
+	bool ok = size >= (long)sizeof(header) && !fseek(f, 0, SEEK_SET) && fread(&header, sizeof(header), 1, f) == 1;
+
+	// the tables must fit in the file and the hash size must be a power of two
+	ok = ok && header.ar_magic == ARCHIVE_MAGIC;
+	ok = ok && header.ar_members >= 0 && header.ar_symbols >= 0 && header.ar_slots >= 0 && header.ar_strsize >= 0;
+	ok = ok && (header.ar_slots & (header.ar_slots - 1)) == 0 && header.ar_slots >= header.ar_symbols;
+
+	if (ok)
+	{
+		uint64_t indexSize = sizeof(header);
+		indexSize += (uint64_t)header.ar_members * sizeof(ArchiveMember);
+		indexSize += (uint64_t)header.ar_symbols * sizeof(ArchiveSymbol);
+		indexSize += (uint64_t)header.ar_slots * sizeof(HashSlot);
+		indexSize += header.ar_strsize;
+		ok = indexSize <= (uint64_t)size;
+	}
+
+	if (ok)
+	{
+		members.resize(header.ar_members);
+		symbols.resize(header.ar_symbols);
+		slots.resize(header.ar_slots);
+		names.resize(header.ar_strsize);
+
+		if (!members.empty())
+			ok = fread(members.data(), members.size() * sizeof(ArchiveMember), 1, f) == 1;
+		if (ok && !symbols.empty())
+			ok = fread(symbols.data(), symbols.size() * sizeof(ArchiveSymbol), 1, f) == 1;
+		if (ok && !slots.empty())
+			ok = fread(slots.data(), slots.size() * sizeof(HashSlot), 1, f) == 1;
+		if (ok && !names.empty())
+			ok = fread(names.data(), names.size(), 1, f) == 1;
+	}
+
+	fclose(f);
+
+	// every name must be a null terminated string inside the name table and
+	// every member must be inside the file
+	auto validName = [&](uint32_t offset) {
+		return offset < names.size() && memchr(&names[offset], 0, names.size() - offset);
+	};
+
+	for (auto it = members.begin(); ok && it != members.end(); it++)
+		ok = validName(it->nameOffset) && (uint64_t)it->offset + it->size <= (uint64_t)size;
+
+	for (auto it = symbols.begin(); ok && it != symbols.end(); it++)
+		ok = validName(it->nameOffset) && it->member < members.size();
+
+	for (auto it = slots.begin(); ok && it != slots.end(); it++)
+		ok = it->index == EMPTY_SLOT || it->index < symbols.size();
+
+	if (!ok)
+	{
+		clear();
+		return EOF;
+	}
+
+	filename = name;
+
+	return 0;
+}
+
+// read a member of the archive in full
+int Archive::readMember(size_t index, ObjectFile &obj) const
+{
+	assert(index < members.size());
+
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (nullptr == f)
+		return EOF;
+
+	auto &am = members[index];
+	std::vector<uint8_t> buf(am.size);
+
+	bool ok = !fseek(f, am.offset, SEEK_SET);
+	if (ok && !buf.empty())
+		ok = fread(buf.data(), buf.size(), 1, f) == 1;
+
+	fclose(f);
+
+	if (!ok)
+		return EOF;
+
+	return obj.readBuffer(buf.data(), buf.size());
+}
+
+// find a symbol name in the hash, returns EMPTY_SLOT if not found
+uint32_t Archive::indexOf(const char *name, uint32_t hash) const
+{
+	if (slots.empty())
+		return EMPTY_SLOT;
+
+	size_t mask = slots.size() - 1;
+
+	// a full table from a bad file must not loop forever
+	for (size_t n = 0, slot = hash & mask; n < slots.size() && slots[slot].index != EMPTY_SLOT; n++, slot = (slot + 1) & mask)
+	{
+		if (slots[slot].hash == hash && !strcmp(&names[symbols[slots[slot].index].nameOffset], name))
+			return slots[slot].index;
+	}
+
+	return EMPTY_SLOT;
+}
+
+// find the member that defines a symbol, returns -1 if no member does
+int Archive::findMember(const char *name) const
+{
+	auto index = indexOf(name, hashName(name, strlen(name)));
+	return index != EMPTY_SLOT ? (int)symbols[index].member : -1;
+}
+
+// check if the named file starts with the archive magic number
+bool isArchive(const std::string &name)
+{
+	FILE *f = fopen(name.c_str(), "rb");
+	if (nullptr == f)
+		return false;
+
+	int magic = 0;
+	bool result = fread(&magic, sizeof(magic), 1, f) == 1 && magic == ARCHIVE_MAGIC;
+	fclose(f);
+
+	return result;
+}
@@ -0,0 +1,90 @@
+#ifndef __ARCHIVE_H
+#define __ARCHIVE_H
+
+#pragma once
+
+#include "aout.h"
+
+// Define the archive header. A static library archive holds a.out object
+// files together with a hash index of the symbols they define, so that the
+// linker only needs to read the index to decide which members to link.
+//
+// The file is laid out as the header, the member table, the symbol table,
+// the symbol hash slots, the name table and then the member object files.
+struct ARCHIVE_HEADER
+{
+	int ar_magic;		// magic number
+	int ar_members;		// number of member object files
+	int ar_symbols;		// number of indexed symbols
+	int ar_slots;		// number of hash slots, a power of two
+	int ar_strsize;		// size of the name table
+	int ar_spare[3];	// unused
+};
+
+// Validate the size of the archive header struct
+static_assert(sizeof(ARCHIVE_HEADER) == 32, "Invalid archive header size!");
+
+static const int ARCHIVE_MAGIC = 0x0A72613C;	// "<ar\n"
+
+// Define an archive member entry
+struct ArchiveMember
+{
+	uint32_t nameOffset;	// offset in the name table of the member file name
+	uint32_t offset;		// offset of the object file from the start of the archive
+	uint32_t size;			// size of the object file
+};
+
+// Define an archive symbol entry
+struct ArchiveSymbol
+{
+	uint32_t nameOffset;	// offset in the name table of the symbol name
+	uint32_t member;		// index of the member that defines the symbol
+};
+
+// Define the archive class
+class Archive
+{
+protected:
+	ARCHIVE_HEADER header;
+	std::string filename;
+
+	std::vector<ArchiveMember> members;
+	std::vector<ArchiveSymbol> symbols;
+	std::vector<HashSlot> slots;
+	std::vector<char> names;
+
+	// contents of the members added with addMember()
+	std::vector<std::vector<uint8_t> > contents;
+
+	uint32_t addName(const char *name);
+	uint32_t indexOf(const char *name, uint32_t hash) const;
+
+public:
+	Archive();
+	virtual ~Archive();
+
+	void clear();
+
+	// building an archive
+	int addMember(const std::string &name, const std::vector<uint8_t> &file);
+	int writeFile(const std::string &name);
+
+	// reading an archive
+	int readIndex(const std::string &name);
+	int readMember(size_t index, ObjectFile &obj) const;
+
+	size_t getMemberCount() const		{ return members.size(); }
+	const char *memberName(size_t index) const	{ return &names[members[index].nameOffset]; }
+	uint32_t memberSize(size_t index) const		{ return members[index].size; }
+
+	size_t getSymbolCount() const		{ return symbols.size(); }
+	const char *symbolName(size_t index) const	{ return &names[symbols[index].nameOffset]; }
+	uint32_t symbolMember(size_t index) const	{ return symbols[index].member; }
+
+	int findMember(const char *name) const;
+};
+
+// helper functions
+bool isArchive(const std::string &name);
+
+#endif // __ARCHIVE_H
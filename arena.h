@@ -0,0 +1,132 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Define a monotonic arena. Memory is handed out from large blocks and is
+// only given back when the arena is released, all at once. A tool that
+// builds many object files can give them one arena so that they don't each
+// make many small allocations, and drop them all in one step.
+//
+// An arena takes no lock, threads that build object files at the same time
+// each need an arena of their own.
+class Arena
+{
+	std::vector<uint8_t*> blocks;
+	uint8_t *next;
+	uint8_t *end;
+
+	size_t blockSize;
+	size_t used;
+
+	// get a new block for an allocation that doesn't fit the current one
+	void *allocateBlock(size_t size)
+	{
+		// large allocations get a block of their own so the current block
+		// isn't wasted
+		if (size > blockSize / 4)
+		{
+			auto block = static_cast<uint8_t*>(::operator new(size));
+			blocks.push_back(block);
+			return block;
+		}
+
+		auto block = static_cast<uint8_t*>(::operator new(blockSize));
+		blocks.push_back(block);
+
+		next = block + size;
+		end = block + blockSize;
+
+		return block;
+	}
+
+public:
+	explicit Arena(size_t blockSize = 64 * 1024) : next(nullptr), end(nullptr), blockSize(blockSize), used(0) {}
+	~Arena() { release(); }
+
+	Arena(const Arena&) = delete;
+	Arena &operator=(const Arena&) = delete;
+
+	void *allocate(size_t size, size_t align)
+	{
+		used += size;
+
+		uintptr_t p = ((uintptr_t)next + align - 1) & ~(uintptr_t)(align - 1);
+		if (next && p + size <= (uintptr_t)end)
+		{
+			next = (uint8_t*)(p + size);
+			return (void*)p;
+		}
+
+		// blocks from operator new are aligned for any type
+		return allocateBlock(size);
+	}
+
+	// free all of the memory handed out, nothing allocated from the arena
+	// may be used afterwards
+	void release()
+	{
+		for (auto it = blocks.begin(); it != blocks.end(); it++)
+			::operator delete(*it);
+
+		blocks.clear();
+		next = end = nullptr;
+		used = 0;
+	}
+
+	size_t getBlockCount() const	{ return blocks.size(); }
+	size_t getBytesUsed() const		{ return used; }
+};
+
+// Define an allocator for the standard containers that allocates from an
+// arena, or from the heap when it has none. Memory from an arena is freed
+// with the arena, not by the container.
+template <typename T>
+class ArenaAllocator
+{
+	template <typename U> friend class ArenaAllocator;
+
+	Arena *arena;
+
+public:
+	typedef T value_type;
+
+	// containers take the allocator of the one they are moved or swapped from
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	ArenaAllocator(Arena *arena = nullptr) : arena(arena) {}
+
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U> &rhs) : arena(rhs.arena) {}
+
+	T *allocate(size_t n)
+	{
+		if (arena)
+			return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t)
+	{
+		if (!arena)
+			::operator delete(p);
+	}
+
+	Arena *getArena() const { return arena; }
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U> &rhs) const { return arena == rhs.arena; }
+
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U> &rhs) const { return arena != rhs.arena; }
+};
+
+#endif // __ARENA_H
@@ -0,0 +1,153 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "cache.h"
+#include "../aout.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#	include <direct.h>
+#	include <process.h>
+#	define getpid _getpid
+#else
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+// the first line of a manifest, the rest are the names of the included files
+static const char *MANIFEST_MAGIC = "asm cache 1";
+
+// write a whole file through a temp file named for this process, so that
+// assemblers sharing a cache never see part of a file
+static int writeWholeFile(const std::string &name, const std::vector<uint8_t> &buf)
+{
+	char suffix[32];
+	sprintf(suffix, ".%d.tmp", (int)getpid());
+
+	return writeFileAtomic(name, [&buf](FILE *f) { return buf.empty() || fwrite(buf.data(), buf.size(), 1, f) == 1; }, suffix);
+}
+
+// hash a source file along with the assembler build and options
+AsmCache::AsmCache(const char *dir, const char *source, const std::string &options) : dir(dir), sourceKey(0), valid(false)
+{
+	std::vector<uint8_t> buf;
+	if (readWholeFile(source, buf))
+		return;
+
+	sourceKey = hashBytes(options.c_str(), options.size() + 1);
+	sourceKey = hashBytes(buf.data(), buf.size(), sourceKey);
+	valid = true;
+}
+
+//
+std::string AsmCache::manifestName() const
+{
+	char name[32];
+	sprintf(name, "/%016llX.m", (unsigned long long)sourceKey);
+
+	return dir + name;
+}
+
+//
+std::string AsmCache::objectName(uint64_t key) const
+{
+	char name[32];
+	sprintf(name, "/%016llX.o", (unsigned long long)key);
+
+	return dir + name;
+}
+
+// hash the source key with the names and contents of the included files,
+// false if one of them can't be read
+bool AsmCache::objectKey(const std::vector<std::string> &includes, uint64_t &key) const
+{
+	key = sourceKey;
+
+	for (auto it = includes.begin(); it != includes.end(); it++)
+	{
+		std::vector<uint8_t> buf;
+		if (readWholeFile(it->c_str(), buf))
+			return false;
+
+		uint64_t hash = hashBytes(buf.data(), buf.size());
+
+		key = hashBytes(it->c_str(), it->size() + 1, key);
+		key = hashBytes(&hash, sizeof(hash), key);
+	}
+
+	return true;
+}
+
+// Copy the object file of the source from the cache to the output, and get
+// the files the source includes. Returns EOF if the cache doesn't have it,
+// or one of the files the source included when it was stored has changed.
+int AsmCache::fetch(const char *output, std::vector<std::string> &includes)
+{
+	includes.clear();
+
+	if (!valid)
+		return EOF;
+
+	FILE *f = fopen(manifestName().c_str(), "r");
+	if (nullptr == f)
+		return EOF;
+
+	bool ok = false;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+
+		if (!ok)
+		{
+			ok = !strcmp(line, MANIFEST_MAGIC);
+			if (!ok)
+				break;
+		}
+		else
+			includes.push_back(line);
+	}
+
+	fclose(f);
+
+	uint64_t key;
+	if (!ok || !objectKey(includes, key))
+		return EOF;
+
+	std::vector<uint8_t> buf;
+	if (readWholeFile(objectName(key).c_str(), buf))
+		return EOF;
+
+	return writeWholeFile(output, buf);
+}
+
+// store the object file assembled from the source, with the list of files
+// it included
+int AsmCache::store(const char *output, const std::vector<std::string> &includes)
+{
+	if (!valid)
+		return EOF;
+
+	uint64_t key;
+	if (!objectKey(includes, key))
+		return EOF;
+
+	// the first store creates the cache, it may already exist
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0777);
+#endif
+
+	std::vector<uint8_t> buf;
+	if (readWholeFile(output, buf) || writeWholeFile(objectName(key), buf))
+		return EOF;
+
+	// the manifest is written last so that it never names a missing object
+	std::string manifest = std::string(MANIFEST_MAGIC) + "\n";
+	for (auto it = includes.begin(); it != includes.end(); it++)
+		manifest += *it + "\n";
+
+	return writeWholeFile(manifestName(), std::vector<uint8_t>(manifest.begin(), manifest.end()));
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Define the assembly cache. An object file is stored under a hash of
+// everything that goes into it: the source, the files it includes, the
+// assembler and object format versions and the options that change the
+// output. The files a source includes are only known once it is assembled,
+// so the cache keeps a manifest for each source that lists them.
+//
+// The cache directory holds a manifest named by the hash of the source, and
+// an object file named by the hash of the source and its includes.
+class AsmCache
+{
+	std::string dir;
+	uint64_t sourceKey;
+	bool valid;
+
+	std::string manifestName() const;
+	std::string objectName(uint64_t key) const;
+
+	bool objectKey(const std::vector<std::string> &includes, uint64_t &key) const;
+
+public:
+	AsmCache(const char *dir, const char *source, const std::string &options);
+
+	int fetch(const char *output, std::vector<std::string> &includes);
+	int store(const char *output, const std::vector<std::string> &includes);
+};
+
+#endif // __CACHE_H
@@ -3,13 +3,25 @@
 #include "../aout.h"
 #include "../cpu_cisc.h"
 #include <stdio.h>
+#include <algorithm>
+#include <memory>
 #include "./ParserKit/baseparser.h"
+#include "cache.h"
 
 //
 // Command line switches
 //
 bool g_bDebug = false;
 const char *g_szOutputFilename = "a.out";
+int g_nFormat = FORMAT_AOUT;
+const char *g_szCacheDir = nullptr;
+bool g_bDepfile = false;
+const char *g_szDepfile = nullptr;
+bool g_bLongBranches = false;
+
+// version of the code the assembler generates, part of the cache key so
+// bump it whenever a change makes the same source assemble differently
+static const int ASM_VERSION = 1;
 
 enum
 {
@@ -33,9 +45,18 @@ protected:
 	using AddressList = std::vector<uint16_t>;
 	using Fixups = std::map<std::string, AddressList>;
 	Fixups fixups;
+	Fixups dataFixups;
+
+	// the files included through INCLUDE, in order
+	std::vector<std::string> includes;
+
+	// the branches to labels in this file, which may take the short form
+	std::vector<BranchSite> branches;
 
 	void addFixup(const std::string &str, uint16_t addr);
+	void addDataFixup(const std::string &str, uint16_t addr);
 	void applyFixups(const std::string &str, uint16_t addr);
+	void applyDataFixups(const std::string &str, uint16_t addr, uint32_t segment);
 	void dataByte(SymbolEntry * sym);
 	void dataWord(SymbolEntry * sym);
 	void dataString(SymbolEntry * sym);
@@ -55,9 +76,12 @@ public:
 
 	void memOperand(int immOp, int memOp, bool isWordValue = false);
 	void addTextRelocation(uint32_t addr, uint32_t length, uint32_t index, bool external);
+	void addDataRelocation(uint32_t addr, uint32_t length, uint32_t index, bool external);
 	void dataAddress(int op);
 	void codeAddress(int op);
 
+	const std::vector<std::string> &getIncludes() const { return includes; }
+
 	void include();
 	void label();
 	void file();
@@ -250,7 +274,13 @@ void usage()
 {
 	puts("\nusage: asm [options] filename\n");
 	puts("-v\tverbose output");
-	puts("-o file\tset output filename\n");
+	puts("-o file\tset output filename");
+	puts("-c dir\tuse an assembly cache in dir");
+	puts("-MD\twrite a make dependency file of the included files");
+	puts("-MF file\tset dependency filename, default is the output with .d");
+	puts("-l\tkeep branches long, don't use the short relative forms");
+	puts("-x\twrite the extended object file format");
+	puts("-z\twrite the extended format, compacted\n");
 
 	exit(0);
 }
@@ -263,6 +293,20 @@ int getopt(int n, char *args[])
 	int i;
 	for (i = 1; args[i][0] == '-'; i++)
 	{
+		if (!strcmp(args[i], "-MD"))
+		{
+			g_bDepfile = true;
+			continue;
+		}
+
+		if (!strcmp(args[i], "-MF"))
+		{
+			g_bDepfile = true;
+			g_szDepfile = args[i + 1];
+			i++;
+			continue;
+		}
+
 		if (args[i][1] == 'v')
 			g_bDebug = true;
 
@@ -270,7 +314,24 @@ int getopt(int n, char *args[])
 		{
 			g_szOutputFilename = args[i + 1];
 			i++;
+			continue;
+		}
+
+		if (args[i][1] == 'c')
+		{
+			g_szCacheDir = args[i + 1];
+			i++;
+			continue;
 		}
+
+		if (args[i][1] == 'l')
+			g_bLongBranches = true;
+
+		if (args[i][1] == 'x')
+			g_nFormat = FORMAT_AOUTX;
+
+		if (args[i][1] == 'z')
+			g_nFormat = FORMAT_AOUTX_COMPACT;
 	}
 
 	return i;
@@ -294,19 +355,44 @@ void AsmParser::applyFixups(const std::string &str, uint16_t addr)
 	auto iter = fixups.find(str);
 
 	// if there were no forward refs there will be no fixups
-	if (iter == fixups.end())
-		return;
-
-	for (auto i = iter->second.begin(); i != iter->second.end(); i++)
+	if (iter != fixups.end())
 	{
-		auto loc = *i;
-		auto rom = obj.textPtr();
-		rom[loc] = addr & 0xFF;
-		rom[loc + 1] = addr >> 8;
+		for (auto i = iter->second.begin(); i != iter->second.end(); i++)
+		{
+			auto loc = *i;
+			auto rom = obj.textPtr();
+			rom[loc] = addr & 0xFF;
+			rom[loc + 1] = addr >> 8;
+		}
+
+		// we are done with these fixups!
+		fixups.erase(iter);
 	}
 
-	// we are done with these fixups!
-	fixups.erase(iter);
+	// forward refs from address tables in the data segment
+	applyDataFixups(str, addr, SEG_TEXT);
+}
+
+// We saw a new code or data label. Fixup the forward references to it from
+// address tables in the data segment, which are relocated against the
+// segment of the label.
+void AsmParser::applyDataFixups(const std::string &str, uint16_t addr, uint32_t segment)
+{
+	auto iter = dataFixups.find(str);
+	if (iter != dataFixups.end())
+	{
+		for (auto i = iter->second.begin(); i != iter->second.end(); i++)
+		{
+			auto loc = *i;
+			auto data = obj.dataPtr();
+			data[loc] = addr & 0xFF;
+			data[loc + 1] = addr >> 8;
+
+			addDataRelocation(loc, 1, segment, false);
+		}
+
+		dataFixups.erase(iter);
+	}
 }
 
 // We found an inferred forward reference to a symbol, add the location to fixups list
@@ -325,6 +411,12 @@ void AsmParser::addFixup(const std::string &str, uint16_t addr)
 	}
 }
 
+// We found a forward reference to a label in the data segment
+void AsmParser::addDataFixup(const std::string &str, uint16_t addr)
+{
+	dataFixups[str].push_back(addr);
+}
+
 // Allocate a block of memory in the DATA or BSS segment
 void AsmParser::dataMemory(SymbolEntry *sym)
 {
@@ -347,6 +439,7 @@ void AsmParser::dataMemory(SymbolEntry *sym)
 		sym->type = stDataMemory;
 		sym->ival = se.value;
 		obj.addSymbol(sym->lexeme, se);
+		applyDataFixups(sym->lexeme, se.value, se.type == SET_DATA ? SEG_DATA : SEG_BSS);
 	}
 }
 
@@ -386,6 +479,7 @@ void AsmParser::dataByte(SymbolEntry *sym)
 		sym->type = stDataByte;
 		sym->ival = se.value;
 		obj.addSymbol(sym->lexeme, se);
+		applyDataFixups(sym->lexeme, se.value, se.type == SET_DATA ? SEG_DATA : SEG_BSS);
 	}
 }
 
@@ -403,11 +497,53 @@ void AsmParser::dataWord(SymbolEntry *sym)
 		se.type = SET_BSS;
 		se.value = obj.allocBSS(WORD_SIZE);
 	}
+	else if (lookahead == TV_ID && yylval.sym->type != stEqu)
+	{
+		// the address of a label, like an entry in a jump table
+		se.type = SET_DATA;
+
+		auto ref = yylval.sym;
+		ref->isReferenced = true;
+
+		auto val = ref->ival;
+
+		se.value = obj.addData(LOBYTE(val));
+		obj.addData(HIBYTE(val));
+
+		auto external = ref->type == stExternal;
+
+		// a forward reference is relocated once the label is defined and
+		// its segment is known
+		uint32_t index = SEG_TEXT;
+		if (ref->type == stUndef)
+			addDataFixup(ref->lexeme, se.value);
+		else if (external)
+		{
+			// for stExternal this needs to be the index to the symbol table entry
+			index = obj.indexOfSymbol(ref->lexeme);
+			assert(index != UINT_MAX);
+		}
+		else if (isDataLabel(ref->type))
+		{
+			SymbolEntity target;
+			if (!obj.findSymbol(ref->lexeme, target))
+				assert(false);
+
+			index = (target.type == SET_DATA) ? SEG_DATA : SEG_BSS;
+		}
+
+		if (ref->type != stUndef)
+			addDataRelocation(se.value, 1, index, external);
+
+		match();
+	}
 	else
 	{
 		se.type = SET_DATA;
 
-		auto val = yylval.ival;
+		auto val = lookahead == TV_ID ? yylval.sym->ival : yylval.ival;
+		if (lookahead == TV_ID)
+			yylval.sym->isReferenced = true;
 
 		se.value = obj.addData(LOBYTE(val));
 		obj.addData(HIBYTE(val));
@@ -421,6 +557,7 @@ void AsmParser::dataWord(SymbolEntry *sym)
 		sym->type = stDataWord;
 		sym->ival = se.value;
 		obj.addSymbol(sym->lexeme, se);
+		applyDataFixups(sym->lexeme, se.value, se.type == SET_DATA ? SEG_DATA : SEG_BSS);
 	}
 }
 
@@ -449,6 +586,7 @@ void AsmParser::dataString(SymbolEntry *sym)
 		sym->type = stDataString;
 		sym->ival = se.value;
 		obj.addSymbol(sym->lexeme, se);
+		applyDataFixups(sym->lexeme, se.value, SEG_DATA);
 	}
 
 	yylval.sym->isReferenced = true;
@@ -590,6 +728,19 @@ void AsmParser::addTextRelocation(uint32_t addr, uint32_t length, uint32_t index
 	obj.addTextRelocation(re);
 }
 
+// Add a data segment relocation entry
+void AsmParser::addDataRelocation(uint32_t addr, uint32_t length, uint32_t index, bool external)
+{
+	RelocationEntry re;
+
+	re.address = addr;
+	re.length = length;
+	re.index = index;
+	re.external = external ? 1 : 0;
+
+	obj.addDataRelocation(re);
+}
+
 // We are expecting an 8-bit immediate value or named immediate value
 void AsmParser::imm8(int op)
 {
@@ -671,8 +822,9 @@ void AsmParser::imm16(int op)
 
 		uint32_t index = SEG_DATA;
 
-		// handle CODE PTR's
-		if (yylval.sym->type == stProc)
+		// handle CODE PTR's, a forward reference can only be to code as
+		// only code labels apply fixups
+		if (yylval.sym->type == stProc || yylval.sym->type == stUndef)
 			index = SEG_TEXT;
 		else if (yylval.sym->type != stUndef && !external)
 		{
@@ -869,6 +1021,13 @@ void AsmParser::codeAddress(int op)
 		}
 
 		addTextRelocation(addr, 1, index, external);
+
+		auto type = yylval.sym->type;
+		if (type == stLabel || type == stProc || type == stUndef)
+		{
+			BranchSite site = { addr - 1, (uint8_t)shortBranchOf(op) };
+			branches.push_back(site);
+		}
 	}
 
 	match();
@@ -880,6 +1039,7 @@ void AsmParser::include()
 	match(TV_INCLUDE);
 		yylval.sym->isReferenced = true;
 		m_lexer->pushFile(yylval.sym->lexeme.c_str());
+		includes.push_back(yylval.sym->lexeme);
 	match(TV_STRING);
 }
 
@@ -917,8 +1077,6 @@ void AsmParser::file()
 
 	while (lookahead != TV_DONE)
 	{
-		auto sym = yylval.sym;
-
 		switch (lookahead)
 		{
 		case TV_INCLUDE:
@@ -947,7 +1105,8 @@ void AsmParser::file()
 			yylval.sym->global			= true;
 			yylval.sym->isReferenced	= true;	// OK if procedures aren't referenced
 
-			se.type = SET_TEXT;
+			// the linker can drop whole procedures, see ln --gc-procs
+			se.type = SET_TEXT | SET_PROC;
 			se.value = obj.getTextSize();
 			obj.addSymbol(yylval.sym->lexeme, se);
 
@@ -962,16 +1121,17 @@ void AsmParser::file()
 			label();
 			break;
 
+		// unnamed data, like the rest of a table
 		case TV_DB:
-			dataByte(sym);
+			dataByte(nullptr);
 			break;
 
 		case TV_DW:
-			dataWord(sym);
+			dataWord(nullptr);
 			break;
 
 		case TV_DM:
-			dataMemory(sym);
+			dataMemory(nullptr);
 			break;
 
 		case TV_NOP:
@@ -1213,18 +1373,112 @@ int AsmParser::yyparse()
 		bMissingSymbols = true;
 	}
 
+	for (auto it = dataFixups.begin(); it != dataFixups.end(); it++)
+	{
+		if (fixups.find(it->first) != fixups.end())
+			continue;
+
+		fprintf(stderr, "error: undefined symbol \"%s\"\n", it->first.c_str());
+		bMissingSymbols = true;
+	}
+
 	if (bMissingSymbols)
 	{
 		fprintf(stderr, "error: Assembly failed!\n");
 		exit(-1);
 	}
 
-	// write out the OBJ file
-	obj.writeFile(g_szOutputFilename);
+	// take the short form of the branches whose targets are in reach
+	if (!g_bLongBranches)
+	{
+		auto saved = obj.relaxBranches(branches);
+		if (g_bDebug)
+			printf("Shortened branches by %u bytes\n", saved);
+	}
+
+	// write out the OBJ file, replacing any old one only once it is complete
+	obj.setFormat(g_nFormat);
+	if (obj.writeFile(g_szOutputFilename, true))
+	{
+		fprintf(stderr, "error: unable to write \"%s\"\n", g_szOutputFilename);
+		exit(-1);
+	}
 
 	return 0;
 }
 
+// write a name in a make rule, escaping the characters make treats specially
+void writeDepName(FILE *f, const std::string &name)
+{
+	for (auto it = name.begin(); it != name.end(); it++)
+	{
+		if (*it == ' ' || *it == '#')
+			fputc('\\', f);
+		else if (*it == '$')
+			fputc('$', f);
+
+		fputc(*it, f);
+	}
+}
+
+// Write a make rule that the output depends on the source and each file it
+// included, and an empty rule for each included file so make doesn't fail
+// when one of them is removed. The default name is the output with a .d
+// extension.
+int writeDepfile(const char *source, const std::vector<std::string> &includes)
+{
+	std::string name;
+	if (g_szDepfile)
+		name = g_szDepfile;
+	else
+	{
+		name = g_szOutputFilename;
+
+		auto dot = name.find_last_of('.');
+		auto slash = name.find_last_of("/\\");
+		if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+			name.erase(dot);
+
+		name += ".d";
+	}
+
+	FILE *f = fopen(name.c_str(), "w");
+	if (nullptr == f)
+	{
+		fprintf(stderr, "error: unable to write \"%s\"\n", name.c_str());
+		return EOF;
+	}
+
+	// each file is listed once, in the order it was first included
+	std::vector<std::string> deps;
+	for (auto it = includes.begin(); it != includes.end(); it++)
+	{
+		if (std::find(deps.begin(), deps.end(), *it) == deps.end())
+			deps.push_back(*it);
+	}
+
+	writeDepName(f, g_szOutputFilename);
+	fputs(": ", f);
+	writeDepName(f, source);
+
+	for (auto it = deps.begin(); it != deps.end(); it++)
+	{
+		fputs(" \\\n ", f);
+		writeDepName(f, *it);
+	}
+
+	fputs("\n", f);
+
+	for (auto it = deps.begin(); it != deps.end(); it++)
+	{
+		fputs("\n", f);
+		writeDepName(f, *it);
+		fputs(":\n", f);
+	}
+
+	return fclose(f) ? EOF : 0;
+}
+
 //
 int main(int argc, char* argv[])
 {
@@ -1233,6 +1487,25 @@ int main(int argc, char* argv[])
 
 	int iFirstArg = getopt(argc, argv);
 
+	// the output only depends on the source, its includes, the build of the
+	// assembler, the output format and the branch forms
+	std::unique_ptr<AsmCache> cache;
+	if (g_szCacheDir)
+	{
+		cache = std::make_unique<AsmCache>(g_szCacheDir, argv[iFirstArg], std::to_string(ASM_VERSION) + " " + std::to_string(AOUTX_VERSION) + " " + std::to_string(g_nFormat) + (g_bLongBranches ? " l" : ""));
+
+		std::vector<std::string> includes;
+		if (!cache->fetch(g_szOutputFilename, includes))
+		{
+			printf("\nAssembly complete %s -> %s (cached)\n", argv[iFirstArg], g_szOutputFilename);
+
+			if (g_bDepfile && writeDepfile(argv[iFirstArg], includes))
+				return -1;
+
+			return 0;
+		}
+	}
+
 	// TODO - #21 handle multiple files on the command line?
 	{
 		AsmParser parser;
@@ -1247,6 +1520,12 @@ int main(int argc, char* argv[])
 			printf("\nWarnings generated: %d\n", parser.getWarningCount());
 
 		printf("\nAssembly complete %s -> %s\n", argv[iFirstArg], g_szOutputFilename);
+
+		if (cache && cache->store(g_szOutputFilename, parser.getIncludes()))
+			printf("Warning: unable to store %s in the cache '%s'\n", g_szOutputFilename, g_szCacheDir);
+
+		if (g_bDepfile && writeDepfile(argv[iFirstArg], parser.getIncludes()))
+			return -1;
 	}
 
 
@@ -0,0 +1,429 @@
+#pragma once
+
+#ifndef __CISC_H
+#define __CISC_H
+
+#include "../aout.h"
+#include "../cpu_cisc.h"
+#include <stdio.h>
+#include <set>
+#include <map>
+#include <vector>
+
+// Flag bit helper functions
+#define SETF(flag) (CC |= flag)
+#define CLRF(flag) (CC &= ~flag)
+#define TSTF(flag) ((CC & flag) != 0)
+
+//
+static const int SMALL_BUFFER = 256;
+
+// a frame on the shadow call stack
+struct StackFrame
+{
+	uint16_t target;			// address of the called PROC or interrupt handler
+	uint16_t entrySP;			// SP before the return address was pushed
+	uint16_t minSP;				// lowest SP seen while the frame was active
+	bool isInterrupt;			// frame was pushed by an interrupt rather than a CALL
+};
+
+// stack usage of a single PROC across all of its calls
+struct ProcStackStats
+{
+	uint64_t calls;
+	uint16_t maxDepth;
+
+	ProcStackStats()
+	{
+		calls = 0;
+		maxDepth = 0;
+	}
+};
+
+// CPU time accounting for a single os.asm task
+struct TaskStats
+{
+	std::string name;			// nearest code symbol to where the task first ran
+	uint64_t instructions;		// instructions retired while this task was current
+	uint64_t isrInstructions;	// subset of the above executed with interrupts masked
+	uint64_t interrupts;		// interrupts taken while this task was current
+	uint64_t switches;			// number of times the task was switched in
+
+	std::vector<StackFrame> callStack;	// shadow call stack for this task
+	uint16_t stackTop;			// highest SP seen outside of interrupts
+	uint16_t stackLow;			// lowest SP seen
+
+	TaskStats()
+	{
+		instructions = isrInstructions = interrupts = switches = 0;
+		stackTop = 0;
+		stackLow = 0xFFFF;
+	}
+};
+
+// small deterministic PRNG so random streams are reproducible from the seed
+class XorShift
+{
+	uint64_t state;
+
+public:
+	XorShift(uint64_t seed) { state = seed ? seed : 0x9E3779B97F4A7C15ull; }
+
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return (uint32_t)(state >> 16);
+	}
+
+	uint8_t nextByte() { return next() & 0xFF; }
+};
+
+// architectural register state, as compared between engines
+struct CpuState
+{
+	uint8_t A, CC;
+	uint16_t PC, SP, X, Y;
+};
+
+// machine state saved by the fuzzer and restored between runs
+struct Snapshot
+{
+	CpuState regs;
+	std::vector<uint8_t> ram;
+};
+
+// define our CPU arch
+class Cisc
+{
+protected:
+	// 8-bit registers
+	uint8_t A, CC;
+
+	// 16-bit registers
+	uint16_t PC, SP, X, Y;
+	
+	// memory
+	uint8_t ram[0x10000];
+	uint8_t rom[0x10000];
+
+	// processor state
+	uint16_t maxStack;
+	uint16_t __brk;
+	uint64_t instructionCount;
+
+	// task accounting, keyed by TCB address
+	using TaskList = std::map<uint16_t, TaskStats>;
+	TaskList tasks;
+	TaskStats *pTask;
+	bool taskTracking;
+	uint16_t currentTaskAddr;	// address of the os.asm 'current' TCB pointer
+	uint16_t currentTask;		// last observed value of 'current'
+	uint64_t taskSwitches;
+
+	// stack profiling, keyed by PROC address
+	using ProcStackList = std::map<uint16_t, ProcStackStats>;
+	ProcStackList procStacks;
+	bool stackProfiling;
+
+	// guest IO, port 1 reads from inputData after setInput() and otherwise from stdin
+	bool hasInput;
+	const uint8_t *inputData;
+	size_t inputSize, inputPos;
+	std::vector<uint8_t> *pOutput;
+
+	// hooks used to observe the engine from the lockstep harness
+	bool quiet;					// suppress trace and diagnostic output
+	bool trapPanics;			// return from panic() rather than stopping
+	bool faulted;				// panic() was called
+	bool trackWrites;			// record the address of every store
+	std::vector<uint16_t> writes;
+
+	// hooks used by the fuzzer
+	bool trackDirty;			// mark the pages touched by stores
+	uint8_t dirtyPages[0x100];
+	uint8_t *pCoverage;			// hit counts indexed by branch edge hash
+	std::vector<uint16_t> *pEdges;	// edges hit for the first time this run
+	bool inputExhausted;		// port 1 was read past the end of inputData
+	bool stackOverflowed;		// the stack grew across __brk
+	bool vectorWritten;			// a store changed an interrupt vector
+
+	// instruction buffer
+	uint8_t opcode;
+
+	void log(const char *fmt, ...);
+
+	// symbol names for the trace, only looked up when the trace is on
+	bool tracing() const						{ return !quiet && TSTF(FLAG_S); }
+	const char *traceCodeSymbol(uint16_t addr)	{ return tracing() ? obj.findCodeSymbolByAddr(addr) : nullptr; }
+	const char *traceDataSymbol(uint16_t addr)	{ return tracing() ? obj.findDataSymbolByAddr(addr) : nullptr; }
+
+	void pushRegs();
+	void popRegs();
+
+	using BreakpointList = std::set<uint32_t>;
+	BreakpointList breakpoints;
+
+	ObjectFileView obj;
+
+	void accountTask();
+	void enterFrame(uint16_t target, uint16_t entrySP, bool isInterrupt = false);
+	void leaveFrame();
+	
+public:
+	Cisc() {
+		taskTracking = false;
+		stackProfiling = false;
+		currentTaskAddr = 0;
+		__brk = 0;
+
+		hasInput = false;
+		inputData = nullptr;
+		inputSize = inputPos = 0;
+		pOutput = nullptr;
+
+		quiet = trapPanics = trackWrites = false;
+
+		trackDirty = false;
+		memset(dirtyPages, 0, sizeof(dirtyPages));
+		pCoverage = nullptr;
+		pEdges = nullptr;
+
+		reset();
+	}
+
+	virtual ~Cisc() {}
+
+	void load(const std::string &filename);
+	void loadImage(const uint8_t *text, size_t textSize, const uint8_t *data, size_t dataSize, uint16_t entry);
+
+	void reset() 
+	{ 
+		A = CC = opcode = 0; 
+		X = Y = 0;
+
+		ram[RESET_VECTOR] = 0;
+		ram[RESET_VECTOR + 1] = 0;
+
+		PC = ram[RESET_VECTOR];
+		SP = RAM_END;
+
+		maxStack = SP;
+		instructionCount = 0;
+		faulted = false;
+		writes.clear();
+		inputExhausted = false;
+		stackOverflowed = false;
+		vectorWritten = false;
+
+		tasks.clear();
+		currentTask = 0;
+		taskSwitches = 0;
+		pTask = &tasks[currentTask];
+		pTask->stackTop = SP;
+		procStacks.clear();
+
+		ram[MMIO_TIMER_REG] = 0;
+		ram[MMIO_TIMER_ENA] = 0;
+		ram[MMIO_TIMER_LIM] = 0;
+	}
+
+	uint32_t checkOverflow(uint16_t val);
+	uint32_t checkOverflow(uint32_t val);
+	void inputByte();
+	void outputByte();
+
+	uint16_t getMaxStack() { return RAM_END - maxStack; }
+	void printTaskStats();
+	void printStackStats();
+	void push(uint8_t val);
+	uint8_t pop();
+	void getRegisterList(uint8_t operand, std::string&);
+	void panic();
+	uint16_t fetchW();
+	uint16_t fetchBranch();
+	uint8_t fetch();
+	void decode();
+	void pushAll();
+	void popAll();
+	void updateFlag(uint32_t result, uint8_t flag);
+
+	uint8_t exec();
+	virtual uint8_t tick();
+
+	// all guest stores go through here so they can be observed
+	void store(uint16_t addr, uint8_t val)
+	{
+		if (trackDirty)
+		{
+			dirtyPages[addr >> 8] = 1;
+
+			// flag an overwritten vector at the store, like a stack overflow
+			if (addr >= BRK_VECTOR && ram[addr] != val)
+				vectorWritten = true;
+		}
+
+		ram[addr] = val;
+
+		if (trackWrites)
+			writes.push_back(addr);
+	}
+
+	// count a taken or not taken branch edge
+	void recordEdge(uint16_t from, uint16_t to)
+	{
+		uint16_t edge = (uint16_t)((from * 0x9E37) ^ to);
+
+		if (0 == pCoverage[edge]++)
+			pEdges->push_back(edge);
+		else if (0 == pCoverage[edge])
+			pCoverage[edge] = 0xFF;		// saturate
+	}
+
+	// lockstep harness support
+	void setInput(const uint8_t *data, size_t size) { hasInput = true; inputData = data; inputSize = size; inputPos = 0; }
+	void captureOutput(std::vector<uint8_t> *output) { pOutput = output; }
+	void setQuiet(bool value)		{ quiet = value; }
+	void setTrapPanics(bool value)	{ trapPanics = value; }
+	void setTrackWrites(bool value) { trackWrites = value; }
+	bool isFaulted() const			{ return faulted; }
+	const std::vector<uint16_t> &getWrites() const { return writes; }
+	void clearWrites()				{ writes.clear(); }
+	const uint8_t *ramPtr() const	{ return ram; }
+	uint8_t peekCode(uint16_t addr) const	{ return rom[addr]; }
+
+	// fuzzer support
+	void setCoverage(uint8_t *coverage, std::vector<uint16_t> *edges) { pCoverage = coverage; pEdges = edges; }
+	bool isInputExhausted() const	{ return inputExhausted; }
+	bool hasStackOverflowed() const { return stackOverflowed; }
+	bool hasVectorWritten() const	{ return vectorWritten; }
+	void saveSnapshot(Snapshot &snap);
+	void restoreSnapshot(const Snapshot &snap);
+	const char *getNearestCodeSymbol(uint16_t addr, uint16_t &symAddr) { return obj.findNearestCodeSymbolToAddr(addr, symAddr); }
+	const char *getDataSymbolName(uint16_t addr) { return obj.findDataSymbolByAddr(addr); }
+
+	CpuState getState() const
+	{
+		CpuState state;
+
+		state.A = A;
+		state.CC = CC;
+		state.PC = PC;
+		state.SP = SP;
+		state.X = X;
+		state.Y = Y;
+
+		return state;
+	}
+
+	void interrupt(uint32_t vector);
+
+	uint8_t getCC() const	{ return CC;  }
+	void setCC(uint8_t cc)	{ CC = cc; }
+
+	// breakpoints
+	uint16_t getPC() const { return PC; }
+	bool getSymbolAddress(const std::string &name, uint16_t &addr);
+	const char *getCodeSymbolName(uint16_t addr);
+	void addBreakpoint(uint16_t addr) { breakpoints.insert(addr); }
+
+	void clearAllBreakpoints() { breakpoints.clear(); }
+
+	bool clearBreakpoint(const std::string &name)
+	{
+		uint16_t addr = 0;
+		if (getSymbolAddress(name, addr))
+		{
+			breakpoints.erase(addr);
+			log("breakpoint deleted @ %s (" HEX_PREFIX "%04X)", name.c_str(), addr);
+
+			return true;
+		}
+
+		return false;
+	}
+
+	void listBreakpoints();
+
+	bool setBreakpoint(const std::string &name)
+	{
+		uint16_t addr = 0;
+		if (getSymbolAddress(name, addr))
+		{
+			addBreakpoint(addr);
+			log("breakpoint set @ %s (" HEX_PREFIX "%04X)", name.c_str(), addr);
+
+			return true;
+		}
+		
+		return false;
+	}
+
+	bool isBreakpoint(uint16_t addr)
+	{
+		if (breakpoints.find(addr) != breakpoints.end())
+			return true;
+		
+		return false;
+	}
+
+	uint16_t getAddressFromToken(char *tok);
+
+	//
+	void printRegisters()
+	{
+		printf("A: %02X X: %04X Y: %04X CC: %02X SP: %04X PC: %04X\n", A, X, Y, CC, SP, PC);
+		printf("Flags C: %d Z: %d V: %d N: %d I: %d S: %d\n", TSTF(FLAG_C), TSTF(FLAG_Z), TSTF(FLAG_V), TSTF(FLAG_N), TSTF(FLAG_I), TSTF(FLAG_S));
+	}
+
+	void printByte(uint16_t addr)
+	{
+		printf("%d (" HEX_PREFIX "%04X) points to -> %d (" HEX_PREFIX "%02X)\n", addr, addr, ram[addr], ram[addr]);
+	}
+
+	void printWord(uint16_t addr)
+	{
+		uint16_t value = ram[addr] + (ram[addr + 1] << 8);
+
+		printf("%d (" HEX_PREFIX "%04X) points to -> %d (" HEX_PREFIX "%04X)\n", addr, addr, value, value);
+	}
+
+	void dumpMemoryAt(uint32_t addr)
+	{
+		hexDumpLine(stdout, addr, &ram[addr]);
+		hexDumpLine(stdout, addr + 16, &ram[addr + 16]);
+	}
+
+	void reportLocation()
+	{
+		uint16_t addr;
+
+		if (auto name = obj.findNearestCodeSymbolToAddr(PC, addr))
+		{
+			if (PC > addr)
+				log("execution stopped @ %s +%d (" HEX_PREFIX "%04X)", name, PC - addr, PC);
+			else
+				log("execution stopped @ %s (" HEX_PREFIX "%04X)", name, PC);
+		}
+		else
+			log("stopped @ " HEX_PREFIX "%X", PC);
+	}
+};
+
+// lockstep.cpp
+Cisc *createEngine(const std::string &name);
+int runLockstep(const char *filename, const std::string &engine, const std::vector<uint8_t> &input, uint64_t maxSteps);
+int runRandomLockstep(uint64_t seed, const std::string &engine, uint64_t programs, uint64_t maxSteps);
+
+// fuzz.cpp
+int runFuzzer(const char *filename, const char *corpusDir, uint64_t maxExecs, uint64_t maxSteps);
+
+// lanes.cpp
+Cisc *createLaneEngine(bool vector);
+int runBatch(const char *filename, char *inputFiles[], int count, uint64_t maxSteps, std::string engine, unsigned threads);
+
+// main.cpp
+bool readBinaryFile(const char *filename, std::vector<uint8_t> &data);
+
+#endif // __CISC_H
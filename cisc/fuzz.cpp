@@ -0,0 +1,437 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "cisc.h"
+#include <signal.h>
+#include <chrono>
+
+#ifdef _WIN32
+#	include <io.h>
+#	include <direct.h>
+#else
+#	include <dirent.h>
+#	include <sys/stat.h>
+#endif
+
+//
+// Coverage-guided fuzzer
+//
+// Feeds generated byte streams to port 1 of a guest program. The machine is
+// run once up to the first IN from port 1 and snapshotted there, and every
+// run starts from that snapshot. Branch edge coverage decides which inputs
+// are kept in the corpus for further mutation.
+//
+
+static const uint64_t DEFAULT_RUN_STEPS		= 100000;
+static const uint64_t MAX_STARTUP_STEPS		= 10000000;
+static const size_t MAX_INPUT_SIZE			= 1024;
+static const int COVERAGE_SIZE				= 0x10000;
+
+// ways a guest program can crash
+enum
+{
+	CRASH_NONE,
+	CRASH_PANIC,		// invalid opcode
+	CRASH_STACK,		// stack grew across __brk
+	CRASH_VECTOR		// interrupt vectors were overwritten
+};
+
+static const char *crashNames[] = { "none", "panic", "stack", "vector" };
+
+// bytes that commonly matter to parsers
+static const uint8_t interestingBytes[] = { 0, 1, '\n', '\r', ' ', '0', '9', 'A', 'Z', 'a', 'z', 0x7F, 0x80, 0xFF };
+
+static volatile sig_atomic_t stopFuzzing = 0;
+
+// Ctrl-C pressed
+static void fuzzSigint(int val)
+{
+	stopFuzzing = 1;
+}
+
+// list the regular files in a directory
+static void listFiles(const std::string &dir, std::vector<std::string> &files)
+{
+#ifdef _WIN32
+	_finddata_t fd;
+	auto handle = _findfirst((dir + "/*").c_str(), &fd);
+	if (handle == -1)
+		return;
+
+	do
+	{
+		if (!(fd.attrib & _A_SUBDIR))
+			files.push_back(dir + "/" + fd.name);
+	} while (_findnext(handle, &fd) == 0);
+
+	_findclose(handle);
+#else
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return;
+
+	while (auto entry = readdir(d))
+	{
+		if (entry->d_name[0] != '.')
+			files.push_back(dir + "/" + entry->d_name);
+	}
+
+	closedir(d);
+#endif
+}
+
+// create a directory if it does not already exist
+static void makeDirectory(const std::string &dir)
+{
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0755);
+#endif
+}
+
+// write a byte buffer to a file
+static bool writeBinaryFile(const std::string &filename, const std::vector<uint8_t> &data)
+{
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (nullptr == f)
+		return false;
+
+	fwrite(data.data(), 1, data.size(), f);
+	fclose(f);
+
+	return true;
+}
+
+// map a hit count to a single bit so that loop counts only matter coarsely
+static uint8_t countBucket(uint8_t count)
+{
+	if (count < 4)
+		return count == 3 ? 4 : count;
+	if (count < 8)
+		return 8;
+	if (count < 16)
+		return 16;
+	if (count < 32)
+		return 32;
+	if (count < 128)
+		return 64;
+
+	return 128;
+}
+
+//
+class Fuzzer
+{
+	Cisc *cpu;
+	Snapshot snap;
+
+	std::string imageFile;
+	std::string corpusDir;
+	std::vector<std::vector<uint8_t>> corpus;
+
+	uint8_t coverage[COVERAGE_SIZE];	// hit counts for the current run
+	uint8_t virgin[COVERAGE_SIZE];		// count buckets seen across all runs
+	std::vector<uint16_t> edges;
+	uint64_t edgeCount;
+
+	std::set<uint32_t> crashes;			// unique (kind, PC) pairs
+	uint16_t crashPC;
+
+	std::vector<uint8_t> output;		// port 1 output of the current run
+
+	uint64_t maxSteps;
+	XorShift rng;
+
+public:
+	Fuzzer(const std::string &dir, uint64_t steps) : corpusDir(dir), maxSteps(steps), rng(0x5EED)
+	{
+		cpu = new Cisc();
+		memset(coverage, 0, sizeof(coverage));
+		memset(virgin, 0, sizeof(virgin));
+		edgeCount = 0;
+		crashPC = 0;
+	}
+
+	~Fuzzer() { delete cpu; }
+
+	bool start(const char *filename);
+	int run(const std::vector<uint8_t> &input);
+	bool updateCoverage();
+	void mutate(std::vector<uint8_t> &data);
+	void saveCrash(int kind, const std::vector<uint8_t> &input);
+	void loadCorpus();
+	int fuzz(const char *filename, uint64_t maxExecs);
+};
+
+// load the image and run it up to its first read from port 1
+bool Fuzzer::start(const char *filename)
+{
+	imageFile = filename;
+
+	cpu->setQuiet(true);
+	cpu->setTrapPanics(true);
+	cpu->captureOutput(&output);
+	cpu->load(filename);
+
+	uint64_t steps = 0;
+	while (!(cpu->peekCode(cpu->getPC()) == OP_IN && cpu->peekCode(cpu->getPC() + 1) == 1))
+	{
+		cpu->tick();
+
+		if (cpu->isFaulted() || ++steps > MAX_STARTUP_STEPS)
+		{
+			fprintf(stderr, "Program never reads from port 1, nothing to fuzz!\n");
+			return false;
+		}
+	}
+
+	printf("Snapshot taken at " HEX_PREFIX "%04X after %llu instructions\n", cpu->getPC(), (unsigned long long)steps);
+
+	cpu->saveSnapshot(snap);
+	cpu->setCoverage(coverage, &edges);
+
+	return true;
+}
+
+// run one input from the snapshot and return the kind of crash, if any
+int Fuzzer::run(const std::vector<uint8_t> &input)
+{
+	cpu->restoreSnapshot(snap);
+	cpu->setInput(input.data(), input.size());
+	output.clear();
+
+	for (uint64_t steps = 0; steps < maxSteps; steps++)
+	{
+		crashPC = cpu->getPC();
+		cpu->tick();
+
+		if (cpu->isFaulted())
+			return CRASH_PANIC;
+
+		if (cpu->hasStackOverflowed())
+			return CRASH_STACK;
+
+		if (cpu->hasVectorWritten())
+			return CRASH_VECTOR;
+
+		// the program asked for more input than we gave it
+		if (cpu->isInputExhausted())
+			break;
+	}
+
+	return CRASH_NONE;
+}
+
+// fold the last run into the global coverage, returns true for new coverage
+bool Fuzzer::updateCoverage()
+{
+	bool isNew = false;
+
+	for (auto it = edges.begin(); it != edges.end(); it++)
+	{
+		auto edge = *it;
+		auto bit = countBucket(coverage[edge]);
+		coverage[edge] = 0;
+
+		if (bit & ~virgin[edge])
+		{
+			if (0 == virgin[edge])
+				edgeCount++;
+
+			virgin[edge] |= bit;
+			isNew = true;
+		}
+	}
+
+	edges.clear();
+	return isNew;
+}
+
+// apply a small stack of random mutations
+void Fuzzer::mutate(std::vector<uint8_t> &data)
+{
+	int count = 1 + rng.next() % 8;
+
+	for (int i = 0; i < count; i++)
+	{
+		size_t pos = data.empty() ? 0 : rng.next() % data.size();
+
+		switch (rng.next() % 8)
+		{
+		case 0:		// flip a bit
+			if (!data.empty())
+				data[pos] ^= 1 << (rng.next() % 8);
+			break;
+
+		case 1:		// random byte
+			if (!data.empty())
+				data[pos] = rng.nextByte();
+			break;
+
+		case 2:		// interesting byte
+			if (!data.empty())
+				data[pos] = interestingBytes[rng.next() % sizeof(interestingBytes)];
+			break;
+
+		case 3:		// insert a random byte
+			data.insert(data.begin() + pos, rng.nextByte());
+			break;
+
+		case 4:		// insert an interesting byte
+			data.insert(data.begin() + pos, interestingBytes[rng.next() % sizeof(interestingBytes)]);
+			break;
+
+		case 5:		// delete a block
+			if (!data.empty())
+			{
+				size_t len = 1 + rng.next() % (data.size() - pos);
+				data.erase(data.begin() + pos, data.begin() + pos + len);
+			}
+			break;
+
+		case 6:		// duplicate a block
+			if (!data.empty())
+			{
+				size_t len = 1 + rng.next() % (data.size() - pos);
+				std::vector<uint8_t> block(data.begin() + pos, data.begin() + pos + len);
+				data.insert(data.begin() + rng.next() % data.size(), block.begin(), block.end());
+			}
+			break;
+
+		case 7:		// splice in part of another corpus entry
+			{
+				auto &other = corpus[rng.next() % corpus.size()];
+				if (!other.empty())
+				{
+					size_t from = rng.next() % other.size();
+					size_t len = 1 + rng.next() % (other.size() - from);
+					data.insert(data.begin() + pos, other.begin() + from, other.begin() + from + len);
+				}
+			}
+			break;
+		}
+	}
+
+	if (data.size() > MAX_INPUT_SIZE)
+		data.resize(MAX_INPUT_SIZE);
+}
+
+// save a reproducer for each unique crash
+void Fuzzer::saveCrash(int kind, const std::vector<uint8_t> &input)
+{
+	if (!crashes.insert((kind << 16) | crashPC).second)
+		return;
+
+	char buf[SMALL_BUFFER];
+	sprintf(buf, "%s/crash-%s-%04X", corpusDir.c_str(), crashNames[kind], crashPC);
+
+	uint16_t symAddr;
+	auto name = cpu->getNearestCodeSymbol(crashPC, symAddr);
+
+	printf("\nCrash: %s @ %s (" HEX_PREFIX "%04X), reproduce with: cisc -i %s %s\n", crashNames[kind], name ? name : "?", crashPC, buf, imageFile.c_str());
+	writeBinaryFile(buf, input);
+}
+
+// read the seed inputs, adding an empty input if there are none
+void Fuzzer::loadCorpus()
+{
+	makeDirectory(corpusDir);
+
+	std::vector<std::string> files;
+	listFiles(corpusDir, files);
+
+	for (auto it = files.begin(); it != files.end(); it++)
+	{
+		// don't re-run known crashes
+		if (it->find("/crash-") != std::string::npos)
+			continue;
+
+		std::vector<uint8_t> data;
+		if (readBinaryFile(it->c_str(), data))
+			corpus.push_back(data);
+	}
+
+	if (corpus.empty())
+		corpus.push_back(std::vector<uint8_t>());
+}
+
+// main fuzzing loop
+int Fuzzer::fuzz(const char *filename, uint64_t maxExecs)
+{
+	if (!start(filename))
+		return -1;
+
+	loadCorpus();
+
+	// establish the coverage of the seeds
+	for (auto it = corpus.begin(); it != corpus.end(); it++)
+	{
+		auto kind = run(*it);
+		updateCoverage();
+
+		if (kind != CRASH_NONE)
+			saveCrash(kind, *it);
+	}
+
+	printf("Fuzzing with %d seed inputs, %llu edges covered\n", (int)corpus.size(), (unsigned long long)edgeCount);
+
+	signal(SIGINT, fuzzSigint);
+
+	auto startTime = std::chrono::steady_clock::now();
+	auto lastReport = startTime;
+	uint64_t execs = 0;
+	std::vector<uint8_t> input;
+
+	while (!stopFuzzing && (0 == maxExecs || execs < maxExecs))
+	{
+		input = corpus[rng.next() % corpus.size()];
+		mutate(input);
+
+		auto kind = run(input);
+		bool isNew = updateCoverage();
+		execs++;
+
+		if (kind != CRASH_NONE)
+			saveCrash(kind, input);
+		else if (isNew)
+		{
+			char buf[SMALL_BUFFER];
+			sprintf(buf, "%s/id-%06d", corpusDir.c_str(), (int)corpus.size());
+			writeBinaryFile(buf, input);
+
+			corpus.push_back(input);
+		}
+
+		// periodic status line
+		if (0 == (execs & 0x3FF))
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (now - lastReport >= std::chrono::seconds(1))
+			{
+				double secs = std::chrono::duration<double>(now - startTime).count();
+				printf("execs: %llu (%.0f/s) corpus: %d edges: %llu crashes: %d\n", (unsigned long long)execs, execs / secs,
+					(int)corpus.size(), (unsigned long long)edgeCount, (int)crashes.size());
+				fflush(stdout);
+
+				lastReport = now;
+			}
+		}
+	}
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	printf("\nFuzzing done: %llu execs in %.1fs, corpus: %d edges: %llu crashes: %d\n", (unsigned long long)execs, secs,
+		(int)corpus.size(), (unsigned long long)edgeCount, (int)crashes.size());
+
+	return crashes.empty() ? 0 : 1;
+}
+
+// fuzz the port 1 input of an executable image
+int runFuzzer(const char *filename, const char *corpusDir, uint64_t maxExecs, uint64_t maxSteps)
+{
+	Fuzzer *fuzzer = new Fuzzer(corpusDir, maxSteps ? maxSteps : DEFAULT_RUN_STEPS);
+
+	auto result = fuzzer->fuzz(filename, maxExecs);
+
+	delete fuzzer;
+	return result;
+}
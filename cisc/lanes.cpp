@@ -0,0 +1,1169 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "cisc.h"
+#include "lanes.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef _MSC_VER
+#	include <intrin.h>
+#endif
+
+//
+// Multi-lane interpreter
+//
+// Runs LANES copies of the same image side by side, each with its own
+// registers, RAM and port IO. The registers are kept as structure of arrays
+// and every instruction is executed for all lanes sharing the scheduled PC.
+// The RAM of the lanes is interleaved, so an address is one row holding the
+// byte of every lane and lanes that load or store the same address do it
+// with a single vector access. Lanes whose PCs diverge sit out until the
+// scheduler picks their PC again, scheduling the lowest PC first lets lanes
+// which split at a branch meet up again further on.
+//
+// The work of a step is done by a set of kernels, see lanes.h. The AVX2
+// kernels in lanes_avx2.cpp are used when the CPU has AVX2, the portable
+// kernels below otherwise. Instructions the kernels leave alone, like IO,
+// interrupts and stack accesses at different SPs, run lane by lane here.
+//
+// One observed lane mirrors its stores into the RAM of the Cisc base class
+// and its registers are copied back after every instruction, so the engine
+// can be checked against the reference interpreter with the lockstep
+// harness. The observed lane moves on each time the engine is restarted so
+// that a run of random programs checks every lane. Batch runs have no
+// observed lane.
+//
+
+static const uint64_t DEFAULT_LANE_STEPS	= 1000000;
+
+// scalar state of a single lane
+struct LaneInfo
+{
+	bool faulted;				// hit an invalid opcode
+	bool overflowed;			// the stack grew across __brk
+	bool exhausted;				// port 1 was read past the end of the input
+
+	const uint8_t *input;
+	size_t inputSize, inputPos;
+	std::vector<uint8_t> output;
+};
+
+// true when the CPU and the OS support AVX2
+static bool cpuHasAvx2()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int regs[4];
+
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+
+	// the OS must save the YMM registers
+	__cpuid(regs, 1);
+	if (!(regs[2] & (1 << 27)) || !(regs[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return false;
+#endif
+}
+
+// byte addr of a lane
+static inline uint8_t &laneByte(LaneFile &f, int lane, uint16_t addr)
+{
+	return f.ram[addr * LANES + lane];
+}
+
+//
+// Portable kernels
+//
+
+// run the lowest PC, unless a lane has waited too long
+static bool scheduleScalar(LaneFile &f, uint16_t &target, uint32_t &timerLanes)
+{
+	int lane = -1, starved = -1;
+	for (int l = 0; l < LANES; l++)
+	{
+		if (!f.active[l])
+			continue;
+
+		if (lane < 0 || f.pc[l] < f.pc[lane])
+			lane = l;
+
+		if (f.waited[l] > LANE_MAX_STARVE && (starved < 0 || f.waited[l] > f.waited[starved]))
+			starved = l;
+	}
+
+	if (starved >= 0)
+		lane = starved;
+
+	if (lane < 0)
+		return false;
+
+	target = f.pc[lane];
+	f.leader = lane;
+
+	// the timer is checked once before each instruction as in Cisc::tick()
+	const uint8_t *enabled = &laneByte(f, 0, MMIO_TIMER_ENA);
+
+	timerLanes = 0;
+	for (int l = 0; l < LANES; l++)
+	{
+		f.mask[l] = (f.active[l] && f.pc[l] == target) ? 0xFFFF : 0;
+
+		if (f.mask[l] && !f.timerDone[l] && enabled[l])
+			timerLanes |= 1u << l;
+	}
+
+	return true;
+}
+
+// A = low byte of an arithmetic result
+static void setA(LaneFile &f, const uint16_t *t)
+{
+	for (int l = 0; l < LANES; l++)
+		f.a[l] = f.mask[l] ? (uint8_t)t[l] : f.a[l];
+}
+
+// C, Z, N and V of an 8-bit arithmetic result
+static void flags8(LaneFile &f, const uint16_t *t)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		uint16_t check = t[l] & 0x180;
+		uint16_t c = f.cc[l] & ~(FLAG_C | FLAG_Z | FLAG_N | FLAG_V);
+
+		c |= (t[l] & 0xFF00) ? FLAG_C : 0;
+		c |= (t[l] == 0) ? FLAG_Z : 0;
+		c |= (t[l] & 0x80) ? FLAG_N : 0;
+		c |= (check == 0x100 || check == 0x80) ? FLAG_V : 0;
+
+		f.cc[l] = f.mask[l] ? c : f.cc[l];
+	}
+}
+
+// C, Z, N and V of a 16-bit compare
+static void flags16(LaneFile &f, const uint32_t *t)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		uint32_t check = t[l] & 0x18000;
+		uint16_t c = f.cc[l] & ~(FLAG_C | FLAG_Z | FLAG_N | FLAG_V);
+
+		c |= (t[l] & 0xFFFF0000) ? FLAG_C : 0;
+		c |= (t[l] == 0) ? FLAG_Z : 0;
+		c |= (t[l] & 0x8000) ? FLAG_N : 0;
+		c |= (check == 0x10000 || check == 0x8000) ? FLAG_V : 0;
+
+		f.cc[l] = f.mask[l] ? c : f.cc[l];
+	}
+}
+
+// Z and N of A, V cleared
+static void logicFlags(LaneFile &f)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		uint16_t c = f.cc[l] & ~(FLAG_Z | FLAG_N | FLAG_V);
+
+		c |= (f.a[l] == 0) ? FLAG_Z : 0;
+		c |= (f.a[l] & 0x80) ? FLAG_N : 0;
+
+		f.cc[l] = f.mask[l] ? c : f.cc[l];
+	}
+}
+
+// Z and N of a 16-bit load, V cleared
+static void loadFlags16(LaneFile &f, const uint16_t *r)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		uint16_t c = f.cc[l] & ~(FLAG_Z | FLAG_N | FLAG_V);
+
+		c |= (r[l] == 0) ? FLAG_Z : 0;
+		c |= (r[l] & 0x8000) ? FLAG_N : 0;
+
+		f.cc[l] = f.mask[l] ? c : f.cc[l];
+	}
+}
+
+// load a word at the same address for every lane
+static void gather16(LaneFile &f, uint16_t addr, uint16_t *val)
+{
+	const uint8_t *lo = &laneByte(f, 0, addr);
+	const uint8_t *hi = &laneByte(f, 0, (uint16_t)(addr + 1));
+
+	for (int l = 0; l < LANES; l++)
+		val[l] = lo[l] + (hi[l] << 8);
+}
+
+// store a byte of each masked lane to the same address
+static void scatter8(LaneFile &f, uint16_t addr, const uint16_t *val, int shift)
+{
+	uint8_t *row = &laneByte(f, 0, addr);
+
+	for (int l = 0; l < LANES; l++)
+		row[l] = f.mask[l] ? (uint8_t)(val[l] >> shift) : row[l];
+
+	f.writes[f.writeCount++] = addr;
+}
+
+// conditional branch, this is where lanes diverge
+static void branch(LaneFile &f, uint16_t target, const uint8_t *cond)
+{
+	for (int l = 0; l < LANES; l++)
+		f.pc[l] = (f.mask[l] && cond[l]) ? target : f.pc[l];
+}
+
+// ALU, flag, load, store to a fixed address and branch instructions
+static bool executeScalar(LaneFile &f, uint8_t op, uint16_t next, uint16_t addr, uint8_t operand)
+{
+	uint16_t t[LANES];
+	uint32_t t32[LANES];
+	uint8_t cond[LANES];
+
+	for (int l = 0; l < LANES; l++)
+		f.pc[l] = f.mask[l] ? next : f.pc[l];
+
+	const uint8_t *row = &laneByte(f, 0, addr);
+
+	switch (op)
+	{
+	case OP_NOP:
+		break;
+
+	case OP_SHL:
+		for (int l = 0; l < LANES; l++)
+			t[l] = operand < 16 ? f.a[l] << operand : 0;
+		flags8(f, t);
+		setA(f, t);
+		break;
+
+	case OP_SHR:
+		for (int l = 0; l < LANES; l++)
+		{
+			uint16_t r = (operand < 8 ? f.a[l] >> operand : 0) | (f.a[l] & 0x80);
+			uint16_t c = f.cc[l] & ~(FLAG_C | FLAG_Z | FLAG_N);
+
+			c |= (f.a[l] & 1) ? FLAG_C : 0;
+			c |= (r == 0) ? FLAG_Z : 0;
+			c |= (r & 0x80) ? FLAG_N : 0;
+
+			f.cc[l] = f.mask[l] ? c : f.cc[l];
+			f.a[l] = f.mask[l] ? r : f.a[l];
+		}
+		break;
+
+	case OP_ADD:
+	case OP_ADC:
+		for (int l = 0; l < LANES; l++)
+			t[l] = f.a[l] + row[l] + ((op == OP_ADC && (f.cc[l] & FLAG_C)) ? 1 : 0);
+		flags8(f, t);
+		setA(f, t);
+		break;
+
+	case OP_ADDI:
+	case OP_ADCI:
+		for (int l = 0; l < LANES; l++)
+			t[l] = f.a[l] + operand + ((op == OP_ADCI && (f.cc[l] & FLAG_C)) ? 1 : 0);
+		flags8(f, t);
+		setA(f, t);
+		break;
+
+	case OP_SUB:
+	case OP_SBB:
+	case OP_CMP:
+		for (int l = 0; l < LANES; l++)
+			t[l] = f.a[l] - row[l] - ((op == OP_SBB && (f.cc[l] & FLAG_C)) ? 1 : 0);
+		flags8(f, t);
+		if (op != OP_CMP)
+			setA(f, t);
+		break;
+
+	case OP_SUBI:
+	case OP_SBBI:
+	case OP_CMPI:
+		for (int l = 0; l < LANES; l++)
+			t[l] = f.a[l] - operand - ((op == OP_SBBI && (f.cc[l] & FLAG_C)) ? 1 : 0);
+		flags8(f, t);
+		if (op != OP_CMPI)
+			setA(f, t);
+		break;
+
+	case OP_AAX:
+		for (int l = 0; l < LANES; l++)
+			f.x[l] = f.mask[l] ? f.x[l] + f.a[l] : f.x[l];
+		break;
+
+	case OP_AAY:
+		for (int l = 0; l < LANES; l++)
+			f.y[l] = f.mask[l] ? f.y[l] + f.a[l] : f.y[l];
+		break;
+
+	case OP_CMPX:
+	case OP_CMPY:
+		gather16(f, addr, t);
+		for (int l = 0; l < LANES; l++)
+			t32[l] = (op == OP_CMPX ? f.x[l] : f.y[l]) - t[l];
+		flags16(f, t32);
+		break;
+
+	case OP_CMPXI:
+	case OP_CMPYI:
+		for (int l = 0; l < LANES; l++)
+			t32[l] = (op == OP_CMPXI ? f.x[l] : f.y[l]) - addr;
+		flags16(f, t32);
+		break;
+
+	case OP_AND:
+	case OP_OR:
+	case OP_XOR:
+		for (int l = 0; l < LANES; l++)
+		{
+			uint16_t r = op == OP_AND ? f.a[l] & row[l] : op == OP_OR ? f.a[l] | row[l] : f.a[l] ^ row[l];
+			f.a[l] = f.mask[l] ? r : f.a[l];
+		}
+		logicFlags(f);
+		break;
+
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+		for (int l = 0; l < LANES; l++)
+		{
+			uint16_t r = op == OP_ANDI ? f.a[l] & operand : op == OP_ORI ? f.a[l] | operand : f.a[l] ^ operand;
+			f.a[l] = f.mask[l] ? r : f.a[l];
+		}
+		logicFlags(f);
+		break;
+
+	case OP_NOT:
+		for (int l = 0; l < LANES; l++)
+		{
+			f.a[l] = f.mask[l] ? (uint8_t)~f.a[l] : f.a[l];
+			f.cc[l] = f.mask[l] ? f.cc[l] | FLAG_C : f.cc[l];
+		}
+		logicFlags(f);
+		break;
+
+	case OP_JMP:
+		for (int l = 0; l < LANES; l++)
+			f.pc[l] = f.mask[l] ? addr : f.pc[l];
+		break;
+
+	case OP_JNE:
+	case OP_JEQ:
+		for (int l = 0; l < LANES; l++)
+			cond[l] = ((f.cc[l] & FLAG_Z) != 0) == (op == OP_JEQ);
+		branch(f, addr, cond);
+		break;
+
+	case OP_JGT:
+		for (int l = 0; l < LANES; l++)
+			cond[l] = !(f.cc[l] & FLAG_Z) && ((f.cc[l] & FLAG_N) != 0) == ((f.cc[l] & FLAG_V) != 0);
+		branch(f, addr, cond);
+		break;
+
+	case OP_JLT:
+		for (int l = 0; l < LANES; l++)
+			cond[l] = ((f.cc[l] & FLAG_N) != 0) != ((f.cc[l] & FLAG_V) != 0);
+		branch(f, addr, cond);
+		break;
+
+	case OP_LAX:
+	case OP_LAY:
+		for (int l = 0; l < LANES; l++)
+		{
+			uint16_t r = laneByte(f, l, op == OP_LAX ? f.x[l] : f.y[l]);
+			f.a[l] = f.mask[l] ? r : f.a[l];
+		}
+		logicFlags(f);
+		break;
+
+	case OP_LDA:
+		for (int l = 0; l < LANES; l++)
+			f.a[l] = f.mask[l] ? row[l] : f.a[l];
+		logicFlags(f);
+		break;
+
+	case OP_LDAI:
+		for (int l = 0; l < LANES; l++)
+			f.a[l] = f.mask[l] ? operand : f.a[l];
+		logicFlags(f);
+		break;
+
+	case OP_LDX:
+	case OP_LDY:
+	{
+		uint16_t *r = op == OP_LDX ? f.x : f.y;
+
+		gather16(f, addr, t);
+		for (int l = 0; l < LANES; l++)
+			r[l] = f.mask[l] ? t[l] : r[l];
+		loadFlags16(f, r);
+		break;
+	}
+
+	case OP_LDXI:
+	case OP_LDYI:
+	{
+		uint16_t *r = op == OP_LDXI ? f.x : f.y;
+
+		for (int l = 0; l < LANES; l++)
+			r[l] = f.mask[l] ? addr : r[l];
+		loadFlags16(f, r);
+		break;
+	}
+
+	case OP_LEAX:
+	case OP_LEAY:
+	{
+		uint16_t *r = op == OP_LEAX ? f.x : f.y;
+
+		for (int l = 0; l < LANES; l++)
+		{
+			uint16_t sum = (int)r[l] + (char)operand;
+
+			r[l] = f.mask[l] ? sum : r[l];
+			f.cc[l] = f.mask[l] ? (sum == 0 ? f.cc[l] | FLAG_Z : f.cc[l] & ~FLAG_Z) : f.cc[l];
+		}
+		break;
+	}
+
+	case OP_LXX:
+	case OP_LYY:
+	{
+		uint16_t *r = op == OP_LXX ? f.x : f.y;
+
+		for (int l = 0; l < LANES; l++)
+			t[l] = laneByte(f, l, r[l]) + (laneByte(f, l, (uint16_t)(r[l] + 1)) << 8);
+		for (int l = 0; l < LANES; l++)
+			r[l] = f.mask[l] ? t[l] : r[l];
+		loadFlags16(f, r);
+		break;
+	}
+
+	case OP_STA:
+		scatter8(f, addr, f.a, 0);
+		break;
+
+	case OP_STX:
+	case OP_STY:
+		scatter8(f, addr, op == OP_STX ? f.x : f.y, 0);
+		scatter8(f, addr + 1, op == OP_STX ? f.x : f.y, 8);
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+// bookkeeping for the lanes which just ran
+static void finishScalar(LaneFile &f, bool batch)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		if (!f.active[l])
+			continue;
+
+		if (!f.mask[l])
+		{
+			if (f.waited[l] < 0xFFFF)
+				f.waited[l]++;
+			continue;
+		}
+
+		f.timerDone[l] = 0;
+		f.waited[l] = 0;
+		f.instructions[l]++;
+
+		// in batch mode a lane is done once it breaks or runs out of input
+		if (batch && ((f.cc[l] & FLAG_S) || f.stopping[l]))
+			f.active[l] = 0;
+	}
+}
+
+static const LaneKernels scalarKernels = { "portable", scheduleScalar, executeScalar, finishScalar };
+
+//
+class Lanes : public Cisc
+{
+	LaneFile f;
+	const LaneKernels *kernels;
+
+	std::vector<uint8_t> laneRam;	// interleaved RAM of all lanes, see LaneFile
+	int observed;					// lane visible through the Cisc registers, -1 for none
+	int restarts;
+
+	LaneInfo info[LANES];
+	bool batch;						// stop lanes on a break, see runBatch()
+	uint64_t maxSteps;
+	uint64_t steps;
+	uint8_t lastOpcode;
+
+	uint8_t laneRead(int lane, uint16_t addr) { return laneByte(f, lane, addr); }
+	void laneStore(int lane, uint16_t addr, uint8_t value);
+	void lanePush(int lane, uint8_t value);
+	uint8_t lanePop(int lane) { return laneRead(lane, f.sp[lane]++); }
+	uint16_t lanePopW(int lane);
+	void laneInterrupt(int lane, uint16_t vector);
+	uint8_t laneInput(int lane);
+	void laneOutput(int lane);
+
+	void checkTimers(uint16_t target, uint32_t timerLanes);
+	void execute(uint8_t op, uint16_t next, uint16_t addr, uint8_t operand);
+	void mirrorWrites();
+	void syncObserved();
+
+public:
+	Lanes(bool vector)
+	{
+		kernels = nullptr;
+		if (vector && cpuHasAvx2())
+			kernels = getAvx2LaneKernels();
+		if (!kernels)
+			kernels = &scalarKernels;
+
+		// the padding keeps 32-bit gathers from the last row in bounds
+		laneRam.resize(LANES * 0x10000 + 32);
+		f.ram = laneRam.data();
+
+		observed = 0;
+		restarts = 0;
+
+		batch = false;
+		maxSteps = 0;
+		steps = 0;
+		lastOpcode = 0;
+	}
+
+	void start();
+	bool step();
+	void setBatch(uint64_t limit) { batch = true; maxSteps = limit; observed = -1; }
+	void setLaneInput(int lane, const uint8_t *data, size_t size);
+	void stopLane(int lane) { f.active[lane] = 0; }
+	const LaneInfo &getLaneInfo(int lane) const { return info[lane]; }
+	uint64_t getLaneInstructions(int lane) const { return f.instructions[lane]; }
+	const char *getKernelName() const { return kernels->name; }
+
+	virtual uint8_t tick();
+};
+
+// copy the loaded image and registers into all lanes
+void Lanes::start()
+{
+	for (int addr = 0; addr < 0x10000; addr++)
+		memset(&laneByte(f, 0, addr), ram[addr], LANES);
+
+	for (int l = 0; l < LANES; l++)
+	{
+		f.a[l] = A;
+		f.cc[l] = CC;
+		f.pc[l] = PC;
+		f.sp[l] = SP;
+		f.x[l] = X;
+		f.y[l] = Y;
+
+		f.mask[l] = 0;
+		f.active[l] = 0xFFFF;
+		f.stopping[l] = 0;
+		f.timerDone[l] = 0;
+		f.waited[l] = 0;
+		f.instructions[l] = 0;
+
+		info[l].faulted = false;
+		info[l].overflowed = false;
+		info[l].exhausted = false;
+		info[l].output.clear();
+
+		// by default the other lanes read shorter suffixes of the input so the lanes diverge
+		size_t skip = observed < 0 ? 0 : (l - observed + LANES) % LANES;
+		if (skip > inputSize)
+			skip = inputSize;
+
+		setLaneInput(l, inputData ? inputData + skip : nullptr, inputSize - skip);
+	}
+
+	f.brk = __brk;
+	f.writeCount = 0;
+	steps = 0;
+}
+
+//
+void Lanes::setLaneInput(int lane, const uint8_t *data, size_t size)
+{
+	info[lane].input = data;
+	info[lane].inputSize = size;
+	info[lane].inputPos = 0;
+}
+
+// observed lane stores also go through Cisc::store()
+void Lanes::laneStore(int lane, uint16_t addr, uint8_t value)
+{
+	laneByte(f, lane, addr) = value;
+
+	if (lane == observed)
+		store(addr, value);
+}
+
+// same as Cisc::push()
+void Lanes::lanePush(int lane, uint8_t value)
+{
+	f.sp[lane]--;
+
+	if (__brk && f.sp[lane] + 1 == __brk)
+	{
+		f.cc[lane] |= FLAG_S;
+		info[lane].overflowed = true;
+	}
+
+	laneStore(lane, f.sp[lane], value);
+}
+
+// pop a little endian word
+uint16_t Lanes::lanePopW(int lane)
+{
+	uint16_t word = lanePop(lane);
+	word |= lanePop(lane) << 8;
+
+	return word;
+}
+
+// same as Cisc::interrupt()
+void Lanes::laneInterrupt(int lane, uint16_t vector)
+{
+	if (vector == INT_VECTOR && (f.cc[lane] & FLAG_I))
+		return;
+
+	lanePush(lane, HIBYTE(f.pc[lane]));
+	lanePush(lane, LOBYTE(f.pc[lane]));
+	lanePush(lane, HIBYTE(f.x[lane]));
+	lanePush(lane, LOBYTE(f.x[lane]));
+	lanePush(lane, HIBYTE(f.y[lane]));
+	lanePush(lane, LOBYTE(f.y[lane]));
+	lanePush(lane, (uint8_t)f.a[lane]);
+	lanePush(lane, (uint8_t)f.cc[lane]);
+
+	uint16_t addr = f.sp[lane];
+	lanePush(lane, HIBYTE(addr));
+	lanePush(lane, LOBYTE(addr));
+
+	f.cc[lane] |= FLAG_I;
+	f.pc[lane] = laneRead(lane, vector) + (laneRead(lane, vector + 1) << 8);
+}
+
+// read port 1, the observed lane reads the Cisc input
+uint8_t Lanes::laneInput(int lane)
+{
+	bool isObserved = lane == observed;
+	if (isObserved && !hasInput)
+		return getchar();
+
+	auto &li = info[lane];
+	const uint8_t *data = isObserved ? inputData : li.input;
+	size_t size = isObserved ? inputSize : li.inputSize;
+	size_t &pos = isObserved ? inputPos : li.inputPos;
+
+	if (pos < size)
+		return data[pos++];
+
+	li.exhausted = true;
+	if (isObserved)
+		inputExhausted = true;
+
+	// in batch mode a lane is done once it runs out of input
+	if (batch)
+		f.stopping[lane] = 0xFFFF;
+
+	return 0xFF;
+}
+
+// write port 1, the observed lane writes the Cisc output
+void Lanes::laneOutput(int lane)
+{
+	uint8_t value = (uint8_t)f.a[lane];
+
+	if (lane != observed)
+		info[lane].output.push_back(value);
+	else if (pOutput)
+		pOutput->push_back(value);
+	else
+		putchar(value);
+}
+
+// count the timer of the lanes about to run, a lane that takes the timer
+// interrupt continues in the handler instead
+void Lanes::checkTimers(uint16_t target, uint32_t timerLanes)
+{
+	for (int l = 0; l < LANES; l++)
+	{
+		if (!(timerLanes & (1u << l)))
+			continue;
+
+		f.timerDone[l] = 0xFFFF;
+
+		uint8_t timer = laneRead(l, MMIO_TIMER_REG) + 1;
+		laneStore(l, MMIO_TIMER_REG, timer);
+
+		if (laneRead(l, MMIO_TIMER_LIM) == timer)
+		{
+			laneInterrupt(l, INT_VECTOR);
+
+			if (f.pc[l] != target)
+				f.mask[l] = 0;
+		}
+	}
+}
+
+// execute one instruction for the masked lanes, what the kernels don't do
+// runs lane by lane
+void Lanes::execute(uint8_t op, uint16_t next, uint16_t addr, uint8_t operand)
+{
+	if (kernels->execute(f, op, next, addr, operand))
+		return;
+
+	for (int l = 0; l < LANES; l++)
+	{
+		if (!f.mask[l])
+			continue;
+
+		switch (op)
+		{
+		case OP_CALL:
+			lanePush(l, HIBYTE(f.pc[l]));
+			lanePush(l, LOBYTE(f.pc[l]));
+			f.pc[l] = addr;
+			break;
+
+		case OP_RET:
+			f.pc[l] = lanePopW(l);
+			break;
+
+		case OP_RTI:
+			f.sp[l] = lanePopW(l);
+			f.cc[l] = lanePop(l);
+			f.a[l] = lanePop(l);
+			f.y[l] = lanePopW(l);
+			f.x[l] = lanePopW(l);
+			f.pc[l] = lanePopW(l);
+			break;
+
+		case OP_STAX:
+		case OP_STAY:
+			laneStore(l, op == OP_STAX ? f.x[l] : f.y[l], (uint8_t)f.a[l]);
+			break;
+
+		case OP_STYX:
+			laneStore(l, f.x[l], LOBYTE(f.y[l]));
+			laneStore(l, f.x[l] + 1, HIBYTE(f.y[l]));
+			break;
+
+		case OP_STXY:
+			laneStore(l, f.y[l], LOBYTE(f.x[l]));
+			laneStore(l, f.y[l] + 1, HIBYTE(f.x[l]));
+			break;
+
+		case OP_PUSH:
+			if (operand & REG_PC)
+			{
+				lanePush(l, HIBYTE(f.pc[l]));
+				lanePush(l, LOBYTE(f.pc[l]));
+			}
+
+			if (operand & REG_SP)
+			{
+				uint16_t s = f.sp[l];
+				lanePush(l, HIBYTE(s));
+				lanePush(l, LOBYTE(s));
+			}
+
+			if (operand & REG_X)
+			{
+				lanePush(l, HIBYTE(f.x[l]));
+				lanePush(l, LOBYTE(f.x[l]));
+			}
+
+			if (operand & REG_Y)
+			{
+				lanePush(l, HIBYTE(f.y[l]));
+				lanePush(l, LOBYTE(f.y[l]));
+			}
+
+			if (operand & REG_A)
+				lanePush(l, (uint8_t)f.a[l]);
+
+			if (operand & REG_CC)
+				lanePush(l, (uint8_t)f.cc[l]);
+			break;
+
+		case OP_POP:
+			if (operand & REG_CC)
+				f.cc[l] = lanePop(l);
+
+			if (operand & REG_A)
+				f.a[l] = lanePop(l);
+
+			if (operand & REG_Y)
+				f.y[l] = lanePopW(l);
+
+			if (operand & REG_X)
+				f.x[l] = lanePopW(l);
+
+			if (operand & REG_SP)
+				f.sp[l] = lanePopW(l);
+
+			if (operand & REG_PC)
+				f.pc[l] = lanePopW(l);
+			break;
+
+		case OP_OUT:
+			if (operand == 1)
+				laneOutput(l);
+			break;
+
+		case OP_IN:
+			if (operand == 1)
+				f.a[l] = laneInput(l);
+			break;
+
+		case OP_SWI:
+		case OP_BRK:
+			laneInterrupt(l, op == OP_SWI ? SWI_VECTOR : BRK_VECTOR);
+			break;
+
+		default:
+			info[l].faulted = true;
+			f.active[l] = 0;
+			break;
+		}
+	}
+}
+
+// the kernels store to the lane RAM only, copy the stores of the observed
+// lane to the Cisc RAM
+void Lanes::mirrorWrites()
+{
+	if (observed >= 0 && f.mask[observed])
+	{
+		for (int i = 0; i < f.writeCount; i++)
+			store(f.writes[i], laneRead(observed, f.writes[i]));
+	}
+
+	f.writeCount = 0;
+}
+
+// make the observed lane visible through the Cisc registers
+void Lanes::syncObserved()
+{
+	A = (uint8_t)f.a[observed];
+	CC = (uint8_t)f.cc[observed];
+	PC = f.pc[observed];
+	SP = f.sp[observed];
+	X = f.x[observed];
+	Y = f.y[observed];
+
+	faulted = info[observed].faulted;
+	stackOverflowed = info[observed].overflowed;
+}
+
+// execute one instruction for the lanes at the scheduled PC, false once all lanes have stopped
+bool Lanes::step()
+{
+	uint16_t target;
+	uint32_t timerLanes;
+
+	if (!kernels->schedule(f, target, timerLanes))
+		return false;
+
+	if (timerLanes)
+		checkTimers(target, timerLanes);
+
+	// operands are the same for every lane at this PC
+	uint8_t op = rom[target];
+	uint16_t next = target + 1;
+	uint16_t addr = 0;
+	uint8_t operand = 0;
+
+	if (op < OP_COUNT)
+	{
+		if (opcodeInfo[op].operandSize == 2)
+			addr = rom[next] | (rom[(uint16_t)(next + 1)] << 8);
+		else if (opcodeInfo[op].operandSize == 1)
+			operand = rom[next];
+
+		next += opcodeInfo[op].operandSize;
+	}
+
+	if (observed >= 0 && f.mask[observed])
+		lastOpcode = op;
+
+	// a short branch executes as the absolute branch to the target of its
+	// displacement
+	if (isShortBranch(op))
+	{
+		addr = (uint16_t)(next + (int8_t)operand);
+		op = longBranchOf(op);
+	}
+
+	execute(op, next, addr, operand);
+	mirrorWrites();
+	kernels->finish(f, batch);
+
+	// no lane can have retired more instructions than there were steps
+	if (batch && ++steps >= maxSteps)
+	{
+		for (int l = 0; l < LANES; l++)
+		{
+			if (f.instructions[l] >= maxSteps)
+				f.active[l] = 0;
+		}
+	}
+
+	if (observed >= 0)
+		syncObserved();
+
+	return true;
+}
+
+// run the lanes until the observed lane has executed one instruction
+uint8_t Lanes::tick()
+{
+	// first tick after a load or reset
+	if (0 == instructionCount)
+	{
+		observed = restarts++ % LANES;
+		start();
+	}
+
+	instructionCount++;
+
+	uint64_t retired = f.instructions[observed];
+
+	while (f.active[observed] && f.instructions[observed] == retired)
+		step();
+
+	return lastOpcode;
+}
+
+// create the multi-lane engine for the lockstep harness, with the AVX2
+// kernels if the CPU has them or with the portable kernels
+Cisc *createLaneEngine(bool vector)
+{
+	return new Lanes(vector);
+}
+
+// the result of one input of a batch run
+struct BatchResult
+{
+	bool read;
+	uint64_t instructions;
+	const char *status;
+	bool failed;
+	std::vector<uint8_t> output;
+};
+
+// run inputs first .. first + LANES - 1 of a batch on the multi-lane engine
+static void runLaneGroup(Lanes &lanes, const char *filename, char *inputFiles[], int first, int count, uint64_t maxSteps, std::vector<BatchResult> &results)
+{
+	std::vector<std::vector<uint8_t>> inputs(LANES);
+
+	lanes.reset();
+	lanes.load(filename);
+	lanes.start();
+
+	for (int l = 0; l < LANES; l++)
+	{
+		if (first + l >= count || !readBinaryFile(inputFiles[first + l], inputs[l]))
+		{
+			lanes.stopLane(l);
+			continue;
+		}
+
+		results[first + l].read = true;
+		lanes.setLaneInput(l, inputs[l].data(), inputs[l].size());
+	}
+
+	while (lanes.step())
+		;
+
+	for (int l = 0; l < LANES && first + l < count; l++)
+	{
+		auto &li = lanes.getLaneInfo(l);
+		auto &r = results[first + l];
+
+		if (!r.read)
+			continue;
+
+		r.instructions = lanes.getLaneInstructions(l);
+		r.status = li.faulted ? "fault" : li.overflowed ? "stack overflow" :
+			li.exhausted ? "end of input" : r.instructions >= maxSteps ? "step limit" : "break";
+		r.failed = li.faulted || li.overflowed;
+		r.output = li.output;
+	}
+}
+
+// run one input of a batch on the reference interpreter, stopping it the
+// same way as a lane
+static void runScalarInput(Cisc &cpu, const char *filename, const char *inputFile, uint64_t maxSteps, BatchResult &r)
+{
+	std::vector<uint8_t> input;
+	if (!readBinaryFile(inputFile, input))
+		return;
+
+	r.read = true;
+
+	cpu.reset();
+	cpu.load(filename);
+	cpu.setInput(input.data(), input.size());
+	cpu.captureOutput(&r.output);
+
+	r.instructions = 0;
+	for (;;)
+	{
+		cpu.tick();
+		if (cpu.isFaulted())
+			break;
+
+		r.instructions++;
+		if ((cpu.getCC() & FLAG_S) || cpu.isInputExhausted() || r.instructions >= maxSteps)
+			break;
+	}
+
+	r.status = cpu.isFaulted() ? "fault" : cpu.hasStackOverflowed() ? "stack overflow" :
+		cpu.isInputExhausted() ? "end of input" : r.instructions >= maxSteps ? "step limit" : "break";
+	r.failed = cpu.isFaulted() || cpu.hasStackOverflowed();
+}
+
+// Run an image once per input file on a pool of threads. The lane engines
+// take LANES inputs at a time, the reference engine one, so the two can be
+// compared on the same inputs. Without AVX2 the portable kernels lose to the
+// reference engine on branchy code, so that is the default there.
+int runBatch(const char *filename, char *inputFiles[], int count, uint64_t maxSteps, std::string engine, unsigned threads)
+{
+	if (engine.empty())
+		engine = (cpuHasAvx2() && getAvx2LaneKernels()) ? "lanes" : "ref";
+
+	bool useLanes = engine == "lanes" || engine == "lanes-scalar";
+	if (!useLanes && engine != "ref")
+	{
+		fprintf(stderr, "Unknown batch engine '%s'!\n", engine.c_str());
+		return -1;
+	}
+
+	if (0 == maxSteps)
+		maxSteps = DEFAULT_LANE_STEPS;
+
+	int perItem = useLanes ? LANES : 1;
+	int items = (count + perItem - 1) / perItem;
+
+	if (0 == threads)
+		threads = std::thread::hardware_concurrency();
+	if (threads > (unsigned)items)
+		threads = items;
+	if (0 == threads)
+		threads = 1;
+
+	std::vector<BatchResult> results(count);
+	for (auto it = results.begin(); it != results.end(); it++)
+	{
+		it->read = false;
+		it->instructions = 0;
+		it->status = "";
+		it->failed = false;
+	}
+
+	std::string kernelName;
+	std::atomic<int> nextItem(0);
+
+	auto startTime = std::chrono::steady_clock::now();
+
+	auto worker = [&](bool first) {
+		Lanes *lanes = nullptr;
+		Cisc *cpu = nullptr;
+
+		if (useLanes)
+		{
+			lanes = new Lanes(engine == "lanes");
+			lanes->setQuiet(true);
+			lanes->setTrapPanics(true);
+			lanes->setBatch(maxSteps);
+
+			if (first)
+				kernelName = lanes->getKernelName();
+		}
+		else
+		{
+			cpu = new Cisc();
+			cpu->setQuiet(true);
+			cpu->setTrapPanics(true);
+		}
+
+		for (int item = nextItem++; item < items; item = nextItem++)
+		{
+			if (lanes)
+				runLaneGroup(*lanes, filename, inputFiles, item * LANES, count, maxSteps, results);
+			else
+				runScalarInput(*cpu, filename, inputFiles[item], maxSteps, results[item]);
+		}
+
+		delete lanes;
+		delete cpu;
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; t++)
+		pool.push_back(std::thread(worker, false));
+
+	worker(true);
+
+	for (auto it = pool.begin(); it != pool.end(); it++)
+		it->join();
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	uint64_t total = 0;
+	int failed = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		auto &r = results[i];
+
+		if (!r.read)
+		{
+			fprintf(stderr, "Unable to read input file '%s'!\n", inputFiles[i]);
+			failed++;
+			continue;
+		}
+
+		printf("%s: %llu instructions, %s\n", inputFiles[i], (unsigned long long)r.instructions, r.status);
+
+		std::string outName = std::string(inputFiles[i]) + ".out";
+		FILE *f = fopen(outName.c_str(), "wb");
+		if (f)
+		{
+			fwrite(r.output.data(), 1, r.output.size(), f);
+			fclose(f);
+		}
+
+		if (r.failed)
+			failed++;
+
+		total += r.instructions;
+	}
+
+	if (useLanes)
+		printf("\n%s engine, %s kernels, %u threads\n", engine.c_str(), kernelName.c_str(), threads);
+	else
+		printf("\n%s engine, %u threads\n", engine.c_str(), threads);
+
+	printf("%d inputs, %llu instructions in %.2fs (%.0f/s)\n", count, (unsigned long long)total, secs, secs > 0 ? total / secs : 0.0);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef __LANES_H
+#define __LANES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Multi-lane engine kernels
+//
+// The register file of the lanes and the kernels that work on it. This
+// header is shared with lanes_avx2.cpp, which is built with AVX2 code
+// generation, so it must only hold plain data and declarations. Anything
+// inline from the standard library compiled into that file could be picked
+// by the linker for the rest of the program and run on a CPU without AVX2.
+//
+
+static const int LANES				= 16;
+static const int LANE_MAX_STARVE	= 256;	// steps a lane may wait before it is scheduled
+static const int LANE_MAX_WRITES	= 16;	// most rows a single instruction stores to
+
+// Registers and scheduling state of the lanes, one element per lane. The
+// 8-bit registers are kept in 16-bit elements like the rest so that every
+// register fills one 256-bit vector. Lane masks are 0xFFFF for a lane that
+// is set and 0 otherwise.
+struct LaneFile
+{
+	uint16_t a[LANES];
+	uint16_t cc[LANES];
+	uint16_t pc[LANES];
+	uint16_t sp[LANES];
+	uint16_t x[LANES];
+	uint16_t y[LANES];
+
+	uint16_t mask[LANES];		// lanes executing the current instruction
+	uint16_t active[LANES];		// lanes still being scheduled
+	uint16_t stopping[LANES];	// lanes to stop once the instruction is done
+	uint16_t timerDone[LANES];	// timer already checked for the next instruction
+	uint16_t waited[LANES];		// steps since the lane last ran
+	uint64_t instructions[LANES];	// instructions retired by each lane
+
+	// RAM of all of the lanes, interleaved so that byte addr of lane l is
+	// at ram[addr * LANES + l] and an address is one 16 byte row
+	uint8_t *ram;
+
+	uint16_t brk;		// __brk, pushes across it are left to the scalar code
+	int leader;			// a lane at the scheduled PC
+
+	// rows stored to by the last instruction, to mirror the observed lane
+	uint16_t writes[LANE_MAX_WRITES];
+	int writeCount;
+};
+
+// Kernels that run one step of the lanes. schedule() picks the PC to run,
+// sets the mask and returns the lanes whose timer must be checked first, or
+// returns false when no lane is active. execute() always moves the PC of the
+// masked lanes to next, then executes the instruction if it can and returns
+// false for instructions that are left to the scalar code in lanes.cpp.
+// finish() does the bookkeeping once the instruction has run.
+struct LaneKernels
+{
+	const char *name;
+	bool (*schedule)(LaneFile &f, uint16_t &target, uint32_t &timerLanes);
+	bool (*execute)(LaneFile &f, uint8_t op, uint16_t next, uint16_t addr, uint8_t operand);
+	void (*finish)(LaneFile &f, bool batch);
+};
+
+// lanes_avx2.cpp, null when it was built without AVX2
+const LaneKernels *getAvx2LaneKernels();
+
+#endif // __LANES_H
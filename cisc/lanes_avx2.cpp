@@ -0,0 +1,629 @@
+//
+// AVX2 kernels of the multi-lane engine
+//
+// Every register of the lanes is one 256-bit vector of 16-bit elements, so
+// an ALU instruction is a handful of vector operations for all lanes at once
+// and the flags are computed with shifts rather than branches. Loads through
+// X or Y gather the byte of each lane from the interleaved RAM, or load the
+// whole row when every lane uses the same address. Stores, calls and pushes
+// are only done here when all the lanes store to the same rows, the rest is
+// left to the scalar code in lanes.cpp.
+//
+// This file is built with AVX2 code generation and is only called once
+// cpuHasAvx2() has said so, see the note in lanes.h about what it may use.
+//
+
+#include "lanes.h"
+
+#if defined(__AVX2__)
+
+#include "cpu_cisc.h"
+#include <immintrin.h>
+
+// lane numbers as 32-bit elements for the gather indices
+static const int32_t laneIndex[LANES] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+//
+static inline __m256i load(const uint16_t *reg)
+{
+	return _mm256_loadu_si256((const __m256i *)reg);
+}
+
+//
+static inline void save(uint16_t *reg, __m256i value)
+{
+	_mm256_storeu_si256((__m256i *)reg, value);
+}
+
+// value where the mask is set, old otherwise
+static inline __m256i select(__m256i old, __m256i value, __m256i mask)
+{
+	return _mm256_blendv_epi8(old, value, mask);
+}
+
+// one bit per lane of a 0xFFFF / 0 vector
+static inline uint32_t laneBits(__m256i mask)
+{
+	__m128i bytes = _mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+
+	return (uint32_t)_mm_movemask_epi8(bytes);
+}
+
+// 0xFFFF for lanes where value is 0
+static inline __m256i isZero(__m256i value)
+{
+	return _mm256_cmpeq_epi16(value, _mm256_setzero_si256());
+}
+
+// the bytes of a row widened to 16 bits
+static inline __m256i loadRow(const LaneFile &f, uint16_t addr)
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)&f.ram[addr * LANES]));
+}
+
+// store the low bytes of value to a row for the masked lanes
+static inline void storeRow(LaneFile &f, uint16_t addr, __m256i value, __m256i mask)
+{
+	__m128i *row = (__m128i *)&f.ram[addr * LANES];
+
+	__m256i low = _mm256_and_si256(value, _mm256_set1_epi16(0xFF));
+	__m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(low), _mm256_extracti128_si256(low, 1));
+	__m128i byteMask = _mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+
+	_mm_storeu_si128(row, _mm_blendv_epi8(_mm_loadu_si128(row), bytes, byteMask));
+
+	f.writes[f.writeCount++] = addr;
+}
+
+// true when all of the masked lanes have the value of the leader in reg
+static inline bool uniform(const LaneFile &f, const uint16_t *reg, __m256i mask)
+{
+	__m256i same = _mm256_cmpeq_epi16(load(reg), _mm256_set1_epi16((short)reg[f.leader]));
+
+	return (laneBits(_mm256_andnot_si256(same, mask))) == 0;
+}
+
+// gather 8 bytes at the addresses in 8 32-bit elements
+static inline __m256i gatherHalf(const LaneFile &f, __m128i addr, int half)
+{
+	__m256i index = _mm256_slli_epi32(_mm256_cvtepu16_epi32(addr), 4);
+	index = _mm256_add_epi32(index, _mm256_loadu_si256((const __m256i *)&laneIndex[half * 8]));
+
+	__m256i value = _mm256_i32gather_epi32((const int *)f.ram, index, 1);
+
+	return _mm256_and_si256(value, _mm256_set1_epi32(0xFF));
+}
+
+// load the byte of each lane at the address in reg
+static inline __m256i gather8(const LaneFile &f, __m256i addr)
+{
+	__m256i lo = gatherHalf(f, _mm256_castsi256_si128(addr), 0);
+	__m256i hi = gatherHalf(f, _mm256_extracti128_si256(addr, 1), 1);
+
+	// packus works on 128-bit halves, put the lanes back in order
+	return _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+}
+
+// load the byte of each lane at the address in reg, one row if it's the same for all lanes
+static inline __m256i gatherReg8(const LaneFile &f, const uint16_t *reg, __m256i mask)
+{
+	if (uniform(f, reg, mask))
+		return loadRow(f, reg[f.leader]);
+
+	return gather8(f, load(reg));
+}
+
+// load the word of each lane at the address in reg
+static inline __m256i gatherReg16(const LaneFile &f, const uint16_t *reg, __m256i mask)
+{
+	if (uniform(f, reg, mask))
+	{
+		uint16_t addr = reg[f.leader];
+		return _mm256_or_si256(loadRow(f, addr), _mm256_slli_epi16(loadRow(f, (uint16_t)(addr + 1)), 8));
+	}
+
+	__m256i addr = load(reg);
+	__m256i lo = gather8(f, addr);
+	__m256i hi = gather8(f, _mm256_add_epi16(addr, _mm256_set1_epi16(1)));
+
+	return _mm256_or_si256(lo, _mm256_slli_epi16(hi, 8));
+}
+
+// cc with C, Z, N and V of an 8-bit arithmetic result
+static inline __m256i flags8(__m256i cc, __m256i t)
+{
+	__m256i c = _mm256_min_epu16(_mm256_srli_epi16(t, 8), _mm256_set1_epi16(FLAG_C));
+	__m256i z = _mm256_and_si256(isZero(t), _mm256_set1_epi16(FLAG_Z));
+	__m256i n = _mm256_and_si256(_mm256_srli_epi16(t, 4), _mm256_set1_epi16(FLAG_N));
+
+	// V is bit 8 ^ bit 7
+	__m256i v = _mm256_xor_si256(_mm256_srli_epi16(t, 6), _mm256_srli_epi16(t, 5));
+	v = _mm256_and_si256(v, _mm256_set1_epi16(FLAG_V));
+
+	cc = _mm256_andnot_si256(_mm256_set1_epi16(FLAG_C | FLAG_Z | FLAG_N | FLAG_V), cc);
+
+	return _mm256_or_si256(cc, _mm256_or_si256(_mm256_or_si256(c, z), _mm256_or_si256(n, v)));
+}
+
+// cc with C, Z, N and V of r - value
+static inline __m256i flags16(__m256i cc, __m256i r, __m256i value)
+{
+	__m256i d = _mm256_sub_epi16(r, value);
+
+	__m256i c = _mm256_andnot_si256(isZero(_mm256_subs_epu16(value, r)), _mm256_set1_epi16(FLAG_C));
+	__m256i z = _mm256_and_si256(isZero(d), _mm256_set1_epi16(FLAG_Z));
+	__m256i n = _mm256_and_si256(_mm256_srli_epi16(d, 12), _mm256_set1_epi16(FLAG_N));
+
+	// V is the borrow ^ bit 15
+	__m256i v = _mm256_xor_si256(_mm256_slli_epi16(c, 2), _mm256_srli_epi16(d, 13));
+	v = _mm256_and_si256(v, _mm256_set1_epi16(FLAG_V));
+
+	cc = _mm256_andnot_si256(_mm256_set1_epi16(FLAG_C | FLAG_Z | FLAG_N | FLAG_V), cc);
+
+	return _mm256_or_si256(cc, _mm256_or_si256(_mm256_or_si256(c, z), _mm256_or_si256(n, v)));
+}
+
+// cc with Z and N of an 8-bit value, V cleared
+static inline __m256i logicFlags(__m256i cc, __m256i a)
+{
+	__m256i z = _mm256_and_si256(isZero(a), _mm256_set1_epi16(FLAG_Z));
+	__m256i n = _mm256_and_si256(_mm256_srli_epi16(a, 4), _mm256_set1_epi16(FLAG_N));
+
+	cc = _mm256_andnot_si256(_mm256_set1_epi16(FLAG_Z | FLAG_N | FLAG_V), cc);
+
+	return _mm256_or_si256(cc, _mm256_or_si256(z, n));
+}
+
+// cc with Z and N of a 16-bit value, V cleared
+static inline __m256i loadFlags16(__m256i cc, __m256i r)
+{
+	__m256i z = _mm256_and_si256(isZero(r), _mm256_set1_epi16(FLAG_Z));
+	__m256i n = _mm256_and_si256(_mm256_srli_epi16(r, 12), _mm256_set1_epi16(FLAG_N));
+
+	cc = _mm256_andnot_si256(_mm256_set1_epi16(FLAG_Z | FLAG_N | FLAG_V), cc);
+
+	return _mm256_or_si256(cc, _mm256_or_si256(z, n));
+}
+
+// true when pushing count bytes at a uniform SP can't cross __brk, the
+// scalar code flags the overflow
+static inline bool canPush(const LaneFile &f, int count)
+{
+	uint16_t sp = f.sp[f.leader];
+
+	return 0 == f.brk || (uint16_t)(sp - f.brk) >= count;
+}
+
+// push a byte of every masked lane, SP is uniform
+static inline void push8(LaneFile &f, uint16_t &sp, __m256i value, __m256i mask)
+{
+	storeRow(f, --sp, value, mask);
+}
+
+// push a word of every masked lane, SP is uniform
+static inline void push16(LaneFile &f, uint16_t &sp, __m256i value, __m256i mask)
+{
+	push8(f, sp, _mm256_srli_epi16(value, 8), mask);
+	push8(f, sp, value, mask);
+}
+
+// pop a word of every lane, SP is uniform
+static inline __m256i pop16(const LaneFile &f, uint16_t &sp)
+{
+	__m256i lo = loadRow(f, sp++);
+	__m256i hi = loadRow(f, sp++);
+
+	return _mm256_or_si256(lo, _mm256_slli_epi16(hi, 8));
+}
+
+// bytes pushed by PUSH operand
+static inline int pushSize(uint8_t operand)
+{
+	return ((operand & REG_PC) ? 2 : 0) + ((operand & REG_SP) ? 2 : 0) + ((operand & REG_X) ? 2 : 0) +
+		((operand & REG_Y) ? 2 : 0) + ((operand & REG_A) ? 1 : 0) + ((operand & REG_CC) ? 1 : 0);
+}
+
+// run the lowest PC, unless a lane has waited too long
+static bool scheduleAvx2(LaneFile &f, uint16_t &target, uint32_t &timerLanes)
+{
+	__m256i active = load(f.active);
+	if (0 == laneBits(active))
+		return false;
+
+	// inactive lanes sort last
+	__m256i pc = load(f.pc);
+	__m256i key = select(_mm256_set1_epi16(-1), pc, active);
+	__m128i low = _mm_min_epu16(_mm256_castsi256_si128(key), _mm256_extracti128_si256(key, 1));
+	target = (uint16_t)_mm_extract_epi16(_mm_minpos_epu16(low), 0);
+
+	// the longest wait is the smallest complement
+	__m256i waited = _mm256_and_si256(load(f.waited), active);
+	__m256i inverse = _mm256_xor_si256(waited, _mm256_set1_epi16(-1));
+	low = _mm_min_epu16(_mm256_castsi256_si128(inverse), _mm256_extracti128_si256(inverse, 1));
+	uint16_t longest = (uint16_t)~_mm_extract_epi16(_mm_minpos_epu16(low), 0);
+
+	if (longest > LANE_MAX_STARVE)
+	{
+		uint32_t starved = laneBits(_mm256_cmpeq_epi16(waited, _mm256_set1_epi16((short)longest)));
+		int lane = 0;
+
+		while (!(starved & (1u << lane)))
+			lane++;
+
+		target = f.pc[lane];
+	}
+
+	__m256i mask = _mm256_and_si256(_mm256_cmpeq_epi16(pc, _mm256_set1_epi16((short)target)), active);
+	save(f.mask, mask);
+
+	uint32_t bits = laneBits(mask);
+	int leader = 0;
+
+	while (!(bits & (1u << leader)))
+		leader++;
+	f.leader = leader;
+
+	// the timer is checked once before each instruction as in Cisc::tick()
+	__m256i enabled = _mm256_andnot_si256(isZero(loadRow(f, MMIO_TIMER_ENA)), mask);
+	timerLanes = laneBits(_mm256_andnot_si256(load(f.timerDone), enabled));
+
+	return true;
+}
+
+// execute one instruction for the masked lanes
+static bool executeAvx2(LaneFile &f, uint8_t op, uint16_t next, uint16_t addr, uint8_t operand)
+{
+	__m256i mask = load(f.mask);
+	save(f.pc, select(load(f.pc), _mm256_set1_epi16((short)next), mask));
+
+	__m256i a = load(f.a);
+	__m256i cc = load(f.cc);
+	__m256i one = _mm256_set1_epi16(1);
+	__m256i t, cond;
+
+	switch (op)
+	{
+	case OP_NOP:
+		return true;
+
+	case OP_SHL:
+		t = _mm256_sll_epi16(a, _mm_cvtsi32_si128(operand));
+		save(f.cc, select(cc, flags8(cc, t), mask));
+		save(f.a, select(a, _mm256_and_si256(t, _mm256_set1_epi16(0xFF)), mask));
+		return true;
+
+	case OP_SHR:
+	{
+		t = _mm256_or_si256(_mm256_srl_epi16(a, _mm_cvtsi32_si128(operand)), _mm256_and_si256(a, _mm256_set1_epi16(0x80)));
+
+		__m256i c = _mm256_and_si256(a, _mm256_set1_epi16(FLAG_C));
+		__m256i z = _mm256_and_si256(isZero(t), _mm256_set1_epi16(FLAG_Z));
+		__m256i n = _mm256_and_si256(_mm256_srli_epi16(t, 4), _mm256_set1_epi16(FLAG_N));
+		__m256i r = _mm256_andnot_si256(_mm256_set1_epi16(FLAG_C | FLAG_Z | FLAG_N), cc);
+
+		r = _mm256_or_si256(r, _mm256_or_si256(c, _mm256_or_si256(z, n)));
+
+		save(f.cc, select(cc, r, mask));
+		save(f.a, select(a, t, mask));
+		return true;
+	}
+
+	case OP_ADD:
+	case OP_ADC:
+	case OP_ADDI:
+	case OP_ADCI:
+	case OP_SUB:
+	case OP_SBB:
+	case OP_CMP:
+	case OP_SUBI:
+	case OP_SBBI:
+	case OP_CMPI:
+	{
+		bool immediate = op == OP_ADDI || op == OP_ADCI || op == OP_SUBI || op == OP_SBBI || op == OP_CMPI;
+		__m256i value = immediate ? _mm256_set1_epi16(operand) : loadRow(f, addr);
+
+		if (op == OP_ADC || op == OP_ADCI || op == OP_SBB || op == OP_SBBI)
+			value = _mm256_add_epi16(value, _mm256_and_si256(cc, one));
+
+		if (op == OP_ADD || op == OP_ADC || op == OP_ADDI || op == OP_ADCI)
+			t = _mm256_add_epi16(a, value);
+		else
+			t = _mm256_sub_epi16(a, value);
+
+		save(f.cc, select(cc, flags8(cc, t), mask));
+
+		if (op != OP_CMP && op != OP_CMPI)
+			save(f.a, select(a, _mm256_and_si256(t, _mm256_set1_epi16(0xFF)), mask));
+		return true;
+	}
+
+	case OP_AAX:
+		save(f.x, select(load(f.x), _mm256_add_epi16(load(f.x), a), mask));
+		return true;
+
+	case OP_AAY:
+		save(f.y, select(load(f.y), _mm256_add_epi16(load(f.y), a), mask));
+		return true;
+
+	case OP_CMPX:
+	case OP_CMPY:
+	case OP_CMPXI:
+	case OP_CMPYI:
+	{
+		__m256i r = load(op == OP_CMPX || op == OP_CMPXI ? f.x : f.y);
+		__m256i value;
+
+		if (op == OP_CMPX || op == OP_CMPY)
+			value = _mm256_or_si256(loadRow(f, addr), _mm256_slli_epi16(loadRow(f, (uint16_t)(addr + 1)), 8));
+		else
+			value = _mm256_set1_epi16((short)addr);
+
+		save(f.cc, select(cc, flags16(cc, r, value), mask));
+		return true;
+	}
+
+	case OP_AND:
+	case OP_OR:
+	case OP_XOR:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_NOT:
+	case OP_LDA:
+	case OP_LDAI:
+	case OP_LAX:
+	case OP_LAY:
+	{
+		__m256i value = (op == OP_ANDI || op == OP_ORI || op == OP_XORI || op == OP_LDAI) ? _mm256_set1_epi16(operand) :
+			op == OP_NOT ? _mm256_set1_epi16(0xFF) :
+			op == OP_LAX ? gatherReg8(f, f.x, mask) :
+			op == OP_LAY ? gatherReg8(f, f.y, mask) : loadRow(f, addr);
+
+		if (op == OP_AND || op == OP_ANDI)
+			t = _mm256_and_si256(a, value);
+		else if (op == OP_OR || op == OP_ORI)
+			t = _mm256_or_si256(a, value);
+		else if (op == OP_XOR || op == OP_XORI || op == OP_NOT)
+			t = _mm256_xor_si256(a, value);
+		else
+			t = value;
+
+		if (op == OP_NOT)
+			cc = _mm256_or_si256(cc, _mm256_and_si256(mask, _mm256_set1_epi16(FLAG_C)));
+
+		save(f.cc, select(cc, logicFlags(cc, t), mask));
+		save(f.a, select(a, t, mask));
+		return true;
+	}
+
+	case OP_LDX:
+	case OP_LDY:
+	case OP_LDXI:
+	case OP_LDYI:
+	case OP_LXX:
+	case OP_LYY:
+	{
+		uint16_t *reg = (op == OP_LDX || op == OP_LDXI || op == OP_LXX) ? f.x : f.y;
+		__m256i value = (op == OP_LDXI || op == OP_LDYI) ? _mm256_set1_epi16((short)addr) :
+			(op == OP_LXX || op == OP_LYY) ? gatherReg16(f, reg, mask) :
+			_mm256_or_si256(loadRow(f, addr), _mm256_slli_epi16(loadRow(f, (uint16_t)(addr + 1)), 8));
+
+		save(reg, select(load(reg), value, mask));
+		save(f.cc, select(cc, loadFlags16(cc, value), mask));
+		return true;
+	}
+
+	case OP_LEAX:
+	case OP_LEAY:
+	{
+		uint16_t *reg = op == OP_LEAX ? f.x : f.y;
+		__m256i sum = _mm256_add_epi16(load(reg), _mm256_set1_epi16((int8_t)operand));
+		__m256i z = _mm256_and_si256(isZero(sum), _mm256_set1_epi16(FLAG_Z));
+
+		save(reg, select(load(reg), sum, mask));
+		save(f.cc, select(cc, _mm256_or_si256(_mm256_andnot_si256(_mm256_set1_epi16(FLAG_Z), cc), z), mask));
+		return true;
+	}
+
+	case OP_STA:
+		storeRow(f, addr, a, mask);
+		return true;
+
+	case OP_STX:
+	case OP_STY:
+	{
+		__m256i r = load(op == OP_STX ? f.x : f.y);
+
+		storeRow(f, addr, r, mask);
+		storeRow(f, addr + 1, _mm256_srli_epi16(r, 8), mask);
+		return true;
+	}
+
+	case OP_STAX:
+	case OP_STAY:
+	{
+		const uint16_t *reg = op == OP_STAX ? f.x : f.y;
+		if (!uniform(f, reg, mask))
+			return false;
+
+		storeRow(f, reg[f.leader], a, mask);
+		return true;
+	}
+
+	case OP_STYX:
+	case OP_STXY:
+	{
+		const uint16_t *reg = op == OP_STYX ? f.x : f.y;
+		if (!uniform(f, reg, mask))
+			return false;
+
+		__m256i r = load(op == OP_STYX ? f.y : f.x);
+		uint16_t target = reg[f.leader];
+
+		storeRow(f, target, r, mask);
+		storeRow(f, target + 1, _mm256_srli_epi16(r, 8), mask);
+		return true;
+	}
+
+	case OP_JMP:
+		save(f.pc, select(load(f.pc), _mm256_set1_epi16((short)addr), mask));
+		return true;
+
+	case OP_JNE:
+	case OP_JEQ:
+	case OP_JGT:
+	case OP_JLT:
+	{
+		__m256i zero = isZero(_mm256_and_si256(cc, _mm256_set1_epi16(FLAG_Z)));
+		__m256i n = _mm256_and_si256(_mm256_srli_epi16(cc, 3), one);
+		__m256i v = _mm256_and_si256(_mm256_srli_epi16(cc, 2), one);
+		__m256i same = _mm256_cmpeq_epi16(n, v);
+
+		if (op == OP_JNE)
+			cond = zero;
+		else if (op == OP_JEQ)
+			cond = _mm256_xor_si256(zero, _mm256_set1_epi16(-1));
+		else if (op == OP_JGT)
+			cond = _mm256_and_si256(zero, same);
+		else
+			cond = _mm256_xor_si256(same, _mm256_set1_epi16(-1));
+
+		save(f.pc, select(load(f.pc), _mm256_set1_epi16((short)addr), _mm256_and_si256(cond, mask)));
+		return true;
+	}
+
+	case OP_CALL:
+	{
+		if (!uniform(f, f.sp, mask) || !canPush(f, 2))
+			return false;
+
+		uint16_t sp = f.sp[f.leader];
+
+		push16(f, sp, _mm256_set1_epi16((short)next), mask);
+
+		save(f.sp, select(load(f.sp), _mm256_set1_epi16((short)sp), mask));
+		save(f.pc, select(load(f.pc), _mm256_set1_epi16((short)addr), mask));
+		return true;
+	}
+
+	case OP_RET:
+	{
+		if (!uniform(f, f.sp, mask))
+			return false;
+
+		uint16_t sp = f.sp[f.leader];
+		__m256i pc = pop16(f, sp);
+
+		save(f.sp, select(load(f.sp), _mm256_set1_epi16((short)sp), mask));
+		save(f.pc, select(load(f.pc), pc, mask));
+		return true;
+	}
+
+	case OP_PUSH:
+	{
+		if (!uniform(f, f.sp, mask) || !canPush(f, pushSize(operand)))
+			return false;
+
+		uint16_t sp = f.sp[f.leader];
+
+		if (operand & REG_PC)
+			push16(f, sp, load(f.pc), mask);
+
+		if (operand & REG_SP)
+			push16(f, sp, _mm256_set1_epi16((short)sp), mask);
+
+		if (operand & REG_X)
+			push16(f, sp, load(f.x), mask);
+
+		if (operand & REG_Y)
+			push16(f, sp, load(f.y), mask);
+
+		if (operand & REG_A)
+			push8(f, sp, a, mask);
+
+		if (operand & REG_CC)
+			push8(f, sp, cc, mask);
+
+		save(f.sp, select(load(f.sp), _mm256_set1_epi16((short)sp), mask));
+		return true;
+	}
+
+	case OP_POP:
+	{
+		// popping SP moves the stack of the remaining pops
+		if ((operand & REG_SP) || !uniform(f, f.sp, mask))
+			return false;
+
+		uint16_t sp = f.sp[f.leader];
+
+		if (operand & REG_CC)
+			save(f.cc, select(cc, loadRow(f, sp++), mask));
+
+		if (operand & REG_A)
+			save(f.a, select(a, loadRow(f, sp++), mask));
+
+		if (operand & REG_Y)
+			save(f.y, select(load(f.y), pop16(f, sp), mask));
+
+		if (operand & REG_X)
+			save(f.x, select(load(f.x), pop16(f, sp), mask));
+
+		if (operand & REG_PC)
+			save(f.pc, select(load(f.pc), pop16(f, sp), mask));
+
+		save(f.sp, select(load(f.sp), _mm256_set1_epi16((short)sp), mask));
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+// bookkeeping for the lanes which just ran
+static void finishAvx2(LaneFile &f, bool batch)
+{
+	__m256i active = load(f.active);
+	__m256i ran = _mm256_and_si256(load(f.mask), active);
+	__m256i waiting = _mm256_andnot_si256(ran, active);
+
+	save(f.waited, _mm256_andnot_si256(ran, _mm256_adds_epu16(load(f.waited), _mm256_and_si256(waiting, _mm256_set1_epi16(1)))));
+	save(f.timerDone, _mm256_andnot_si256(ran, load(f.timerDone)));
+
+	// a set lane is -1, subtracting it counts the instruction
+	for (int i = 0; i < LANES; i += 4)
+	{
+		__m256i *count = (__m256i *)&f.instructions[i];
+		__m256i ran64 = _mm256_cvtepi16_epi64(_mm_loadl_epi64((const __m128i *)&f.mask[i]));
+
+		ran64 = _mm256_and_si256(ran64, _mm256_cvtepi16_epi64(_mm_loadl_epi64((const __m128i *)&f.active[i])));
+		_mm256_storeu_si256(count, _mm256_sub_epi64(_mm256_loadu_si256(count), ran64));
+	}
+
+	// in batch mode a lane is done once it breaks or runs out of input
+	if (batch)
+	{
+		__m256i stop = _mm256_andnot_si256(isZero(_mm256_and_si256(load(f.cc), _mm256_set1_epi16(FLAG_S))), _mm256_set1_epi16(-1));
+		stop = _mm256_and_si256(_mm256_or_si256(stop, load(f.stopping)), ran);
+
+		save(f.active, _mm256_andnot_si256(stop, active));
+	}
+}
+
+static const LaneKernels avx2Kernels = { "avx2", scheduleAvx2, executeAvx2, finishAvx2 };
+
+//
+const LaneKernels *getAvx2LaneKernels()
+{
+	return &avx2Kernels;
+}
+
+#else
+
+//
+const LaneKernels *getAvx2LaneKernels()
+{
+	return nullptr;
+}
+
+#endif
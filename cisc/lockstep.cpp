@@ -0,0 +1,347 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "cisc.h"
+#include <algorithm>
+
+//
+// Differential lockstep harness
+//
+// Runs a reference engine and a candidate engine side by side over the same
+// image and input. After every instruction the registers, the addresses and
+// values of every store and the port output are compared, and the run stops
+// at the first divergence with a symbolized report.
+//
+
+static const uint64_t DEFAULT_IMAGE_STEPS	= 1000000;
+static const uint64_t DEFAULT_RANDOM_STEPS	= 10000;
+static const int RANDOM_PROGRAM_SIZE		= 256;
+
+// create an execution engine by name
+Cisc *createEngine(const std::string &name)
+{
+	if (name == "ref")
+		return new Cisc();
+
+	if (name == "lanes")
+		return createLaneEngine(true);
+
+	if (name == "lanes-scalar")
+		return createLaneEngine(false);
+
+	return nullptr;
+}
+
+// setup an engine to be observed by the harness
+static void prepareEngine(Cisc &engine, std::vector<uint8_t> &output)
+{
+	engine.setQuiet(true);
+	engine.setTrapPanics(true);
+	engine.setTrackWrites(true);
+	engine.captureOutput(&output);
+}
+
+// format an address as symbol+offset when possible
+static void symbolize(Cisc &engine, uint16_t addr, std::string &str)
+{
+	char buf[SMALL_BUFFER];
+	uint16_t symAddr;
+
+	auto name = engine.getNearestCodeSymbol(addr, symAddr);
+	if (name && symAddr <= addr)
+	{
+		if (addr > symAddr)
+			sprintf(buf, "%s +%d (" HEX_PREFIX "%04X)", name, addr - symAddr, addr);
+		else
+			sprintf(buf, "%s (" HEX_PREFIX "%04X)", name, addr);
+	}
+	else
+		sprintf(buf, HEX_PREFIX "%04X", addr);
+
+	str = buf;
+}
+
+// print one register of the divergence report
+static void reportRegister(const char *name, int ref, int test, int width)
+{
+	char refBuf[8], testBuf[8];
+
+	sprintf(refBuf, "%0*X", width, ref);
+	sprintf(testBuf, "%0*X", width, test);
+
+	printf("  %-3s %-6s %-6s%s\n", name, refBuf, testBuf, ref != test ? "<--" : "");
+}
+
+// print a symbolized report of the first divergence
+static void reportDivergence(Cisc &ref, Cisc &test, uint64_t step, uint16_t pc, uint8_t opcode, const char *reason)
+{
+	std::string where;
+	symbolize(ref, pc, where);
+
+	const char *mnemonic = opcode < OP_COUNT ? opcodeInfo[opcode].name : "???";
+
+	printf("\nDivergence at step %llu: %s\n", (unsigned long long)step, reason);
+	printf("Instruction: %s (" HEX_PREFIX "%02X) @ %s\n\n", mnemonic, opcode, where.c_str());
+
+	auto rs = ref.getState();
+	auto ts = test.getState();
+
+	printf("      ref    test\n");
+	reportRegister("A", rs.A, ts.A, 2);
+	reportRegister("X", rs.X, ts.X, 4);
+	reportRegister("Y", rs.Y, ts.Y, 4);
+	reportRegister("CC", rs.CC, ts.CC, 2);
+	reportRegister("SP", rs.SP, ts.SP, 4);
+	reportRegister("PC", rs.PC, ts.PC, 4);
+
+	// show the stores made by each engine during the step
+	const char *names[] = { "ref", "test" };
+	Cisc *engines[] = { &ref, &test };
+
+	for (int e = 0; e < 2; e++)
+	{
+		auto &writes = engines[e]->getWrites();
+		if (writes.empty())
+			continue;
+
+		printf("\n%s stores:\n", names[e]);
+		for (auto it = writes.begin(); it != writes.end(); it++)
+		{
+			auto name = engines[e]->getDataSymbolName(*it);
+
+			printf("  " HEX_PREFIX "%04X %-16s ref: %02X test: %02X\n", *it, name ? name : "", ref.ramPtr()[*it], test.ramPtr()[*it]);
+		}
+	}
+
+	putchar('\n');
+}
+
+// compare the register state of two engines
+static bool sameState(const CpuState &a, const CpuState &b)
+{
+	return a.A == b.A && a.CC == b.CC && a.PC == b.PC && a.SP == b.SP && a.X == b.X && a.Y == b.Y;
+}
+
+// compare the stores made by both engines during the last step
+static bool sameWrites(Cisc &ref, Cisc &test)
+{
+	auto refWrites = ref.getWrites();
+	auto testWrites = test.getWrites();
+
+	std::sort(refWrites.begin(), refWrites.end());
+	refWrites.erase(std::unique(refWrites.begin(), refWrites.end()), refWrites.end());
+
+	std::sort(testWrites.begin(), testWrites.end());
+	testWrites.erase(std::unique(testWrites.begin(), testWrites.end()), testWrites.end());
+
+	if (refWrites != testWrites)
+		return false;
+
+	for (auto it = refWrites.begin(); it != refWrites.end(); it++)
+	{
+		if (ref.ramPtr()[*it] != test.ramPtr()[*it])
+			return false;
+	}
+
+	return true;
+}
+
+// run two engines in lockstep, returns the number of steps or 0 on divergence
+static uint64_t lockstep(Cisc &ref, Cisc &test, std::vector<uint8_t> &refOut, std::vector<uint8_t> &testOut, uint64_t maxSteps)
+{
+	uint64_t step;
+
+	for (step = 1; step <= maxSteps; step++)
+	{
+		ref.clearWrites();
+		test.clearWrites();
+
+		uint16_t pc = ref.getPC();
+
+		uint8_t opcode = ref.tick();
+		test.tick();
+
+		const char *reason = nullptr;
+
+		if (ref.isFaulted() != test.isFaulted())
+			reason = "only one engine faulted";
+		else if (!sameState(ref.getState(), test.getState()))
+			reason = "register state differs";
+		else if (!sameWrites(ref, test))
+			reason = "memory stores differ";
+		else if (refOut != testOut)
+			reason = "port output differs";
+
+		if (reason)
+		{
+			reportDivergence(ref, test, step, pc, opcode, reason);
+			return 0;
+		}
+
+		// both engines hit an invalid instruction in the same way
+		if (ref.isFaulted())
+			break;
+	}
+
+	if (step > maxSteps)
+		step = maxSteps;
+
+	// catch any state the store tracking could have missed
+	if (memcmp(ref.ramPtr(), test.ramPtr(), 0x10000))
+	{
+		printf("\nDivergence: memory contents differ at end of run\n");
+		return 0;
+	}
+
+	return step;
+}
+
+// run an executable image in lockstep on the reference and a candidate engine
+int runLockstep(const char *filename, const std::string &engine, const std::vector<uint8_t> &input, uint64_t maxSteps)
+{
+	Cisc *ref = createEngine("ref");
+	Cisc *test = createEngine(engine);
+	if (!test)
+	{
+		fprintf(stderr, "Unknown engine '%s'!\n", engine.c_str());
+		delete ref;
+		return -1;
+	}
+
+	if (0 == maxSteps)
+		maxSteps = DEFAULT_IMAGE_STEPS;
+
+	std::vector<uint8_t> refOut, testOut;
+	prepareEngine(*ref, refOut);
+	prepareEngine(*test, testOut);
+
+	ref->load(filename);
+	test->load(filename);
+
+	ref->setInput(input.data(), input.size());
+	test->setInput(input.data(), input.size());
+
+	printf("Lockstep: ref vs %s on %s\n", engine.c_str(), filename);
+
+	auto steps = lockstep(*ref, *test, refOut, testOut, maxSteps);
+	if (steps)
+		printf("No divergence in %llu instructions\n", (unsigned long long)steps);
+
+	delete ref;
+	delete test;
+
+	return steps ? 0 : 1;
+}
+
+// generate a random instruction stream from the opcode table
+static void randomProgram(XorShift &rng, std::vector<uint8_t> &text)
+{
+	std::vector<size_t> starts;
+	std::vector<size_t> branches;
+	std::vector<size_t> shortBranches;
+
+	text.clear();
+
+	for (int i = 0; i < RANDOM_PROGRAM_SIZE; i++)
+	{
+		uint8_t op = rng.next() % OP_COUNT;
+
+		starts.push_back(text.size());
+		text.push_back(op);
+
+		// branch targets are patched to instruction starts below
+		if (op == OP_CALL || op == OP_JMP || op == OP_JNE || op == OP_JEQ || op == OP_JGT || op == OP_JLT)
+			branches.push_back(text.size());
+		else if (isShortBranch(op))
+			shortBranches.push_back(text.size());
+
+		for (int j = 0; j < opcodeInfo[op].operandSize; j++)
+			text.push_back(rng.nextByte());
+	}
+
+	for (auto it = branches.begin(); it != branches.end(); it++)
+	{
+		auto target = starts[rng.next() % starts.size()];
+		text[*it] = LOBYTE(target);
+		text[*it + 1] = HIBYTE(target);
+	}
+
+	// short branches get an instruction start in reach of the displacement,
+	// which always includes their own
+	for (auto it = shortBranches.begin(); it != shortBranches.end(); it++)
+	{
+		int next = (int)*it + 1;
+		auto first = std::lower_bound(starts.begin(), starts.end(), (size_t)std::max(next - 128, 0));
+		auto last = std::upper_bound(starts.begin(), starts.end(), (size_t)(next + 127));
+
+		auto target = first[rng.next() % (last - first)];
+		text[*it] = (uint8_t)(target - next);
+	}
+}
+
+// run randomly generated instruction streams in lockstep
+int runRandomLockstep(uint64_t seed, const std::string &engine, uint64_t programs, uint64_t maxSteps)
+{
+	Cisc *ref = createEngine("ref");
+	Cisc *test = createEngine(engine);
+	if (!test)
+	{
+		fprintf(stderr, "Unknown engine '%s'!\n", engine.c_str());
+		delete ref;
+		return -1;
+	}
+
+	if (0 == maxSteps)
+		maxSteps = DEFAULT_RANDOM_STEPS;
+
+	std::vector<uint8_t> refOut, testOut;
+	prepareEngine(*ref, refOut);
+	prepareEngine(*test, testOut);
+
+	printf("Lockstep: ref vs %s on %llu random programs, seed %llu\n", engine.c_str(), (unsigned long long)programs, (unsigned long long)seed);
+
+	XorShift rng(seed);
+	std::vector<uint8_t> text, data(0x10000), input(256);
+	uint64_t total = 0;
+	int result = 0;
+
+	for (uint64_t i = 0; i < programs; i++)
+	{
+		randomProgram(rng, text);
+
+		// random RAM also randomizes the interrupt vectors and timer registers
+		for (size_t j = 0; j < data.size(); j++)
+			data[j] = rng.nextByte();
+
+		for (size_t j = 0; j < input.size(); j++)
+			input[j] = rng.nextByte();
+
+		Cisc *engines[] = { ref, test };
+		for (int e = 0; e < 2; e++)
+		{
+			engines[e]->reset();
+			engines[e]->loadImage(text.data(), text.size(), data.data(), data.size(), 0);
+			engines[e]->setInput(input.data(), input.size());
+		}
+
+		refOut.clear();
+		testOut.clear();
+
+		auto steps = lockstep(*ref, *test, refOut, testOut, maxSteps);
+		if (!steps)
+		{
+			printf("Random program %llu diverged\n", (unsigned long long)i);
+			result = 1;
+			break;
+		}
+
+		total += steps;
+	}
+
+	if (!result)
+		printf("No divergence in %llu instructions\n", (unsigned long long)total);
+
+	delete ref;
+	delete test;
+
+	return result;
+}
@@ -1,250 +1,268 @@
 #define _CRT_SECURE_NO_WARNINGS
 
-#include "../aout.h"
-#include "../cpu_cisc.h"
-#include <stdio.h>
+#include "cisc.h"
 #include <stdarg.h>
 #include <ctype.h>
-#include <set>
+#include <algorithm>
 #include <signal.h>
 
-// Flag bit helper functions
-#define SETF(flag) (CC |= flag)
-#define CLRF(flag) (CC &= ~flag)
-#define TSTF(flag) ((CC & flag) != 0)
+// time spent in the os.asm task running this PROC is reported as idle
+static const char *IDLE_TASK = "idleTask";
 
 //
-static const int SMALL_BUFFER = 256;
-
-// define our CPU arch
-class Cisc
-{
-protected:
-	// 8-bit registers
-	uint8_t A, CC;
+// Command line switches
+//
+bool g_bTaskStats = false;
+bool g_bStackStats = false;
+bool g_bLockstep = false;
+bool g_bRandomLockstep = false;
+bool g_bBatch = false;
+uint64_t g_nSeed = 1;
+uint64_t g_nMaxSteps = 0;
+uint64_t g_nPrograms = 1000;
+const char *g_szEngine = nullptr;
+const char *g_szInputFile = nullptr;
+const char *g_szCorpusDir = nullptr;
+uint64_t g_nMaxExecs = 0;
+unsigned g_nThreads = 0;
 
-	// 16-bit registers
-	uint16_t PC, SP, X, Y;
-	
-	// memory
-	uint8_t ram[0x10000];
-	uint8_t rom[0x10000];
+Cisc cpu;
 
-	// processor state
-	uint16_t maxStack;
-	uint16_t __brk;
+// print out all current breakpoints
+void Cisc::listBreakpoints()
+{
+	for (auto it = breakpoints.begin(); it != breakpoints.end(); it++)
+	{
+		if (auto name = getCodeSymbolName(*it))
+			printf("breakpoint @ %s (" HEX_PREFIX "%04X)\n", name, *it);
+		else
+			printf("breakpoint @ " HEX_PREFIX "%04X\n", *it);
+	}
+}
 
-	// instruction buffer
-	uint8_t opcode;
+//
+bool Cisc::getSymbolAddress(const std::string &name, uint16_t &addr)
+{
+	SymbolEntity se;
 
-	void log(const char *fmt, ...);
+	if (!obj.findSymbol(name, se))
+		return false;
 
-	void pushRegs();
-	void popRegs();
+	addr = se.value;
+	return true;
+}
 
-	using BreakpointList = std::set<uint32_t>;
-	BreakpointList breakpoints;
+//
+const char *Cisc::getCodeSymbolName(uint16_t addr)
+{
+	return obj.findCodeSymbolByAddr(addr);
+}
 
-	ObjectFile obj;
-	
-public:
-	Cisc() {
-		reset();
-	}
+// load an executable file into ROM/RAM
+void Cisc::load(const std::string &filename)
+{
+	if (!quiet)
+		printf("Loading file: %s\n", filename.c_str());
 
-	virtual ~Cisc() {}
+	obj.open(filename);
 
-	void load(const std::string &filename);
+	// the trace, profiles and debugger symbolize addresses all the time
+	if (!quiet)
+		obj.buildAddrMaps();
 
-	void reset() 
-	{ 
-		A = CC = opcode = 0; 
-		X = Y = 0;
+	PC = obj.getEntryPoint();
 
-		ram[RESET_VECTOR] = 0;
-		ram[RESET_VECTOR + 1] = 0;
+	// populate ram
+	memset(ram, 0, 0xFFFF);
+	memcpy(ram, obj.dataPtr(), obj.getDataSize());
 
-		PC = ram[RESET_VECTOR];
-		SP = RAM_END;
+	// populate rom
+	memset(rom, 0, 0xFFFF);
+	memcpy(rom, obj.textPtr(), obj.getTextSize());
 
-		maxStack = SP;
-		ram[MMIO_TIMER_REG] = 0;
-		ram[MMIO_TIMER_ENA] = 0;
-		ram[MMIO_TIMER_LIM] = 0;
+	SymbolEntity se;
+	if (obj.findSymbol("__brk", se))
+	{
+		__brk = ram[se.value] + (ram[se.value + 1] << 8);
+		if (!quiet)
+			printf("Found stack __brk limit of: " HEX_PREFIX "%04X\n", __brk);
 	}
 
-	uint32_t checkOverflow(uint16_t val);
-	uint32_t checkOverflow(uint32_t val);
-	void inputByte();
-	void outputByte();
+	stackProfiling = g_bStackStats;
 
-	uint16_t getMaxStack() { return RAM_END - maxStack; }
-	void push(uint8_t val);
-	uint8_t pop();
-	void getRegisterList(uint8_t operand, std::string&);
-	void panic();
-	uint16_t fetchW();
-	uint8_t fetch();
-	void decode();
-	void pushAll();
-	void popAll();
-	void updateFlag(uint32_t result, uint8_t flag);
-
-	uint8_t exec();
-	uint8_t tick();
+	// watch the os.asm scheduler's current TCB pointer to follow task switches
+	if ((g_bTaskStats || g_bStackStats) && obj.findSymbol("current", se) && (se.type & SET_DATA))
+	{
+		taskTracking = true;
+		currentTaskAddr = se.value;
+		printf("Found task pointer 'current' at: " HEX_PREFIX "%04X\n", currentTaskAddr);
+	}
+}
 
-	void interrupt(uint32_t vector);
+// load a raw text and data image, e.g. a generated instruction stream
+void Cisc::loadImage(const uint8_t *text, size_t textSize, const uint8_t *data, size_t dataSize, uint16_t entry)
+{
+	memset(rom, 0, sizeof(rom));
+	memcpy(rom, text, textSize);
 
-	uint8_t getCC() const	{ return CC;  }
-	void setCC(uint8_t cc)	{ CC = cc; }
+	memset(ram, 0, sizeof(ram));
+	memcpy(ram, data, dataSize);
 
-	// breakpoints
-	uint16_t getPC() const { return PC; }
-	bool getSymbolAddress(const std::string &name, uint16_t &addr);
-	bool getCodeSymbolName(uint16_t addr, std::string &name);
-	void addBreakpoint(uint16_t addr) { breakpoints.insert(addr); }
+	PC = entry;
+}
 
-	void clearAllBreakpoints() { breakpoints.clear(); }
+// attribute the instruction about to execute to the current task
+void Cisc::accountTask()
+{
+	uint16_t tcb = ram[currentTaskAddr] + (ram[currentTaskAddr + 1] << 8);
 
-	bool clearBreakpoint(const std::string &name)
+	// the scheduler changed the current TCB. When that happens in an ISR the
+	// new task's stack is only switched in by the RTI, so wait for it.
+	if (tcb != currentTask && !TSTF(FLAG_I))
 	{
-		uint16_t addr = 0;
-		if (getSymbolAddress(name, addr))
-		{
-			breakpoints.erase(addr);
-			log("breakpoint deleted @ %s (" HEX_PREFIX "%04X)", name.c_str(), addr);
-
-			return true;
-		}
+		currentTask = tcb;
+		pTask = &tasks[tcb];
+		pTask->switches++;
+		taskSwitches++;
+	}
 
-		return false;
+	// name the task after the code it runs once it leaves the scheduler
+	if (pTask->name.empty() && currentTask && !TSTF(FLAG_I))
+	{
+		uint16_t addr;
+		auto name = obj.findNearestCodeSymbolToAddr(PC, addr);
+		pTask->name = name ? name : "<unknown>";
 	}
 
-	void listBreakpoints();
+	pTask->instructions++;
+	if (TSTF(FLAG_I))
+		pTask->isrInstructions++;
+	else if (SP > pTask->stackTop)
+		pTask->stackTop = SP;
+}
 
-	bool setBreakpoint(const std::string &name)
-	{
-		uint16_t addr = 0;
-		if (getSymbolAddress(name, addr))
-		{
-			addBreakpoint(addr);
-			log("breakpoint set @ %s (" HEX_PREFIX "%04X)", name.c_str(), addr);
+// push a frame on the current task's shadow call stack
+void Cisc::enterFrame(uint16_t target, uint16_t entrySP, bool isInterrupt)
+{
+	StackFrame frame;
 
-			return true;
-		}
-		
-		return false;
-	}
+	frame.target = target;
+	frame.entrySP = entrySP;
+	frame.minSP = SP;
+	frame.isInterrupt = isInterrupt;
 
-	bool isBreakpoint(uint16_t addr)
-	{
-		if (breakpoints.find(addr) != breakpoints.end())
-			return true;
-		
-		return false;
-	}
+	pTask->callStack.push_back(frame);
+}
 
-	uint16_t getAddressFromToken(char *tok);
+// pop a frame from the current task's shadow call stack and record its depth
+void Cisc::leaveFrame()
+{
+	auto &callStack = pTask->callStack;
 
-	//
-	void printRegisters()
-	{
-		printf("A: %02X X: %04X Y: %04X CC: %02X SP: %04X PC: %04X\n", A, X, Y, CC, SP, PC);
-		printf("Flags C: %d Z: %d V: %d N: %d I: %d S: %d\n", TSTF(FLAG_C), TSTF(FLAG_Z), TSTF(FLAG_V), TSTF(FLAG_N), TSTF(FLAG_I), TSTF(FLAG_S));
-	}
+	// returns without a matching call, e.g. the first RTI into a new task
+	if (callStack.empty())
+		return;
 
-	void printByte(uint16_t addr)
-	{
-		printf("%d (" HEX_PREFIX "%04X) points to -> %d (" HEX_PREFIX "%02X)\n", addr, addr, ram[addr], ram[addr]);
-	}
+	auto frame = callStack.back();
+	callStack.pop_back();
 
-	void printWord(uint16_t addr)
-	{
-		uint16_t value = ram[addr] + (ram[addr + 1] << 8);
+	auto &stats = procStacks[frame.target];
+	stats.calls++;
 
-		printf("%d (" HEX_PREFIX "%04X) points to -> %d (" HEX_PREFIX "%04X)\n", addr, addr, value, value);
-	}
+	int depth = frame.entrySP - frame.minSP;
+	if (depth > stats.maxDepth)
+		stats.maxDepth = depth;
 
-	void dumpMemoryAt(uint32_t addr)
-	{
-		hexDumpLine(stdout, addr, &ram[addr]);
-		hexDumpLine(stdout, addr + 16, &ram[addr + 16]);
-	}
+	// stack used by the callee also counts against its caller, interrupts
+	// are charged to the task rather than to the code they interrupted
+	if (!frame.isInterrupt && !callStack.empty() && frame.minSP < callStack.back().minSP)
+		callStack.back().minSP = frame.minSP;
+}
 
-	void reportLocation()
+// print the per-PROC and per-task stack usage report
+void Cisc::printStackStats()
+{
+	if (!stackProfiling)
 	{
-		std::string name;
-		uint16_t addr;
-
-		if (obj.findNearestCodeSymbolToAddr(PC, name, addr))
-		{
-			if (PC > addr)
-				log("execution stopped @ %s +%d (" HEX_PREFIX "%04X)", name.c_str(), PC - addr, PC);
-			else
-				log("execution stopped @ %s (" HEX_PREFIX "%04X)", name.c_str(), PC);
-		}
-		else
-			log("stopped @ " HEX_PREFIX "%X", PC);
+		puts("Stack profiling not enabled, run with -s.");
+		return;
 	}
-};
 
-Cisc cpu;
+	std::vector<std::pair<uint16_t, ProcStackStats>> procs(procStacks.begin(), procStacks.end());
+	std::sort(procs.begin(), procs.end(), [](const std::pair<uint16_t, ProcStackStats> &a, const std::pair<uint16_t, ProcStackStats> &b) {
+		return a.second.maxDepth > b.second.maxDepth;
+	});
 
-// print out all current breakpoints
-void Cisc::listBreakpoints()
-{
-	std::string name;
+	printf("\nStack usage by PROC\n");
+	printf("-------------------\n\n");
+	printf(" Addr  PROC                         Calls  Max depth\n");
 
-	for (auto it = breakpoints.begin(); it != breakpoints.end(); it++)
+	for (auto it = procs.begin(); it != procs.end(); it++)
 	{
-		if (getCodeSymbolName(*it, name))
-			printf("breakpoint @ %s (" HEX_PREFIX "%04X)\n", name.c_str(), *it);
-		else
-			printf("breakpoint @ " HEX_PREFIX "%04X\n", *it);
+		auto name = getCodeSymbolName(it->first);
+		printf(HEX_PREFIX "%04X  %-20s %13llu  %9d\n", it->first, name ? name : "<none>", (unsigned long long)it->second.calls, it->second.maxDepth);
 	}
-}
 
-//
-bool Cisc::getSymbolAddress(const std::string &name, uint16_t &addr)
-{
-	SymbolEntity se;
+	printf("\nStack usage by task\n");
+	printf("-------------------\n\n");
+	printf("  TCB  Task                    Top    Low  Max depth\n");
 
-	if (!obj.findSymbol(name, se))
-		return false;
+	for (auto it = tasks.begin(); it != tasks.end(); it++)
+	{
+		auto &ts = it->second;
+		if (ts.stackLow > ts.stackTop)
+			continue;
 
-	addr = se.value;
-	return true;
+		const char *taskName = it->first ? ts.name.c_str() : "<no task>";
+		printf(HEX_PREFIX "%04X  %-20s  " HEX_PREFIX "%04X  " HEX_PREFIX "%04X  %9d\n", it->first, taskName, ts.stackTop, ts.stackLow, ts.stackTop - ts.stackLow);
+	}
 }
 
-//
-bool Cisc::getCodeSymbolName(uint16_t addr, std::string &name)
+// print the per-task CPU usage report
+void Cisc::printTaskStats()
 {
-	return obj.findCodeSymbolByAddr(addr, name);
-}
+	if (!taskTracking)
+	{
+		puts("Task accounting not enabled, run with -t on an os.asm image.");
+		return;
+	}
 
-// load an executable file into ROM/RAM
-void Cisc::load(const std::string &filename)
-{
-	printf("Loading file: %s\n", filename.c_str());
+	printf("\nTask accounting, idle time is the time spent in %s\n", IDLE_TASK);
+	printf("--------------------------------------------------\n\n");
+	printf("  TCB  Task                  Instructions    CPU%%    ISR%%  Interrupts  Switches  Mean slice\n");
 
-	obj.readFile(filename);
+	uint64_t idle = 0;
+	bool hasIdle = false;
 
-	PC = obj.getEntryPoint();
+	for (auto it = tasks.begin(); it != tasks.end(); it++)
+	{
+		auto &ts = it->second;
+		if (0 == ts.instructions)
+			continue;
 
-	// populate ram
-	memset(ram, 0, 0xFFFF);
-	memcpy(ram, obj.dataPtr(), obj.getDataSize());
+		const char *name = it->first ? ts.name.c_str() : "<no task>";
+		if (ts.name == IDLE_TASK)
+		{
+			idle += ts.instructions;
+			hasIdle = true;
+		}
 
-	// populate rom
-	memset(rom, 0, 0xFFFF);
-	memcpy(rom, obj.textPtr(), obj.getTextSize());
+		double cpu = instructionCount ? 100.0 * ts.instructions / instructionCount : 0.0;
+		double isr = 100.0 * ts.isrInstructions / ts.instructions;
+		double slice = ts.switches ? (double)ts.instructions / ts.switches : (double)ts.instructions;
 
-	SymbolEntity se;
-	if (obj.findSymbol("__brk", se))
-	{
-		__brk = ram[se.value] + (ram[se.value + 1] << 8);
-		printf("Found stack __brk limit of: " HEX_PREFIX "%04X\n", __brk);
+		printf(HEX_PREFIX "%04X  %-20s %13llu  %5.1f%%  %5.1f%%  %10llu  %8llu  %10.1f\n", it->first, name,
+			(unsigned long long)ts.instructions, cpu, isr, (unsigned long long)ts.interrupts, (unsigned long long)ts.switches, slice);
 	}
+
+	printf("\nInstructions: %llu\n", (unsigned long long)instructionCount);
+	printf("Context switches: %llu\n", (unsigned long long)taskSwitches);
+	if (taskSwitches)
+		printf("Mean instructions between switches: %.1f\n", (double)instructionCount / taskSwitches);
+	if (!hasIdle)
+		printf("Idle: unknown, no task runs %s\n", IDLE_TASK);
+	else if (instructionCount)
+		printf("Idle: %.1f%%\n", 100.0 * idle / instructionCount);
 }
 
 // stack is full descending
@@ -253,16 +271,31 @@ void Cisc::push(uint8_t val)
 {
 	SP--;
 
-	if (SP < maxStack)
+	// the depth of the main stack, task stacks allocated from the heap below
+	// __brk are reported per task by the stack profile
+	if (SP < maxStack && SP >= __brk)
 		maxStack = SP;
 
-	//if (SP < __brk)
-	//{
-	//	puts("Stack overflow!\n");
-	//	panic();
-	//}
+	// flag the stack growing into the heap as it happens. Task stacks are
+	// allocated from the heap and so only a crossing of __brk is an overflow.
+	if (__brk && SP + 1 == __brk)
+	{
+		if (!quiet)
+			printf("Stack overflow! SP crossed __brk (" HEX_PREFIX "%04X)\n", __brk);
+		SETF(FLAG_S);
+		stackOverflowed = true;
+	}
+
+	if (stackProfiling)
+	{
+		if (SP < pTask->stackLow)
+			pTask->stackLow = SP;
+
+		if (!pTask->callStack.empty() && SP < pTask->callStack.back().minSP)
+			pTask->callStack.back().minSP = SP;
+	}
 
-	ram[SP] = val;
+	store(SP, val);
 }
 
 //
@@ -292,7 +325,7 @@ void Cisc::getRegisterList(uint8_t operand, std::string &str)
 //
 void Cisc::log(const char *fmt, ...)
 {
-	if (!TSTF(FLAG_S))
+	if (quiet || !TSTF(FLAG_S))
 		return;
 
 	char buf[SMALL_BUFFER];
@@ -376,6 +409,10 @@ void Cisc::popRegs()
 	if (operand & REG_PC)
 	{
 		PC = pop() | (pop() << 8);
+
+		// popping PC is a return
+		if (stackProfiling)
+			leaveFrame();
 	}
 
 	std::string s;
@@ -419,7 +456,18 @@ void Cisc::inputByte()
 	switch (port)
 	{
 	case 1:
-		A = getchar();
+		if (hasInput)
+		{
+			if (inputPos < inputSize)
+				A = inputData[inputPos++];
+			else
+			{
+				A = 0xFF;
+				inputExhausted = true;
+			}
+		}
+		else
+			A = getchar();
 		break;
 
 	default:
@@ -438,7 +486,10 @@ void Cisc::outputByte()
 	switch (port)
 	{
 	case 1:
-		putchar(A);
+		if (pOutput)
+			pOutput->push_back(A);
+		else
+			putchar(A);
 		break;
 
 	default:
@@ -461,7 +512,6 @@ char makePrintable(char c)
 // execute the next instruction
 uint8_t Cisc::exec()
 {
-	std::string name;
 	uint8_t operand;
 	uint16_t addr;
 	uint16_t temp16;
@@ -476,7 +526,7 @@ uint8_t Cisc::exec()
 	case OP_SHL:
 		operand = fetch();
 
-		temp16 = A << operand;
+		temp16 = operand < 16 ? A << operand : 0;	// wide shifts clear A
 
 		updateFlag(temp16 & 0xFF00, FLAG_C);
 		updateFlag(temp16 == 0, FLAG_Z);
@@ -495,7 +545,7 @@ uint8_t Cisc::exec()
 
 		updateFlag(A & 1, FLAG_C);
 
-		A = A >> operand;
+		A = operand < 8 ? A >> operand : 0;
 		A = A | temp16;		// restore top bit 7
 
 		updateFlag(A == 0, FLAG_Z);
@@ -515,8 +565,8 @@ uint8_t Cisc::exec()
 
 		A = temp16 & 0xFF;
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("ADD [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("ADD [%s]", name);
 		else
 			log("ADD [" HEX_PREFIX "%X]", addr);
 		break;
@@ -546,8 +596,8 @@ uint8_t Cisc::exec()
 
 		A = temp16 & 0xFF;
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("ADC [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("ADC [%s]", name);
 		else
 			log("ADC [" HEX_PREFIX "%X]", addr);
 		break;
@@ -589,8 +639,8 @@ uint8_t Cisc::exec()
 
 		// Note: we discard the result!
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("CMP [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("CMP [%s]", name);
 		else
 			log("CMP [" HEX_PREFIX "%X]", addr);
 		break;
@@ -611,7 +661,7 @@ uint8_t Cisc::exec()
 
 	case OP_CMPX:
 		addr = fetchW();
-		temp32 = X - (ram[addr] + (ram[addr + 1] << 8));
+		temp32 = X - (ram[addr] + (ram[(uint16_t)(addr + 1)] << 8));
 
 		updateFlag(temp32 & 0xFFFF0000, FLAG_C);
 		updateFlag(temp32 == 0, FLAG_Z);
@@ -620,8 +670,8 @@ uint8_t Cisc::exec()
 
 		// Note: we discard the result!
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("CMPX [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("CMPX [%s]", name);
 		else
 			log("CMPX [" HEX_PREFIX "%X]", addr);
 		break;
@@ -642,7 +692,7 @@ uint8_t Cisc::exec()
 
 	case OP_CMPY:
 		addr = fetchW();
-		temp32 = Y - (ram[addr] + (ram[addr + 1] << 8));
+		temp32 = Y - (ram[addr] + (ram[(uint16_t)(addr + 1)] << 8));
 
 		updateFlag(temp32 & 0xFFFF0000, FLAG_C);
 		updateFlag(temp32 == 0, FLAG_Z);
@@ -651,8 +701,8 @@ uint8_t Cisc::exec()
 
 		// Note: we discard the result!
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("CMPY [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("CMPY [%s]", name);
 		else
 			log("CMPY [" HEX_PREFIX "%X]", addr);
 		break;
@@ -682,8 +732,8 @@ uint8_t Cisc::exec()
 
 		A = temp16 & 0xFF;
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("SUB [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("SUB [%s]", name);
 		else
 			log("SUB [" HEX_PREFIX "%X]", addr);
 		break;
@@ -713,8 +763,8 @@ uint8_t Cisc::exec()
 
 		A = temp16 & 0xFF;
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("SBB [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("SBB [%s]", name);
 		else
 			log("SBB [" HEX_PREFIX "%X]", addr);
 		break;
@@ -741,8 +791,8 @@ uint8_t Cisc::exec()
 		updateFlag(A & 0x80, FLAG_N);
 		updateFlag(0, FLAG_V);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("AND [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("AND [%s]", name);
 		else
 			log("AND [" HEX_PREFIX "%X]", addr);
 		break;
@@ -766,8 +816,8 @@ uint8_t Cisc::exec()
 		updateFlag(A & 0x80, FLAG_N);
 		updateFlag(0, FLAG_V);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("OR [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("OR [%s]", name);
 		else
 			log("OR [" HEX_PREFIX "%X]", addr);
 		break;
@@ -785,21 +835,21 @@ uint8_t Cisc::exec()
 
 	case OP_XOR:
 		addr = fetchW();
-		A = A % ram[addr];
+		A = A ^ ram[addr];
 
 		updateFlag(A == 0, FLAG_Z);
 		updateFlag(A & 0x80, FLAG_N);
 		updateFlag(0, FLAG_V);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("XOR [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("XOR [%s]", name);
 		else
 			log("XOR [" HEX_PREFIX "%X]", addr);
 		break;
 
 	case OP_XORI:
 		operand = fetch();
-		A = A % operand;
+		A = A ^ operand;
 
 		updateFlag(A == 0, FLAG_Z);
 		updateFlag(A & 0x80, FLAG_N);
@@ -821,82 +871,98 @@ uint8_t Cisc::exec()
 		break;
 
 	case OP_CALL:
-		addr = fetchW();
+	case OP_BSR:
+		addr = fetchBranch();
 
+		temp16 = SP;
 		push(HIBYTE(PC));
 		push(LOBYTE(PC));
 
 		PC = addr;
 
-		if (obj.findCodeSymbolByAddr(addr, name))
-			log("CALL %s", name.c_str());
+		if (stackProfiling)
+			enterFrame(addr, temp16);
+
+		if (auto name = traceCodeSymbol(addr))
+			log("%s %s", opcodeInfo[opcode].name, name);
 		else
-			log("CALL %s (" HEX_PREFIX "%X)", name.c_str(), PC);
+			log("%s <none> (" HEX_PREFIX "%X)", opcodeInfo[opcode].name, PC);
 		break;
 	
 	case OP_RET:
 		PC = pop() | (pop() << 8);
 
+		if (stackProfiling)
+			leaveFrame();
+
 		log("RET");
 		break;
 
 	case OP_RTI:
 		popAll();
 
+		if (stackProfiling)
+			leaveFrame();
+
 		log("RTI");
 		break;
 
 	case OP_JMP:
-		PC = fetchW();
+	case OP_BRA:
+		PC = fetchBranch();
 
-		if (obj.findCodeSymbolByAddr(PC, name))
-			log("JMP %s", name.c_str());
+		if (auto name = traceCodeSymbol(PC))
+			log("%s %s", opcodeInfo[opcode].name, name);
 		else
-			log("JMP " HEX_PREFIX "%X", PC);
+			log("%s " HEX_PREFIX "%X", opcodeInfo[opcode].name, PC);
 		break;
 
 	case OP_JNE:
-		addr = fetchW();
+	case OP_BNE:
+		addr = fetchBranch();
 		if (!TSTF(FLAG_Z))
 			PC = addr;
 
-		if (obj.findCodeSymbolByAddr(addr, name))
-			log("JNE %s", name.c_str());
+		if (auto name = traceCodeSymbol(addr))
+			log("%s %s", opcodeInfo[opcode].name, name);
 		else
-			log("JNE " HEX_PREFIX "%X", addr);
+			log("%s " HEX_PREFIX "%X", opcodeInfo[opcode].name, addr);
 		break;
 
 	case OP_JEQ:
-		addr = fetchW();
+	case OP_BEQ:
+		addr = fetchBranch();
 		if (TSTF(FLAG_Z))
 			PC = addr;
 
-		if (obj.findCodeSymbolByAddr(addr, name))
-			log("JEQ %s", name.c_str());
+		if (auto name = traceCodeSymbol(addr))
+			log("%s %s", opcodeInfo[opcode].name, name);
 		else
-			log("JEQ " HEX_PREFIX "%X", addr);
+			log("%s " HEX_PREFIX "%X", opcodeInfo[opcode].name, addr);
 		break;
 
 	case OP_JGT:
-		addr = fetchW();
+	case OP_BGT:
+		addr = fetchBranch();
 		if (!TSTF(FLAG_Z) && ( (TSTF(FLAG_N) && TSTF(FLAG_V)) || (!TSTF(FLAG_N) && !TSTF(FLAG_V)) ) )
 			PC = addr;
 
-		if (obj.findCodeSymbolByAddr(addr, name))
-			log("JGT %s", name.c_str());
+		if (auto name = traceCodeSymbol(addr))
+			log("%s %s", opcodeInfo[opcode].name, name);
 		else
-			log("JGT " HEX_PREFIX "%X", addr);
+			log("%s " HEX_PREFIX "%X", opcodeInfo[opcode].name, addr);
 		break;
 
 	case OP_JLT:
-		addr = fetchW();
+	case OP_BLT:
+		addr = fetchBranch();
 		if ( (TSTF(FLAG_N) || TSTF(FLAG_V)) && !(TSTF(FLAG_N) && TSTF(FLAG_V)) )
 			PC = addr;
 
-		if (obj.findCodeSymbolByAddr(addr, name))
-			log("JLT %s", name.c_str());
+		if (auto name = traceCodeSymbol(addr))
+			log("%s %s", opcodeInfo[opcode].name, name);
 		else
-			log("JLT " HEX_PREFIX "%X", addr);
+			log("%s " HEX_PREFIX "%X", opcodeInfo[opcode].name, addr);
 		break;
 
 	case OP_LAX:
@@ -927,8 +993,8 @@ uint8_t Cisc::exec()
 		updateFlag(A & 0x80, FLAG_N);
 		updateFlag(0, FLAG_V);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("LDA [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("LDA [%s]", name);
 		else
 			log("LDA [" HEX_PREFIX "%X]", addr);
 		break;
@@ -946,14 +1012,14 @@ uint8_t Cisc::exec()
 
 	case OP_LDX:
 		addr = fetchW();
-		X = ram[addr] + (ram[addr + 1] << 8);
+		X = ram[addr] + (ram[(uint16_t)(addr + 1)] << 8);
 
 		updateFlag(X == 0, FLAG_Z);
 		updateFlag(X & 0x8000, FLAG_N);
 		updateFlag(0, FLAG_V);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("LDX [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("LDX [%s]", name);
 		else
 			log("LDX [" HEX_PREFIX "%X]", addr);
 		break;
@@ -970,14 +1036,14 @@ uint8_t Cisc::exec()
 
 	case OP_LDY:
 		addr = fetchW();
-		Y = ram[addr] + (ram[addr + 1] << 8);
+		Y = ram[addr] + (ram[(uint16_t)(addr + 1)] << 8);
 
 		updateFlag(Y == 0, FLAG_Z);
 		updateFlag(Y & 0x8000, FLAG_N);
 		updateFlag(0, FLAG_V);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("LDY [%s]", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("LDY [%s]", name);
 		else
 			log("LDY [" HEX_PREFIX "%X]", addr);
 		break;
@@ -1011,7 +1077,7 @@ uint8_t Cisc::exec()
 		break;
 
 	case OP_LXX:
-		X = ram[X] + (ram[X + 1] << 8);
+		X = ram[X] + (ram[(uint16_t)(X + 1)] << 8);
 
 		updateFlag(X == 0, FLAG_Z);
 		updateFlag(X & 0x8000, FLAG_N);
@@ -1021,7 +1087,7 @@ uint8_t Cisc::exec()
 		break;
 
 	case OP_LYY:
-		Y = ram[Y] + (ram[Y + 1] << 8);
+		Y = ram[Y] + (ram[(uint16_t)(Y + 1)] << 8);
 
 		updateFlag(Y == 0, FLAG_Z);
 		updateFlag(Y & 0x8000, FLAG_N);
@@ -1032,58 +1098,58 @@ uint8_t Cisc::exec()
 
 	case OP_STA:
 		addr = fetchW();
-		ram[addr] = A;
+		store(addr, A);
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("STA %s", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("STA %s", name);
 		else
 			log("STA " HEX_PREFIX "%X", addr);
 		break;
 
 	case OP_STX:
 		addr = fetchW();
-		ram[addr] = LOBYTE(X);
-		ram[addr + 1] = HIBYTE(X);
+		store(addr, LOBYTE(X));
+		store(addr + 1, HIBYTE(X));
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("STX %s", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("STX %s", name);
 		else
 			log("STX " HEX_PREFIX "%X", addr);
 		break;
 
 	case OP_STY:
 		addr = fetchW();
-		ram[addr] = LOBYTE(Y);
-		ram[addr + 1] = HIBYTE(Y);
+		store(addr, LOBYTE(Y));
+		store(addr + 1, HIBYTE(Y));
 
-		if (obj.findDataSymbolByAddr(addr, name))
-			log("STY %s", name.c_str());
+		if (auto name = traceDataSymbol(addr))
+			log("STY %s", name);
 		else
 			log("STY " HEX_PREFIX "%X", addr);
 		break;
 
 	case OP_STAX:
-		ram[X] = A;
+		store(X, A);
 
 		log("STAX");
 		break;
 
 	case OP_STAY:
-		ram[Y] = A;
+		store(Y, A);
 
 		log("STAY");
 		break;
 
 	case OP_STYX:
-		ram[X] = LOBYTE(Y);
-		ram[X + 1] = HIBYTE(Y);
+		store(X, LOBYTE(Y));
+		store(X + 1, HIBYTE(Y));
 
 		log("STYX");
 		break;
 
 	case OP_STXY:
-		ram[Y] = LOBYTE(X);
-		ram[Y + 1] = HIBYTE(X);
+		store(Y, LOBYTE(X));
+		store(Y + 1, HIBYTE(X));
 
 		log("STXY");
 		break;
@@ -1129,18 +1195,67 @@ uint8_t Cisc::tick()
 	// timer increments only if enabled
 	if (ram[MMIO_TIMER_ENA])
 	{
-		ram[MMIO_TIMER_REG]++;
+		store(MMIO_TIMER_REG, ram[MMIO_TIMER_REG] + 1);
 
 		// check for timer interrupts
 		if (ram[MMIO_TIMER_LIM] == ram[MMIO_TIMER_REG])
 			interrupt(INT_VECTOR);
 	}
 
+	if (taskTracking)
+		accountTask();
+
+	instructionCount++;
+
+	uint16_t pc = PC;
+
 	opcode = fetch();
 
 	decode();
 
-	return exec();
+	exec();
+
+	// edge coverage for the fuzzer, CALL through JLT and the short branches
+	// are the branches
+	if (pCoverage && ((opcode >= OP_CALL && opcode <= OP_JLT) || isShortBranch(opcode)))
+		recordEdge(pc, PC);
+
+	return opcode;
+}
+
+// save the registers and RAM, and start tracking the pages that change
+void Cisc::saveSnapshot(Snapshot &snap)
+{
+	snap.regs = getState();
+	snap.ram.assign(ram, ram + sizeof(ram));
+
+	memset(dirtyPages, 0, sizeof(dirtyPages));
+	trackDirty = true;
+}
+
+// return to a saved snapshot, copying back only the RAM pages that changed
+void Cisc::restoreSnapshot(const Snapshot &snap)
+{
+	A = snap.regs.A;
+	CC = snap.regs.CC;
+	PC = snap.regs.PC;
+	SP = snap.regs.SP;
+	X = snap.regs.X;
+	Y = snap.regs.Y;
+
+	for (int page = 0; page < 0x100; page++)
+	{
+		if (dirtyPages[page])
+		{
+			memcpy(&ram[page << 8], &snap.ram[page << 8], 0x100);
+			dirtyPages[page] = 0;
+		}
+	}
+
+	faulted = false;
+	inputExhausted = false;
+	stackOverflowed = false;
+	vectorWritten = false;
 }
 
 // fetch a code byte value
@@ -1160,6 +1275,18 @@ uint16_t Cisc::fetchW()
 	return word;
 }
 
+// fetch the target of a branch, an absolute word or for the short branches
+// a signed byte displacement from the next instruction
+uint16_t Cisc::fetchBranch()
+{
+	if (!isShortBranch(opcode))
+		return fetchW();
+
+	int8_t disp = (int8_t)fetch();
+
+	return (uint16_t)(PC + disp);
+}
+
 // decode an instruction
 void Cisc::decode()
 {
@@ -1208,6 +1335,11 @@ void Cisc::interrupt(uint32_t vector)
 	if (vector == INT_VECTOR && TSTF(FLAG_I))
 		return;
 
+	pTask->interrupts++;
+
+	if (stackProfiling)
+		enterFrame(ram[vector] + (ram[vector + 1] << 8), SP, true);
+
 	// save the current context
 	pushAll();
 
@@ -1222,6 +1354,12 @@ void Cisc::interrupt(uint32_t vector)
 // something seriously unexpected happened
 void Cisc::panic()
 {
+	faulted = true;
+
+	// let the caller decide how to stop, e.g. the lockstep harness
+	if (trapPanics)
+		return;
+
 	puts("Panic!!!!!");
 	printRegisters();
 
@@ -1230,10 +1368,40 @@ void Cisc::panic()
 	exit(-1);
 }
 
+// read a whole file into memory
+bool readBinaryFile(const char *filename, std::vector<uint8_t> &data)
+{
+	FILE *f = fopen(filename, "rb");
+	if (nullptr == f)
+		return false;
+
+	data.clear();
+
+	uint8_t buf[4096];
+	size_t count;
+	while ((count = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + count);
+
+	fclose(f);
+	return true;
+}
+
 // show usage
 void usage()
 {
-	puts("\nusage: cisc [options] filename\n\n");
+	puts("\nusage: cisc [options] filename");
+	puts("       cisc -b filename inputs...\n");
+	puts("-b\trun the image once per input file");
+	puts("-e name\tengine for lockstep runs (default ref) or batch runs");
+	puts("-f dir\tfuzz the port 1 input, keeping the corpus and crashes in dir");
+	puts("-i file\tread port 1 input from file");
+	puts("-j count\tthreads for batch runs (default one per core)");
+	puts("-l\trun the image on two engines in lockstep");
+	puts("-n count\tinstruction limit for lockstep, fuzzer and batch runs");
+	puts("-r seed\trun random instruction streams in lockstep, no filename");
+	puts("-s\treport stack usage per PROC and per task");
+	puts("-t\treport per-task CPU usage of os.asm images");
+	puts("-x count\tstop fuzzing after count executions\n");
 	exit(0);
 }
 
@@ -1241,8 +1409,53 @@ void usage()
 int getopt(int n, char *args[])
 {
 	int i;
-	for (i = 1; args[i][0] == '-'; i++)
+	for (i = 1; args[i] && args[i][0] == '-'; i++)
 	{
+		if (args[i][1] == 'b')
+			g_bBatch = true;
+		else if (args[i][1] == 'e' && args[i + 1])
+		{
+			g_szEngine = args[i + 1];
+			i++;
+		}
+		else if (args[i][1] == 'f' && args[i + 1])
+		{
+			g_szCorpusDir = args[i + 1];
+			i++;
+		}
+		else if (args[i][1] == 'i' && args[i + 1])
+		{
+			g_szInputFile = args[i + 1];
+			i++;
+		}
+		else if (args[i][1] == 'j' && args[i + 1])
+		{
+			g_nThreads = (unsigned)strtoul(args[i + 1], nullptr, 10);
+			i++;
+		}
+		else if (args[i][1] == 'l')
+			g_bLockstep = true;
+		else if (args[i][1] == 'n' && args[i + 1])
+		{
+			g_nMaxSteps = strtoull(args[i + 1], nullptr, 10);
+			i++;
+		}
+		else if (args[i][1] == 'r' && args[i + 1])
+		{
+			g_bRandomLockstep = true;
+			g_nSeed = strtoull(args[i + 1], nullptr, 10);
+			i++;
+		}
+		else if (args[i][1] == 's')
+			g_bStackStats = true;
+		else if (args[i][1] == 't')
+			g_bTaskStats = true;
+		else if (args[i][1] == 'x' && args[i + 1])
+		{
+			g_nMaxExecs = strtoull(args[i + 1], nullptr, 10);
+			i++;
+		}
+
 		//if (args[i][1] == 'v')
 		//	g_bDebug = true;
 
@@ -1304,8 +1517,34 @@ int main(int argc, char* argv[])
 
 	int iFirstArg = getopt(argc, argv);
 
+	if (g_bRandomLockstep)
+		return runRandomLockstep(g_nSeed, g_szEngine ? g_szEngine : "ref", g_nPrograms, g_nMaxSteps);
+
+	if (!argv[iFirstArg])
+		usage();
+
+	if (g_bBatch)
+		return runBatch(argv[iFirstArg], &argv[iFirstArg + 1], argc - iFirstArg - 1, g_nMaxSteps, g_szEngine ? g_szEngine : "", g_nThreads);
+
+	// optional port 1 input
+	std::vector<uint8_t> input;
+	if (g_szInputFile && !readBinaryFile(g_szInputFile, input))
+	{
+		fprintf(stderr, "Unable to read input file '%s'!\n", g_szInputFile);
+		return -1;
+	}
+
+	if (g_bLockstep)
+		return runLockstep(argv[iFirstArg], g_szEngine ? g_szEngine : "ref", input, g_nMaxSteps);
+
+	if (g_szCorpusDir)
+		return runFuzzer(argv[iFirstArg], g_szCorpusDir, g_nMaxExecs, g_nMaxSteps);
+
 	cpu.load(argv[iFirstArg]);
 
+	if (g_szInputFile)
+		cpu.setInput(input.data(), input.size());
+
 	signal(SIGINT, sigint);
 
 #ifdef _WIN32
@@ -1332,6 +1571,10 @@ int main(int argc, char* argv[])
 				cpu.printRegisters();
 			else if (!strcmp(pToken, "q"))			// quit debugger
 				done = true;
+			else if (!strcmp(pToken, "t"))			// per-task CPU usage
+				cpu.printTaskStats();
+			else if (!strcmp(pToken, "st"))			// stack usage
+				cpu.printStackStats();
 			else if (!strcmp(pToken, "g"))			// go, run program
 			{
 				cpu.setCC(cpu.getCC() & ~FLAG_S);
@@ -1430,10 +1673,8 @@ int main(int argc, char* argv[])
 				auto pc = cpu.getPC();
 				if (cpu.isBreakpoint(pc))
 				{
-					std::string name;
-
-					cpu.getCodeSymbolName(pc, name);
-					fprintf(stdout, "breakpoint hit @ %s (" HEX_PREFIX  "%04X)\n", name.c_str(), pc);
+					auto name = cpu.getCodeSymbolName(pc);
+					fprintf(stdout, "breakpoint hit @ %s (" HEX_PREFIX  "%04X)\n", name ? name : "<none>", pc);
 
 					cpu.setCC(cpu.getCC() | FLAG_S);
 				}
@@ -1444,7 +1685,13 @@ int main(int argc, char* argv[])
 		
 	}
 
-	printf("Max stack depth: %d\n", cpu.getMaxStack());
+	printf("Max main stack depth: %d\n", cpu.getMaxStack());
+
+	if (g_bTaskStats)
+		cpu.printTaskStats();
+
+	if (g_bStackStats)
+		cpu.printStackStats();
 
 	return 0;
 }
\ No newline at end of file
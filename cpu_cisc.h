@@ -121,8 +121,78 @@ enum
 	// software interrupts
 	OP_BRK,		// breakpoint interrupt
 	OP_SWI,		// software interrupt
+
+	// short branches, an 8-bit signed displacement from the next instruction
+	OP_BSR,		// call a subroutine
+	OP_BRA,		// branch always
+	OP_BNE,		// branch if not equal
+	OP_BEQ,		// branch if equal
+	OP_BGT,		// branch if greater than
+	OP_BLT,		// branch if less than
+
+	OP_COUNT	// number of opcodes, must be last
 };
 
+//
+// Opcode mnemonics and the number of operand bytes that follow each opcode
+//
+struct OpcodeInfo
+{
+	const char *name;
+	int operandSize;
+};
+
+static const OpcodeInfo opcodeInfo[] =
+{
+	{ "NOP", 0 },
+	{ "ADD", 2 }, { "ADDI", 1 }, { "ADC", 2 }, { "ADCI", 1 },
+	{ "AAX", 0 }, { "AAY", 0 },
+	{ "SUB", 2 }, { "SUBI", 1 }, { "SBB", 2 }, { "SBBI", 1 },
+	{ "CMP", 2 }, { "CMPI", 1 },
+	{ "CMPX", 2 }, { "CMPXI", 2 },
+	{ "CMPY", 2 }, { "CMPYI", 2 },
+	{ "AND", 2 }, { "ANDI", 1 },
+	{ "OR", 2 }, { "ORI", 1 },
+	{ "NOT", 1 },
+	{ "XOR", 2 }, { "XORI", 1 },
+	{ "SHL", 1 }, { "SHR", 1 },
+	{ "CALL", 2 }, { "RET", 0 }, { "RTI", 0 },
+	{ "JMP", 2 }, { "JNE", 2 }, { "JEQ", 2 }, { "JGT", 2 }, { "JLT", 2 },
+	{ "LDA", 2 }, { "LDAI", 1 },
+	{ "LDX", 2 }, { "LDY", 2 }, { "LDXI", 2 }, { "LDYI", 2 },
+	{ "LEAX", 1 }, { "LEAY", 1 },
+	{ "LAX", 0 }, { "LAY", 0 },
+	{ "LXX", 0 }, { "LYY", 0 },
+	{ "STA", 2 }, { "STX", 2 }, { "STY", 2 },
+	{ "STAX", 0 }, { "STAY", 0 },
+	{ "STYX", 0 }, { "STXY", 0 },
+	{ "PUSH", 1 }, { "POP", 1 },
+	{ "OUT", 1 }, { "IN", 1 },
+	{ "BRK", 0 }, { "SWI", 0 },
+	{ "BSR", 1 }, { "BRA", 1 }, { "BNE", 1 }, { "BEQ", 1 }, { "BGT", 1 }, { "BLT", 1 },
+};
+
+static_assert(sizeof(opcodeInfo) / sizeof(opcodeInfo[0]) == OP_COUNT, "Opcode table out of sync!");
+
+// the short branches and the absolute branches they stand in for are in the
+// same order, CALL and JMP to JLT
+static inline bool isShortBranch(int op)	{ return op >= OP_BSR && op <= OP_BLT; }
+
+// the absolute branch that a short branch does the same as
+static inline int longBranchOf(int op)
+{
+	return op == OP_BSR ? OP_CALL : OP_JMP + (op - OP_BRA);
+}
+
+// the short branch for an absolute branch, or -1 if it has none
+static inline int shortBranchOf(int op)
+{
+	if (op == OP_CALL)
+		return OP_BSR;
+
+	return op >= OP_JMP && op <= OP_JLT ? OP_BRA + (op - OP_JMP) : -1;
+}
+
 //
 // Register bit definitions
 //
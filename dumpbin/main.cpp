@@ -124,9 +124,10 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
-	ObjectFile a;
+	// dumping only reads the file, so map it rather than loading a copy
+	ObjectFileView a;
 
-	a.readFile(argv[iFirstArg]);
+	a.open(argv[iFirstArg]);
 
 	if (!a.isValid())
 	{
@@ -144,6 +145,7 @@ int main(int argc, char *argv[])
 
 	// dump the header data
 	a.dumpHeader(stdout);
+	a.dumpDirectory(stdout);
 
 	// optionally dump the text segment
 	if (g_bDumpText)
@@ -0,0 +1,586 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "ln.h"
+#include "../archive.h"
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+//
+// Incremental linking
+//
+// A link made with -i saves where every module was placed, the symbols each
+// module defines and every external reference in a state file next to the
+// output. The next link only reads the modules that changed. If each one
+// still fits its slot and defines the same symbols, it is relocated and
+// copied over the old one in the image, and the references other modules
+// make to its symbols are patched.
+//
+
+// name of the state file of the output
+std::string linkStateName()
+{
+	return std::string(g_szOutputFilename) + ".state";
+}
+
+// get the size and modification time of a file
+static int fileStamp(const char *name, uint32_t &size, uint64_t &time)
+{
+	struct stat st;
+	if (stat(name, &st))
+		return EOF;
+
+	size = (uint32_t)st.st_size;
+	time = (uint64_t)st.st_mtime;
+
+	return 0;
+}
+
+//
+LinkState::LinkState()
+{
+	clear();
+}
+
+// reset the state
+void LinkState::clear()
+{
+	memset(&header, 0, sizeof(header));
+	header.ls_magic = LINKSTATE_MAGIC;
+
+	modules.clear();
+	symbols.clear();
+	sites.clear();
+	names.clear();
+}
+
+// add a name to the name table and return its offset
+uint32_t LinkState::addName(const char *name)
+{
+	uint32_t offset = names.size();
+	names.insert(names.end(), name, name + strlen(name) + 1);
+
+	return offset;
+}
+
+// find a symbol a module defines, returns EMPTY_SLOT if not found
+uint32_t LinkState::findSymbol(uint32_t module, const char *name) const
+{
+	auto &lm = modules[module];
+
+	for (auto i = lm.firstSymbol; i < lm.firstSymbol + lm.symbolCount; i++)
+	{
+		if (!strcmp(nameAt(symbols[i].nameOffset), name))
+			return i;
+	}
+
+	return EMPTY_SLOT;
+}
+
+// record the image relocations and external references of a relocated
+// module, its symbols must already be recorded
+void LinkState::captureModule(uint32_t index, const ObjectFile &module, const GlobalSymbolTable &table, std::vector<LinkSite> &out)
+{
+	auto &lm = modules[index];
+
+	lm.firstSite = out.size();
+	lm.relocCount = captureRelocs(index, SEG_TEXT, module, table, out);
+	lm.dataRelocCount = captureRelocs(index, SEG_DATA, module, table, out);
+	lm.siteCount = out.size() - lm.firstSite;
+}
+
+// record the external references in one segment of a module, returns the
+// number of relocations the module has in that segment of the image
+uint32_t LinkState::captureRelocs(uint32_t index, uint32_t segment, const ObjectFile &module, const GlobalSymbolTable &table, std::vector<LinkSite> &out)
+{
+	auto &relocs = SEG_DATA == segment ? module.getDataRelocs() : module.getTextRelocs();
+	auto base = SEG_DATA == segment ? module.getDataBase() - modules[0].dataBase : module.getTextBase() - header.ls_base;
+	uint32_t count = 0;
+
+	for (size_t i = 0; i < relocs.size(); i++)
+	{
+		// the first module keeps all of its relocations, the other modules
+		// only their segment ones
+		if (0 == index || !relocs[i].external)
+			count++;
+
+		if (!relocs[i].external)
+			continue;
+
+		auto name = module.symbolName(relocs[i].index);
+		auto def = table.find(name);
+		assert(def);
+
+		LinkSite site;
+		site.segment = segment;
+		site.offset = base + relocs[i].address;
+		site.symbol = findSymbol(def->module, name);
+		site.relocIndex = 0 == index ? (uint32_t)i : EMPTY_SLOT;
+		out.push_back(site);
+	}
+
+	return count;
+}
+
+// Record the layout of a full link, once the modules are relocated. The
+// linker meta object file is the last module.
+int LinkState::capture(const std::vector<ObjectFile*> &files, char *inputs[])
+{
+	clear();
+
+	header.ls_base = files[0]->getTextBase();
+	header.ls_padding = g_nPadding;
+	header.ls_format = g_nFormat;
+	header.ls_time = (uint64_t)time(nullptr);
+
+	modules.resize(files.size());
+
+	for (uint32_t m = 0; m < files.size(); m++)
+	{
+		auto module = files[m];
+		auto &lm = modules[m];
+
+		memset(&lm, 0, sizeof(lm));
+
+		if (m < files.size() - 1)
+		{
+			std::vector<uint8_t> buf;
+			if (readWholeFile(inputs[m], buf) || fileStamp(inputs[m], lm.fileSize, lm.fileTime))
+				return EOF;
+
+			lm.nameOffset = addName(inputs[m]);
+			lm.fileHash = hashBytes(buf.data(), buf.size());
+		}
+		else
+			lm.nameOffset = addName("");
+
+		lm.textBase = module->getTextBase();
+		lm.textSize = module->getTextSize();
+		lm.dataBase = module->getDataBase();
+		lm.dataSize = module->getDataSize();
+		lm.bssBase = module->getBssBase();
+		lm.bssSize = module->getBssSize();
+
+		// each slot is the distance to the next module
+		if (m < files.size() - 1)
+		{
+			lm.textSlot = files[m + 1]->getTextBase() - lm.textBase;
+			lm.dataSlot = files[m + 1]->getDataBase() - lm.dataBase;
+			lm.bssSlot = files[m + 1]->getBssBase() - lm.bssBase;
+		}
+		else
+		{
+			lm.textSlot = lm.textSize;
+			lm.dataSlot = lm.dataSize;
+			lm.bssSlot = lm.bssSize;
+		}
+
+		lm.firstSymbol = symbols.size();
+		for (size_t i = 0; i < module->getSymbolCount(); i++)
+		{
+			auto se = module->symbolAt(i);
+			if (se.type & SET_UNDEFINED)
+				continue;
+
+			LinkSymbol ls = { addName(module->symbolName(i)), m, se.type, se.value };
+			symbols.push_back(ls);
+		}
+
+		lm.symbolCount = symbols.size() - lm.firstSymbol;
+	}
+
+	GlobalSymbolTable table;
+	table.build(files);
+
+	uint32_t firstReloc = 0, firstDataReloc = 0;
+	for (uint32_t m = 0; m < files.size(); m++)
+	{
+		captureModule(m, *files[m], table, sites);
+
+		modules[m].firstReloc = firstReloc;
+		firstReloc += modules[m].relocCount;
+
+		modules[m].firstDataReloc = firstDataReloc;
+		firstDataReloc += modules[m].dataRelocCount;
+	}
+
+	return 0;
+}
+
+// Link again by replacing only the modules that changed since the state was
+// saved. Returns 0 once the image is updated, -1 if linking failed, or 1 if
+// a full link is needed.
+int LinkState::relink(char *inputs[], size_t count)
+{
+	auto start = (uint64_t)time(nullptr);
+	auto stateName = linkStateName();
+	if (readFile(stateName))
+	{
+		log(LOG_VERBOSE, "No link state in '%s', doing a full link\n", stateName.c_str());
+		return 1;
+	}
+
+	// the state must be for the same inputs and options
+	bool same = modules.size() == count + 1 && header.ls_base == g_bBaseAddr && header.ls_padding == (int)g_nPadding && header.ls_format == g_nFormat;
+	for (size_t i = 0; same && i < count; i++)
+		same = !strcmp(nameAt(modules[i].nameOffset), inputs[i]) && !isArchive(inputs[i]);
+
+	if (!same)
+	{
+		log(LOG_VERBOSE, "The inputs or options changed, doing a full link\n");
+		return 1;
+	}
+
+	// and the output must be the image the state describes
+	std::vector<uint8_t> imageBuf;
+	if (readWholeFile(g_szOutputFilename, imageBuf) || hashBytes(imageBuf.data(), imageBuf.size()) != header.ls_image)
+	{
+		log(LOG_VERBOSE, "'%s' is not the image of the link state, doing a full link\n", g_szOutputFilename);
+		return 1;
+	}
+
+	// find the modules that changed, a module is only read if its size or
+	// time changed, or its time is too close to the last link to tell
+	std::vector<ObjectFile> objects(modules.size());
+	std::vector<ObjectFile*> files(modules.size());
+	std::vector<bool> changed(modules.size(), false);
+	bool updated = false;
+
+	for (uint32_t m = 0; m < modules.size(); m++)
+	{
+		auto &lm = modules[m];
+		files[m] = &objects[m];
+
+		objects[m].setTextBase(lm.textBase);
+		objects[m].setDataBase(lm.dataBase);
+		objects[m].setBssBase(lm.bssBase);
+
+		if (m == count)
+			continue;
+
+		uint32_t size;
+		uint64_t time;
+		if (fileStamp(inputs[m], size, time))
+		{
+			log(LOG_ALWAYS, "Error: unable to read object file '%s'!\n", inputs[m]);
+			return -1;
+		}
+
+		if (size == lm.fileSize && time == lm.fileTime && time < header.ls_time)
+			continue;
+
+		std::vector<uint8_t> buf;
+		if (readWholeFile(inputs[m], buf))
+		{
+			log(LOG_ALWAYS, "Error: unable to read object file '%s'!\n", inputs[m]);
+			return -1;
+		}
+
+		auto hash = hashBytes(buf.data(), buf.size());
+
+		lm.fileSize = size;
+		lm.fileTime = time;
+		updated = true;
+
+		if (hash == lm.fileHash)
+			continue;
+
+		lm.fileHash = hash;
+		log(LOG_ALWAYS, "%s\n", inputs[m]);
+
+		if (objects[m].readBuffer(buf.data(), buf.size()))
+		{
+			log(LOG_ALWAYS, "Error: unable to read object file '%s'!\n", inputs[m]);
+			return -1;
+		}
+
+		auto &module = objects[m];
+		if (module.getTextSize() > lm.textSlot || module.getDataSize() > lm.dataSlot || module.getBssSize() > lm.bssSlot)
+		{
+			log(LOG_VERBOSE, "'%s' no longer fits its slot, doing a full link\n", inputs[m]);
+			return 1;
+		}
+
+		// the module must define the same symbols
+		std::vector<std::pair<std::string, uint32_t> > oldSymbols, newSymbols;
+		for (auto i = lm.firstSymbol; i < lm.firstSymbol + lm.symbolCount; i++)
+			oldSymbols.push_back(std::make_pair(std::string(nameAt(symbols[i].nameOffset)), symbols[i].type));
+
+		for (size_t i = 0; i < module.getSymbolCount(); i++)
+		{
+			auto se = module.symbolAt(i);
+			if (!(se.type & SET_UNDEFINED))
+				newSymbols.push_back(std::make_pair(std::string(module.symbolName(i)), se.type));
+		}
+
+		std::sort(oldSymbols.begin(), oldSymbols.end());
+		std::sort(newSymbols.begin(), newSymbols.end());
+
+		if (oldSymbols != newSymbols)
+		{
+			log(LOG_VERBOSE, "The symbols of '%s' changed, doing a full link\n", inputs[m]);
+			return 1;
+		}
+
+		module.setTextBase(lm.textBase);
+		module.setDataBase(lm.dataBase);
+		module.setBssBase(lm.bssBase);
+		if (0 == m)
+			module.updateBssSymbols();
+
+		changed[m] = true;
+	}
+
+	if (std::find(changed.begin(), changed.end(), true) == changed.end())
+	{
+		if (updated && writeFile(stateName))
+			log(LOG_ALWAYS, "Warning: unable to write '%s'\n", stateName.c_str());
+
+		log(LOG_ALWAYS, "\n%s is up to date\n\n", g_szOutputFilename);
+		return 0;
+	}
+
+	// the symbols of unchanged modules come from the state
+	GlobalSymbolTable table;
+	table.reset(files, symbols.size());
+
+	for (uint32_t m = 0; m < modules.size(); m++)
+	{
+		if (changed[m])
+		{
+			auto &module = objects[m];
+			for (size_t i = 0; i < module.getSymbolCount(); i++)
+			{
+				auto se = module.symbolAt(i);
+				if (!(se.type & SET_UNDEFINED))
+					table.define(module.symbolName(i), m, se.type, se.value);
+			}
+		}
+		else
+		{
+			auto &lm = modules[m];
+			for (auto i = lm.firstSymbol; i < lm.firstSymbol + lm.symbolCount; i++)
+				table.define(nameAt(symbols[i].nameOffset), m, symbols[i].type, symbols[i].value);
+		}
+	}
+
+	ObjectFile image;
+	if (image.readBuffer(imageBuf.data(), imageBuf.size()))
+		return 1;
+
+	image.setTextBase(header.ls_base);
+	image.setFormat(header.ls_format);
+
+	// replace the changed modules, the relocations of the later modules move
+	// when the number of relocations changes
+	log(LOG_VERBOSE, "Relinking changed modules\n");
+
+	uint32_t firstReloc = 0, firstDataReloc = 0;
+	std::vector<LinkSite> newSites;
+
+	for (uint32_t m = 0; m < modules.size(); m++)
+	{
+		auto &lm = modules[m];
+		lm.firstReloc = firstReloc;
+		lm.firstDataReloc = firstDataReloc;
+
+		if (changed[m])
+		{
+			auto &module = objects[m];
+			if (!module.relocate(table))
+			{
+				log(LOG_ALWAYS, "Linking failed.\n");
+				return -1;
+			}
+
+			image.replaceModule(m, module, table, firstReloc, lm.relocCount, firstDataReloc, lm.dataRelocCount, lm.textSlot, lm.dataSlot, lm.bssSize);
+			lm.textSize = module.getTextSize();
+			lm.dataSize = module.getDataSize();
+			lm.bssSize = module.getBssSize();
+
+			captureModule(m, module, table, newSites);
+		}
+		else
+		{
+			auto first = newSites.size();
+			newSites.insert(newSites.end(), sites.begin() + lm.firstSite, sites.begin() + lm.firstSite + lm.siteCount);
+			lm.firstSite = first;
+		}
+
+		firstReloc += lm.relocCount;
+		firstDataReloc += lm.dataRelocCount;
+	}
+
+	// patch the references to the symbols whose address changed
+	std::vector<uint32_t> moved;
+
+	for (uint32_t m = 0; m < modules.size(); m++)
+	{
+		if (!changed[m])
+			continue;
+
+		auto &lm = modules[m];
+		for (auto i = lm.firstSymbol; i < lm.firstSymbol + lm.symbolCount; i++)
+		{
+			auto name = nameAt(symbols[i].nameOffset);
+
+			SymbolEntity se;
+			objects[m].findSymbol(name, se);
+
+			// only the first definition of a name is referenced
+			if (table.find(name)->module == m && se.value != symbols[i].value)
+				moved.push_back(i);
+
+			symbols[i].value = se.value;
+		}
+	}
+
+	std::sort(moved.begin(), moved.end());
+
+	for (uint32_t m = 0; m < modules.size() && !moved.empty(); m++)
+	{
+		if (changed[m])
+			continue;
+
+		auto &lm = modules[m];
+		for (auto i = lm.firstSite; i < lm.firstSite + lm.siteCount; i++)
+		{
+			if (!std::binary_search(moved.begin(), moved.end(), newSites[i].symbol))
+				continue;
+
+			auto def = table.find(nameAt(symbols[newSites[i].symbol].nameOffset));
+			image.patchReference(newSites[i].segment, newSites[i].offset, newSites[i].relocIndex, table.addressOf(*def));
+		}
+	}
+
+	// write the image and then the state that describes it
+	if (image.writeFile(g_szOutputFilename, true))
+	{
+		log(LOG_ALWAYS, "Error: unable to write '%s'!\n", g_szOutputFilename);
+		return -1;
+	}
+
+	sites.swap(newSites);
+	header.ls_time = start;
+
+	if (save())
+		log(LOG_ALWAYS, "Warning: unable to write '%s'\n", stateName.c_str());
+
+	log(LOG_ALWAYS, "\nIncremental linking complete -> %s\n\n", g_szOutputFilename);
+
+	return 0;
+}
+
+// save the state next to the output file, which must be written first
+int LinkState::save()
+{
+	std::vector<uint8_t> buf;
+	if (readWholeFile(g_szOutputFilename, buf))
+		return EOF;
+
+	header.ls_image = hashBytes(buf.data(), buf.size());
+
+	return writeFile(linkStateName());
+}
+
+// read a link state file
+int LinkState::readFile(const std::string &name)
+{
+	clear();
+
+	std::vector<uint8_t> buf;
+	if (readWholeFile(name.c_str(), buf) || buf.size() < sizeof(header))
+		return EOF;
+
+	memcpy(&header, buf.data(), sizeof(header));
+
+	if (header.ls_magic != LINKSTATE_MAGIC || header.ls_modules < 1 || header.ls_symbols < 0 || header.ls_sites < 0 || header.ls_strsize < 1)
+	{
+		clear();
+		return EOF;
+	}
+
+	uint64_t size = sizeof(header);
+	size += (uint64_t)header.ls_modules * sizeof(LinkModule);
+	size += (uint64_t)header.ls_symbols * sizeof(LinkSymbol);
+	size += (uint64_t)header.ls_sites * sizeof(LinkSite);
+	size += header.ls_strsize;
+
+	if (size != buf.size())
+	{
+		clear();
+		return EOF;
+	}
+
+	const uint8_t *p = buf.data() + sizeof(header);
+
+	modules.resize(header.ls_modules);
+	memcpy(modules.data(), p, modules.size() * sizeof(LinkModule));
+	p += modules.size() * sizeof(LinkModule);
+
+	symbols.resize(header.ls_symbols);
+	if (!symbols.empty())
+		memcpy(symbols.data(), p, symbols.size() * sizeof(LinkSymbol));
+	p += symbols.size() * sizeof(LinkSymbol);
+
+	sites.resize(header.ls_sites);
+	if (!sites.empty())
+		memcpy(sites.data(), p, sites.size() * sizeof(LinkSite));
+	p += sites.size() * sizeof(LinkSite);
+
+	names.assign(p, p + header.ls_strsize);
+
+	// the tables must refer to each other and the names must be terminated
+	bool ok = names.back() == 0;
+
+	for (auto it = modules.begin(); ok && it != modules.end(); it++)
+	{
+		ok = it->nameOffset < names.size();
+		ok = ok && (uint64_t)it->firstSymbol + it->symbolCount <= symbols.size();
+		ok = ok && (uint64_t)it->firstSite + it->siteCount <= sites.size();
+	}
+
+	for (auto it = symbols.begin(); ok && it != symbols.end(); it++)
+		ok = it->nameOffset < names.size() && it->module < modules.size();
+
+	for (auto it = sites.begin(); ok && it != sites.end(); it++)
+		ok = it->symbol < symbols.size() && (it->segment == SEG_TEXT || it->segment == SEG_DATA);
+
+	if (!ok)
+	{
+		clear();
+		return EOF;
+	}
+
+	return 0;
+}
+
+// write out the link state, through a temp file which is renamed over the
+// target once it is complete
+int LinkState::writeFile(const std::string &name)
+{
+	header.ls_magic = LINKSTATE_MAGIC;
+	header.ls_modules = modules.size();
+	header.ls_symbols = symbols.size();
+	header.ls_sites = sites.size();
+	header.ls_strsize = names.size();
+
+	auto write = [this](FILE *f) {
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+		if (ok && !modules.empty())
+			ok = fwrite(modules.data(), modules.size() * sizeof(LinkModule), 1, f) == 1;
+		if (ok && !symbols.empty())
+			ok = fwrite(symbols.data(), symbols.size() * sizeof(LinkSymbol), 1, f) == 1;
+		if (ok && !sites.empty())
+			ok = fwrite(sites.data(), sites.size() * sizeof(LinkSite), 1, f) == 1;
+		if (ok && !names.empty())
+			ok = fwrite(names.data(), names.size(), 1, f) == 1;
+
+		return ok;
+	};
+
+	return writeFileAtomic(name, write);
+}
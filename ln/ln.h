@@ -0,0 +1,121 @@
+#pragma once
+
+#ifndef __LN_H
+#define __LN_H
+
+#include "../aout.h"
+#include <stdio.h>
+#include <vector>
+
+enum {
+	LOG_ALWAYS,
+	LOG_VERBOSE,
+	LOG_DEBUG,
+};
+
+//
+// Command line switches
+//
+extern uint16_t g_bBaseAddr;
+extern const char *g_szOutputFilename;
+extern uint32_t g_nPadding;
+extern int g_nFormat;
+
+void log(int level, const char *fmt, ...);
+
+// Define the link state header. An incremental link keeps the layout of the
+// image next to it so that the next link can replace the modules that
+// changed in place, instead of reading and relocating every module.
+//
+// The file is laid out as the header, the module table, the symbol table,
+// the external references and then the name table.
+struct LINKSTATE_HEADER
+{
+	int ls_magic;		// magic number
+	int ls_modules;		// number of modules, the linker meta object file is last
+	int ls_symbols;		// number of defined symbols
+	int ls_sites;		// number of external references
+	int ls_strsize;		// size of the name table
+	int ls_base;		// base address of the image
+	int ls_padding;		// bytes of padding in each module slot
+	int ls_format;		// FORMAT_xxx of the image
+	uint64_t ls_time;	// when the state was written
+	uint64_t ls_image;	// hash of the output file
+};
+
+// Validate the size of the link state header struct
+static_assert(sizeof(LINKSTATE_HEADER) == 48, "Invalid link state header size!");
+
+static const int LINKSTATE_MAGIC = 0x0A6B6C3C;	// "<lk\n"
+
+// Define the placement of a module in the image
+struct LinkModule
+{
+	uint32_t nameOffset;	// offset in the name table of the input file name
+	uint32_t fileSize;		// size of the input file
+	uint64_t fileTime;		// modification time of the input file
+	uint64_t fileHash;		// hash of the input file
+
+	uint32_t textBase, textSize, textSlot;
+	uint32_t dataBase, dataSize, dataSlot;
+	uint32_t bssBase, bssSize, bssSlot;
+
+	uint32_t firstReloc, relocCount;	// the module's text relocations in the image
+	uint32_t firstDataReloc, dataRelocCount;	// and its data relocations
+	uint32_t firstSymbol, symbolCount;	// the symbols the module defines
+	uint32_t firstSite, siteCount;		// the external references the module makes
+	uint32_t spare;
+};
+
+// Define a symbol defined by a module
+struct LinkSymbol
+{
+	uint32_t nameOffset;	// offset in the name table of the symbol name
+	uint32_t module;		// index of the defining module
+	uint32_t type;			// SET_xxx type of the symbol
+	uint32_t value;			// value of the symbol in the defining module
+};
+
+// Define an external reference, where the address of a symbol was patched
+struct LinkSite
+{
+	uint32_t segment;		// SEG_TEXT or SEG_DATA
+	uint32_t offset;		// offset in the image segment
+	uint32_t symbol;		// index of the first definition of the symbol
+	uint32_t relocIndex;	// the resolved relocation of the first module, or EMPTY_SLOT
+};
+
+// Define the link state class
+class LinkState
+{
+	LINKSTATE_HEADER header;
+
+	std::vector<LinkModule> modules;
+	std::vector<LinkSymbol> symbols;
+	std::vector<LinkSite> sites;
+	std::vector<char> names;
+
+	uint32_t addName(const char *name);
+	const char *nameAt(uint32_t offset) const { return &names[offset]; }
+
+	uint32_t findSymbol(uint32_t module, const char *name) const;
+	void captureModule(uint32_t index, const ObjectFile &module, const GlobalSymbolTable &table, std::vector<LinkSite> &out);
+	uint32_t captureRelocs(uint32_t index, uint32_t segment, const ObjectFile &module, const GlobalSymbolTable &table, std::vector<LinkSite> &out);
+
+public:
+	LinkState();
+
+	void clear();
+
+	int capture(const std::vector<ObjectFile*> &files, char *inputs[]);
+	int relink(char *inputs[], size_t count);
+
+	int save();
+
+	int readFile(const std::string &name);
+	int writeFile(const std::string &name);
+};
+
+std::string linkStateName();
+
+#endif // __LN_H
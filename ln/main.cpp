@@ -1,14 +1,14 @@
 #define _CRT_SECURE_NO_WARNINGS
 
-#include "../aout.h"
+#include "ln.h"
+#include "../archive.h"
 #include <stdio.h>
 #include <stdarg.h>
-
-enum {
-	LOG_ALWAYS,
-	LOG_VERBOSE,
-	LOG_DEBUG,
-};
+#include <string.h>
+#include <atomic>
+#include <functional>
+#include <set>
+#include <thread>
 
 //
 // Command line switches
@@ -16,16 +16,36 @@ enum {
 uint16_t g_bBaseAddr = 0;
 const char *g_szOutputFilename = "a.out";
 bool g_bDebug = false;
+bool g_bStream = false;
+bool g_bGcProcs = false;
+bool g_bIncremental = false;
+uint32_t g_nPadding = 32;
+int g_nFormat = FORMAT_AOUT;
+std::vector<const char*> g_keepSymbols;
+unsigned g_nThreads = 0;
+
+// the object files of the link allocate from an arena of the thread that
+// loads them, so the loader threads never share one. The arenas are freed
+// as a whole.
+std::vector<Arena*> g_arenas;
 
 //
 // show usage
 //
 void usage()
 {
-	puts("\nusage: ln [options] filename\n");
+	puts("\nusage: ln [options] filename... [library.a...]\n");
 	puts("-b 0000\tset base address");
+	puts("--gc-procs\tlink only the procedures reachable from the entry point");
+	puts("-i\tlink incrementally, only relinking the changed modules");
+	puts("-j n\tuse n threads, default is one per core");
+	puts("-k name\tkeep procedure name with --gc-procs");
 	puts("-o file\tset output filename");
-	puts("-v\tverbose output\n");
+	puts("-p n\tpad each module by n bytes for incremental links, default 32");
+	puts("-s\tstream modules from disk to bound memory use");
+	puts("-v\tverbose output");
+	puts("-x\twrite the extended object file format");
+	puts("-z\twrite the extended format, compacted\n");
 
 	exit(0);
 }
@@ -45,13 +65,51 @@ int getopt(int n, char *args[])
 		{
 			g_szOutputFilename = args[i + 1];
 			i++;
+			continue;
 		}
 
 		if (args[i][1] == 'b')
 		{
 			g_bBaseAddr = (uint16_t)atol(args[i + 1]);
 			i++;
+			continue;
+		}
+
+		if (args[i][1] == 's')
+			g_bStream = true;
+
+		if (args[i][1] == 'j')
+		{
+			g_nThreads = (unsigned)atol(args[i + 1]);
+			i++;
+			continue;
+		}
+
+		if (args[i][1] == 'i')
+			g_bIncremental = true;
+
+		if (args[i][1] == 'p')
+		{
+			g_nPadding = (uint32_t)atol(args[i + 1]);
+			i++;
+			continue;
+		}
+
+		if (args[i][1] == 'k')
+		{
+			g_keepSymbols.push_back(args[i + 1]);
+			i++;
+			continue;
 		}
+
+		if (args[i][1] == 'x')
+			g_nFormat = FORMAT_AOUTX;
+
+		if (args[i][1] == 'z')
+			g_nFormat = FORMAT_AOUTX_COMPACT;
+
+		if (!strcmp(args[i], "--gc-procs"))
+			g_bGcProcs = true;
 	}
 
 	return i;
@@ -71,6 +129,225 @@ void log(int level, const char *fmt, ...)
 		fputs(buf, stdout);
 }
 
+// the number of worker threads parallelFor() uses for count items
+size_t workerCount(size_t count)
+{
+	size_t threads = g_nThreads ? g_nThreads : std::thread::hardware_concurrency();
+	if (threads > count)
+		threads = count;
+
+	return threads ? threads : 1;
+}
+
+// run fn(0, worker) .. fn(count - 1, worker) on a pool of worker threads,
+// worker is the number of the thread below workerCount(count)
+void parallelFor(size_t count, const std::function<void(size_t, size_t)> &fn)
+{
+	size_t threads = workerCount(count);
+
+	std::atomic<size_t> next(0);
+	auto worker = [&](size_t t) {
+		for (size_t i = next++; i < count; i = next++)
+			fn(i, t);
+	};
+
+	if (threads <= 1)
+	{
+		worker(0);
+		return;
+	}
+
+	std::vector<std::thread> pool;
+	for (size_t t = 1; t < threads; t++)
+		pool.push_back(std::thread(worker, t));
+
+	worker(0);
+
+	for (auto it = pool.begin(); it != pool.end(); it++)
+		it->join();
+}
+
+// create a new arena for the object files of the link, only called from
+// the main thread
+Arena *newArena()
+{
+	g_arenas.push_back(new Arena());
+	return g_arenas.back();
+}
+
+// free the memory of all of the object files of the link in one step
+void releaseModules()
+{
+	size_t used = 0, blocks = 0;
+	for (auto it = g_arenas.begin(); it != g_arenas.end(); it++)
+	{
+		used += (*it)->getBytesUsed();
+		blocks += (*it)->getBlockCount();
+		delete *it;
+	}
+
+	log(LOG_VERBOSE, "Releasing %u KB of module memory in %u blocks\n", (unsigned)(used / 1024), (unsigned)blocks);
+	g_arenas.clear();
+}
+
+// Second pass of a streaming link. Each input is read in full, relocated
+// and written to its place in the output before the next one is read.
+// Modules without a source file, the archive members and the linker meta
+// object file, are already in memory.
+int linkStream(std::vector<ObjectFile*> &files, const GlobalSymbolTable &symbols, const std::vector<const char*> &sources)
+{
+	log(LOG_VERBOSE, "Streaming relocated modules to %s\n", g_szOutputFilename);
+
+	// returning on an error removes the partly written image
+	ImageWriter image;
+	if (image.open(g_szOutputFilename, files))
+	{
+		log(LOG_ALWAYS, "Error: unable to write '%s'!\n", g_szOutputFilename);
+		exit(-1);
+	}
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		ObjectFile module;
+		ObjectFile *pModule = files[i];
+
+		if (sources[i])
+		{
+			if (module.readFile(sources[i]))
+			{
+				log(LOG_ALWAYS, "Error: unable to read object file '%s'!\n", sources[i]);
+				return -1;
+			}
+
+			module.setTextBase(files[i]->getTextBase());
+			module.setDataBase(files[i]->getDataBase());
+			module.setBssBase(files[i]->getBssBase());
+			pModule = &module;
+		}
+
+		if (!pModule->relocate(symbols))
+		{
+			log(LOG_ALWAYS, "Linking failed.\n");
+			return -1;
+		}
+
+		if (image.writeModule(*pModule))
+		{
+			log(LOG_ALWAYS, "Error: unable to write '%s'!\n", g_szOutputFilename);
+			return -1;
+		}
+	}
+
+	// merge the symbols, the output takes its symbols from the first module
+	log(LOG_VERBOSE, "Merging symbols\n");
+	for (size_t i = 1; i < files.size(); i++)
+	{
+		files[0]->mergeSymbols(files[i]);
+		delete files[i];
+	}
+
+	log(LOG_VERBOSE, "Setting entry point to 0x%04X\n", g_bBaseAddr);
+	files[0]->setEntryPoint(g_bBaseAddr);
+	files[0]->setFormat(g_nFormat);
+
+	if (image.close(*files[0]))
+	{
+		log(LOG_ALWAYS, "Error: unable to write '%s'!\n", g_szOutputFilename);
+		return -1;
+	}
+
+	log(LOG_ALWAYS, "\nLinking complete -> %s\n\n", g_szOutputFilename);
+
+	delete files[0];
+	releaseModules();
+
+	return 0;
+}
+
+// add the names a module defines to the defined set, and the names it uses
+// but does not define to the list of wanted names
+void collectSymbols(ObjectFile *module, std::set<std::string> &defined, std::vector<std::string> &wanted)
+{
+	for (size_t i = 0; i < module->getSymbolCount(); i++)
+	{
+		if (module->symbolAt(i).type & SET_UNDEFINED)
+			wanted.push_back(module->symbolName(i));
+		else
+			defined.insert(module->symbolName(i));
+	}
+}
+
+// Pull in the archive members that define a wanted name, until the members
+// pulled in want no new names. The archives are searched in command line
+// order and the first one that defines a name supplies it. Names that no
+// archive defines are reported when the modules are relocated.
+int pullMembers(std::vector<ObjectFile*> &files, ObjectFile *meta, std::vector<Archive*> &archives, std::vector<const char*> &sources)
+{
+	std::set<std::string> defined;
+	std::vector<std::string> wanted;
+
+	for (auto it = files.begin(); it != files.end(); it++)
+		collectSymbols(*it, defined, wanted);
+
+	collectSymbols(meta, defined, wanted);
+
+	std::set<std::pair<size_t, int> > pulled;
+	Arena *arena = newArena();
+
+	for (size_t next = 0; next < wanted.size(); next++)
+	{
+		if (defined.count(wanted[next]))
+			continue;
+
+		for (size_t i = 0; i < archives.size(); i++)
+		{
+			int member = archives[i]->findMember(wanted[next].c_str());
+			if (member < 0 || !pulled.insert(std::make_pair(i, member)).second)
+				continue;
+
+			log(LOG_ALWAYS, "%s(%s)\n", archives[i]->memberName(member), wanted[next].c_str());
+
+			ObjectFile *module = new ObjectFile(arena);
+			if (archives[i]->readMember(member, *module))
+			{
+				log(LOG_ALWAYS, "Error: unable to read archive member '%s'!\n", archives[i]->memberName(member));
+				return -1;
+			}
+
+			files.push_back(module);
+			sources.push_back(nullptr);
+			collectSymbols(module, defined, wanted);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// Remove the procedures that can't be reached from the entry point, the
+// start of the first module, or from a procedure kept with -k. Interrupt
+// handlers are reached through the code that installs them.
+void gcProcs(std::vector<ObjectFile*> &files)
+{
+	log(LOG_VERBOSE, "\nRemoving unreachable procedures\n");
+
+	GlobalSymbolTable symbols;
+	symbols.build(files);
+
+	ProcGraph graph;
+	graph.build(files, symbols);
+	graph.addRoot(0, 0);
+
+	for (auto it = g_keepSymbols.begin(); it != g_keepSymbols.end(); it++)
+	{
+		if (!graph.addRoot(*it))
+			log(LOG_ALWAYS, "Warning: no procedure '%s' to keep\n", *it);
+	}
+
+	auto removed = graph.sweep();
+	log(LOG_VERBOSE, "Removed %u bytes of code\n", removed);
+}
+
 //
 int main(int argc, char* argv[])
 {
@@ -78,25 +355,96 @@ int main(int argc, char* argv[])
 		usage();
 
 	int iFirstArg = getopt(argc, argv);
+
+	// dead code elimination changes the modules so they must stay in memory
+	if (g_bGcProcs && g_bStream)
+	{
+		log(LOG_ALWAYS, "Warning: -s is ignored with --gc-procs\n");
+		g_bStream = false;
+	}
+	
+	if (g_bIncremental && (g_bGcProcs || g_bStream))
+	{
+		log(LOG_ALWAYS, "Warning: -i is ignored with -s and --gc-procs\n");
+		g_bIncremental = false;
+	}
 	
 	std::vector<ObjectFile*> files;
+	std::vector<Archive*> archives;
 
 	log(LOG_ALWAYS, "Linking...\n");
 
-	// loop over and load the input files
-	for (int i = iFirstArg; i < argc; i++)
+	size_t inputs = argc > iFirstArg ? argc - iFirstArg : 0;
+
+	// an incremental link only reads the modules that changed, it falls
+	// back to a full link that saves a new state
+	if (g_bIncremental)
+	{
+		LinkState state;
+		auto result = state.relink(argv + iFirstArg, inputs);
+		if (result <= 0)
+			return result;
+	}
+
+	// load the input files in parallel, then report them in order. When
+	// streaming only the symbols are loaded until the image is written.
+	// Archives only have their symbol index read.
+	std::vector<int> results(inputs);
+	std::vector<ObjectFile*> objects(inputs);
+	std::vector<Archive*> libraries(inputs);
+
+	// one arena per worker, made up front as the workers can't add to
+	// g_arenas
+	std::vector<Arena*> arenas(workerCount(inputs));
+	for (size_t t = 0; t < arenas.size(); t++)
+		arenas[t] = newArena();
+
+	parallelFor(inputs, [&](size_t i, size_t t) {
+		if (isArchive(argv[iFirstArg + i]))
+		{
+			libraries[i] = new Archive();
+			results[i] = libraries[i]->readIndex(argv[iFirstArg + i]);
+			return;
+		}
+
+		objects[i] = new ObjectFile(arenas[t]);
+		if (g_bStream)
+			results[i] = objects[i]->readSymbols(argv[iFirstArg + i]);
+		else
+			results[i] = objects[i]->readFile(argv[iFirstArg + i]);
+	});
+
+	// the source file of each module, for a streaming link
+	std::vector<const char*> sources;
+
+	for (size_t i = 0; i < inputs; i++)
 	{
-		log(LOG_ALWAYS, "%s\n", argv[i]);
+		log(LOG_ALWAYS, "%s\n", argv[iFirstArg + i]);
+
+		if (results[i])
+		{
+			log(LOG_ALWAYS, "Error: unable to read %s '%s'!\n", libraries[i] ? "archive" : "object file", argv[iFirstArg + i]);
+			exit(-1);
+		}
 
-		ObjectFile *pObj = new ObjectFile();
-		pObj->readFile(argv[i]);
+		if (libraries[i])
+			archives.push_back(libraries[i]);
+		else
+		{
+			files.push_back(objects[i]);
+			sources.push_back(g_bStream ? argv[iFirstArg + i] : nullptr);
+		}
+	}
 
-		files.push_back(pObj);
+	// the first module holds the entry point so it can't come from an archive
+	if (files.empty())
+	{
+		log(LOG_ALWAYS, "Error: no object files to link!\n");
+		exit(-1);
 	}
 
 	// create the linker meta object file
-	ObjectFile *pObj = new ObjectFile();
-	files.push_back(pObj);
+	ObjectFile *pObj = new ObjectFile(newArena());
 
 	// create variable for top of stack
 	SymbolEntity se;
@@ -110,19 +458,47 @@ int main(int argc, char* argv[])
 	se.type = SET_BSS;
 	pObj->addSymbol("__ram_start", se);
 
+	// link in the archive members the modules need, the meta object file
+	// stays last. The members aren't tracked by an incremental link.
+	if (!archives.empty())
+	{
+		if (g_bIncremental)
+		{
+			log(LOG_ALWAYS, "Warning: -i is ignored when linking archives\n");
+			g_bIncremental = false;
+		}
+
+		log(LOG_VERBOSE, "\nSearching archives\n");
+		if (pullMembers(files, pObj, archives, sources))
+			exit(-1);
+
+		for (auto it = archives.begin(); it != archives.end(); it++)
+			delete *it;
+	}
+
+	files.push_back(pObj);
+	sources.push_back(nullptr);
+
+	// drop the procedures that can't be reached, before the modules are placed
+	if (g_bGcProcs)
+		gcProcs(files);
+
 	// possibly adjust base code address...
 	files[0]->setTextBase(g_bBaseAddr);
 
-	// compute code and data segment starts
+	// an incremental link pads each module so that it can grow in place
+	uint32_t padding = g_bIncremental ? g_nPadding : 0;
+
+	// compute code and data segment starts, a prefix sum of the sizes
 	log(LOG_VERBOSE, "\nCompute data segment starts\n");
 	for (size_t i = 1; i < files.size(); i++)
 	{
 		uint32_t offset;
 
-		offset = files[i - 1]->getTextBase() + files[i-1]->getTextSize();
+		offset = files[i - 1]->getTextBase() + files[i-1]->getTextSize() + padding;
 		files[i]->setTextBase(offset);
 
-		offset = files[i - 1]->getDataBase() + files[i - 1]->getDataSize();
+		offset = files[i - 1]->getDataBase() + files[i - 1]->getDataSize() + padding;
 		files[i]->setDataBase(offset);
 	}
 
@@ -138,39 +514,78 @@ int main(int argc, char* argv[])
 		uint32_t offset;
 
 		// the BSS segments should stack at the end of the data segments
-		offset = files[i - 1]->getBssBase() + files[i - 1]->getBssSize();
+		offset = files[i - 1]->getBssBase() + files[i - 1]->getBssSize() + padding;
 		files[i]->setBssBase(offset);
 	}
 
-	// for each module, do relocs and inter-segment fixups
+	// index the symbols defined by all modules
+	GlobalSymbolTable symbols;
+	auto duplicates = symbols.build(files);
+	if (duplicates)
+		log(LOG_VERBOSE, "%d symbols are defined in more than one module\n", (int)duplicates);
+
+	if (g_bStream)
+		return linkStream(files, symbols, sources);
+
+	// for each module, do relocs and inter-segment fixups. A module only
+	// patches its own segments in place, without allocating from the arena
+	// it shares with other modules, so they can all be done at once.
 	log(LOG_VERBOSE, "Relocating symbols and external reference fixups\n");
-	for (size_t i = 0; i < files.size(); i++)
+	std::atomic<bool> relocated(true);
+	parallelFor(files.size(), [&](size_t i, size_t) {
+		if (!files[i]->relocate(symbols))
+			relocated = false;
+	});
+
+	if (!relocated)
 	{
-		if (!files[i]->relocate(files))
-		{
-			log(LOG_ALWAYS, "Linking failed.\n");
-			exit(-1);
-		}
+		log(LOG_ALWAYS, "Linking failed.\n");
+		exit(-1);
 	}
 
-	// merge the segments (AND the symbols!)
+	// record the layout before the modules are merged
+	LinkState state;
+	if (g_bIncremental && state.capture(files, argv + iFirstArg))
+	{
+		log(LOG_ALWAYS, "Warning: unable to save the link state\n");
+		g_bIncremental = false;
+	}
+
+	// merge the segments (AND the symbols!) into the first module, which is
+	// sized for the whole image up front. Each module is freed once merged.
 	log(LOG_VERBOSE, "Merging segments and symbols\n");
+	files[0]->beginConcat(files);
 	for (size_t i = 1; i < files.size(); i++)
 	{
 		files[0]->concat(files[i]);
+		delete files[i];
 	}
 
+	files[0]->endConcat();
+	files.resize(1);
+
 	// set the entry point
 	log(LOG_VERBOSE, "Setting entry point to 0x%04X\n", g_bBaseAddr);
 	files[0]->setEntryPoint(g_bBaseAddr);
+	files[0]->setFormat(g_nFormat);
 
 	// write the output file
-	files[0]->writeFile(g_szOutputFilename);
+	if (files[0]->writeFile(g_szOutputFilename, true))
+	{
+		log(LOG_ALWAYS, "Error: unable to write '%s'!\n", g_szOutputFilename);
+		exit(-1);
+	}
+
+	if (g_bIncremental && state.save())
+		log(LOG_ALWAYS, "Warning: unable to write '%s'\n", linkStateName().c_str());
 
 	log(LOG_ALWAYS, "\nLinking complete -> %s\n\n", g_szOutputFilename);
 
 	if (g_bDebug)
 		files[0]->dumpHeader(stdout);
 
+	delete files[0];
+	releaseModules();
+
 	return 0;
 }
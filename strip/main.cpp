@@ -9,6 +9,7 @@
 bool g_bStripAll = false;
 bool g_bStripRelocations = false;
 const char *g_szOutputFilename = "a.out";
+int g_nFormat = FORMAT_AOUT;
 
 //
 // show usage
@@ -18,7 +19,9 @@ void usage()
 	puts("\nusage: strip [options] filename\n");
 	puts("-a\tstrip all");
 	puts("-r\tstrip relocations");
-	puts("-o file\tset output filename\n");
+	puts("-o file\tset output filename");
+	puts("-x\twrite the extended object file format");
+	puts("-z\twrite the extended format, compacted\n");
 
 	exit(0);
 }
@@ -41,7 +44,14 @@ int getopt(int n, char *args[])
 		{
 			g_szOutputFilename = args[i + 1];
 			i++;
+			continue;
 		}
+
+		if (args[i][1] == 'x')
+			g_nFormat = FORMAT_AOUTX;
+
+		if (args[i][1] == 'z')
+			g_nFormat = FORMAT_AOUTX_COMPACT;
 	}
 
 	return i;
@@ -57,15 +67,24 @@ int main(int argc, char *argv[])
 
 	// read in the object file
 	ObjectFile obj;
-	obj.readFile(argv[iFirstArg]);
+	if (obj.readFile(argv[iFirstArg]))
+	{
+		printf("Unable to read object file '%s'!\n", argv[iFirstArg]);
+		return -1;
+	}
 
 	obj.stripSymbols();
 
 	if (g_bStripRelocations || g_bStripAll)
 		obj.stripRelocations();
 
-	// write out the object file
-	obj.writeFile(g_szOutputFilename);
+	// write out the object file, in a.out format unless asked otherwise
+	obj.setFormat(g_nFormat);
+	if (obj.writeFile(g_szOutputFilename, true))
+	{
+		printf("Unable to write '%s'!\n", g_szOutputFilename);
+		return -1;
+	}
 
 	printf("\nStrip complete -> %s\n\n", g_szOutputFilename);
 